@@ -0,0 +1,66 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace ufan::bench {
+
+// bumped by the global operator new replacement in main.cpp
+inline std::atomic<uint64_t> allocations{0};
+
+template <typename T> inline void do_not_optimize(T const& value) {
+    asm volatile("" : : "r,m"(value) : "memory");
+}
+
+class State {
+  private:
+    std::size_t m_iterations;
+    std::chrono::nanoseconds m_elapsed{0};
+    uint64_t m_allocations = 0;
+    std::size_t m_measured = 0;
+
+  public:
+    explicit State(std::size_t iterations) : m_iterations(iterations) {}
+
+    std::size_t iterations() const noexcept { return m_iterations; }
+    std::chrono::nanoseconds elapsed() const noexcept { return m_elapsed; }
+    uint64_t allocations() const noexcept { return m_allocations; }
+    std::size_t measured() const noexcept { return m_measured; }
+
+    // times iterations() calls of op; setup done before this is not counted
+    template <typename F> void measure(F&& op) {
+        const auto allocs_before =
+            bench::allocations.load(std::memory_order_relaxed);
+        const auto start = std::chrono::steady_clock::now();
+        for (std::size_t i = 0; i < m_iterations; i++)
+            op();
+        m_elapsed += std::chrono::steady_clock::now() - start;
+        m_allocations +=
+            bench::allocations.load(std::memory_order_relaxed) - allocs_before;
+        m_measured += m_iterations;
+    }
+};
+
+struct Case {
+    std::string name;
+    std::function<void(State&)> run;
+};
+
+inline std::vector<Case>& registry() {
+    static std::vector<Case> cases;
+    return cases;
+}
+
+struct Register {
+    Register(std::string name, std::function<void(State&)> run) {
+        registry().push_back({std::move(name), std::move(run)});
+    }
+};
+
+} // namespace ufan::bench
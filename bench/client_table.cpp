@@ -0,0 +1,93 @@
+#include "bench.hpp"
+
+#include <ufan/common/socket.hpp>
+#include <ufan/protocol/header.hpp>
+#include <ufan/server/client_table.hpp>
+
+#include <algorithm>
+#include <cstdint>
+#include <flat_map>
+#include <random>
+#include <string>
+#include <vector>
+
+// Client table under connect/disconnect churn: every op drops one client,
+// connects a new one and looks up a few existing ones, as a worker does
+// while subscribers restart.
+
+namespace {
+
+using ufan::common::Endpoint;
+
+struct FlatMapClient {
+    ufan::protocol::Topic topic{};
+    int64_t last_heartbeat = 0;
+    uint32_t slot = 0;
+};
+
+// n distinct endpoints in random order; different seeds never overlap
+std::vector<Endpoint> endpoints(std::size_t n, uint32_t seed) {
+    std::vector<Endpoint> out(n);
+    for (std::size_t i = 0; i < n; i++)
+        out[i] = Endpoint::ip_u32(0x0A000000 + (seed << 16) + i / 50000,
+                                  static_cast<uint16_t>(10000 + i % 50000));
+    std::shuffle(out.begin(), out.end(), std::mt19937(seed));
+    return out;
+}
+
+constexpr std::size_t lookups_per_op = 4;
+
+void client_table_churn(ufan::bench::State& state, std::size_t n) {
+    ufan::server::ClientTable table;
+    auto live = endpoints(n, 1);
+    for (const auto& ep : live)
+        table.insert(ep);
+    auto fresh = endpoints(state.iterations(), 2);
+
+    std::mt19937 rng(3);
+    std::size_t op = 0;
+    state.measure([&]() {
+        auto& victim = live[rng() % n];
+        table.erase(table.find(victim));
+        victim = fresh[op++];
+        auto [client, inserted] = table.insert(victim);
+        table.last_heartbeat(client) = op;
+        for (std::size_t i = 0; i < lookups_per_op; i++)
+            ufan::bench::do_not_optimize(table.find(live[rng() % n]));
+    });
+}
+
+void flat_map_churn(ufan::bench::State& state, std::size_t n) {
+    std::flat_map<Endpoint, FlatMapClient> table;
+    auto live = endpoints(n, 1);
+    for (const auto& ep : live)
+        table[ep];
+    auto fresh = endpoints(state.iterations(), 2);
+
+    std::mt19937 rng(3);
+    std::size_t op = 0;
+    state.measure([&]() {
+        auto& victim = live[rng() % n];
+        table.erase(victim);
+        victim = fresh[op++];
+        table[victim].last_heartbeat = op;
+        for (std::size_t i = 0; i < lookups_per_op; i++)
+            ufan::bench::do_not_optimize(table.find(live[rng() % n]));
+    });
+}
+
+struct Registrations {
+    Registrations() {
+        for (std::size_t n : {1000, 10000, 100000}) {
+            const auto suffix = "/" + std::to_string(n);
+            ufan::bench::Register(
+                "client_table/churn" + suffix,
+                [n](ufan::bench::State& state) { client_table_churn(state, n); });
+            ufan::bench::Register(
+                "flat_map/churn" + suffix,
+                [n](ufan::bench::State& state) { flat_map_churn(state, n); });
+        }
+    }
+} registrations;
+
+} // namespace
@@ -0,0 +1,287 @@
+#include "bench.hpp"
+
+#include <ufan/common/socket.hpp>
+#include <ufan/protocol/header.hpp>
+#include <ufan/protocol/message.hpp>
+#include <ufan/server/server.hpp>
+#include <ufan/server/stats.hpp>
+#include <ufan/server/subscription_table.hpp>
+
+#include <quill/Frontend.h>
+#include <quill/Logger.h>
+#include <quill/sinks/ConsoleSink.h>
+
+#include <cstddef>
+#include <cstdint>
+#include <filesystem>
+#include <optional>
+#include <span>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// One publish through a server worker, from the received datagram to the
+// queued fanout, with every synthetic client subscribed to the topic. The
+// worker runs on a fake IO that replays scripted datagrams and discards
+// sends, so only the broker's own work is timed.
+
+namespace {
+
+using ufan::common::Endpoint;
+
+class FakeIO {
+  private:
+    // kept so fd() has something to report to the wait strategy
+    ufan::common::Socket m_socket;
+    std::vector<Endpoint> m_from;
+    std::vector<std::vector<std::byte>> m_data;
+    std::size_t m_count = 0;
+    std::size_t m_delivered = 0;
+    uint64_t m_sent = 0;
+    // batched sends are checked against it when set
+    std::optional<ufan::protocol::Topic> m_expected;
+    uint64_t m_unexpected = 0;
+
+  public:
+    static constexpr const char* name = "fake";
+    static constexpr bool supports_gro = false;
+    // independent of the worker's batch size so setup takes few snapshots
+    static constexpr std::size_t capacity_ = 4096;
+
+    FakeIO(ufan::common::Socket socket, std::size_t)
+        : m_socket(std::move(socket)), m_from(capacity_), m_data(capacity_) {}
+
+    // scripts a datagram for the next recv(); false once the batch is full
+    bool deliver(const Endpoint& from, std::span<const std::byte> data) {
+        if (m_count == capacity_)
+            return false;
+        m_from[m_count] = from;
+        m_data[m_count].assign(data.begin(), data.end());
+        m_count++;
+        return true;
+    }
+
+    uint64_t sent() const noexcept { return m_sent; }
+
+    // counts batched sends whose topic isn't topic
+    void expect(ufan::protocol::Topic topic) { m_expected = topic; }
+    uint64_t unexpected() const noexcept { return m_unexpected; }
+
+    int fd() const noexcept { return m_socket.fd(); }
+    int send_fd() const noexcept { return m_socket.fd(); }
+
+    std::size_t recv() {
+        m_delivered = m_count;
+        m_count = 0;
+        return m_delivered;
+    }
+    std::size_t capacity() const noexcept { return capacity_; }
+
+    const Endpoint& from(std::size_t i) const noexcept { return m_from[i]; }
+    std::span<std::byte> data(std::size_t i) noexcept { return m_data[i]; }
+
+    std::size_t send_to(const Endpoint&, std::span<const std::byte>) {
+        m_sent++;
+        return 0;
+    }
+    std::size_t send_to(const Endpoint&, std::span<const std::byte>,
+                        std::span<const std::byte>) {
+        m_sent++;
+        return 0;
+    }
+    std::size_t send_batch(ufan::common::SendBatch& batch) {
+        const auto n = batch.size();
+        for (std::size_t i = 0; i < n; i++) {
+            const auto header =
+                ufan::protocol::MessageParser::header(batch.data(i));
+            if (m_expected && header.topic() != *m_expected)
+                m_unexpected++;
+            batch.set_result(i, ufan::common::SendResult::sent);
+        }
+        m_sent += n;
+        return n;
+    }
+};
+
+quill::Logger* silent_logger() {
+    auto* logger = quill::Frontend::create_or_get_logger(
+        "bench", quill::Frontend::create_or_get_sink<quill::ConsoleSink>(
+                     "default"));
+    // nothing is enqueued, so no backend thread is needed
+    logger->set_log_level(quill::LogLevel::None);
+    return logger;
+}
+
+// retransmit_slots > 0 adds sequencing: a copy into the ring per publish;
+// cache_bytes > 0 a copy into the last-value cache; journaled a copy into
+// the journal queue, written to a temporary directory by its own thread
+void fanout(ufan::bench::State& state, std::size_t n_clients,
+            uint64_t retransmit_slots, std::size_t cache_bytes = 0,
+            bool journaled = false) {
+    ufan::server::ServerConfig config;
+    config.retransmit_slots = retransmit_slots;
+    config.last_value_cache_bytes = cache_bytes;
+    ufan::server::SubscriptionTable table;
+    ufan::server::StatsBoard stats(1);
+    ufan::server::RetransmitRings rings(1, config.retransmit_slots,
+                                        config.retransmit_max_message, 1);
+    ufan::server::LastValueCache cache(1, config.last_value_cache_bytes,
+                                       config.last_value_eviction);
+    const auto journal_dir =
+        std::filesystem::temp_directory_path() / "ufan-bench-journal";
+    std::optional<ufan::server::Journal> journal;
+    if (journaled) {
+        std::filesystem::remove_all(journal_dir);
+        journal.emplace(journal_dir, config.journal_segment_bytes, 1,
+                        config.journal_queue_bytes);
+    }
+    ufan::server::Worker<FakeIO> worker(
+        0, Endpoint::ip("127.0.0.1", 0), config, table, stats, rings, cache,
+        journal ? &*journal : nullptr, silent_logger());
+    auto& io = worker.io();
+
+    ufan::protocol::MessageConstructor constructor;
+    const auto topic = ufan::protocol::Topic::from_string("a.b.c.d.e.f.g.h");
+
+    auto subscribe = constructor.construct(
+        ufan::protocol::Header::subscribe(topic));
+    for (std::size_t i = 0; i < n_clients; i++) {
+        const auto client =
+            Endpoint::ip_u32(0x0A000000 + static_cast<uint32_t>(i / 50000),
+                             static_cast<uint16_t>(10000 + i % 50000));
+        if (!io.deliver(client, subscribe)) {
+            worker.process();
+            io.deliver(client, subscribe);
+        }
+    }
+    worker.process();
+    // publishes the final snapshot
+    worker.process();
+
+    auto publish = constructor.construct(
+        ufan::protocol::Header::publish(topic),
+        std::string_view("0123456789abcdef0123456789abcdef"));
+    const auto publisher = Endpoint::ip("192.168.0.1", 9000);
+    const auto sent_before = io.sent();
+    state.measure([&]() {
+        io.deliver(publisher, publish);
+        worker.process();
+    });
+
+    if (io.sent() - sent_before != state.iterations() * n_clients)
+        throw std::runtime_error("fanout reached the wrong number of clients");
+    if (journal) {
+        journal.reset();
+        std::filesystem::remove_all(journal_dir);
+    }
+}
+
+// Two publishes to a subscriber around a full batch frame of publishes to
+// nobody, all in one recv. Every publish takes a ring slot, so the frame
+// laps a small ring before the worker's end-of-batch flush; the sends
+// queued for the first publish must not go out with a later slot's bytes.
+void sequenced_unmatched(ufan::bench::State& state) {
+    ufan::server::ServerConfig config;
+    config.retransmit_slots = 64;
+    ufan::server::SubscriptionTable table;
+    ufan::server::StatsBoard stats(1);
+    ufan::server::RetransmitRings rings(1, config.retransmit_slots,
+                                        config.retransmit_max_message, 1);
+    ufan::server::LastValueCache cache(1, 0, config.last_value_eviction);
+    ufan::server::Worker<FakeIO> worker(0, Endpoint::ip("127.0.0.1", 0),
+                                        config, table, stats, rings, cache,
+                                        nullptr, silent_logger());
+    auto& io = worker.io();
+
+    ufan::protocol::MessageConstructor constructor;
+    const auto topic = ufan::protocol::Topic::from_string("a.b.c.d.e.f.g.h");
+    io.deliver(Endpoint::ip("10.0.0.1", 10000),
+               constructor.construct(ufan::protocol::Header::subscribe(topic)));
+    worker.process();
+    worker.process();
+
+    ufan::protocol::BatchConstructor frame(65000);
+    const auto unmatched = ufan::protocol::Topic::from_string("x.y");
+    while (frame.append(unmatched, {}))
+        ;
+    const auto batch = frame.finish();
+    auto publish = constructor.construct(
+        ufan::protocol::Header::publish(topic),
+        std::string_view("0123456789abcdef0123456789abcdef"));
+
+    const auto publisher = Endpoint::ip("192.168.0.1", 9000);
+    io.expect(topic);
+    const auto sent_before = io.sent();
+    state.measure([&]() {
+        io.deliver(publisher, publish);
+        io.deliver(publisher, batch);
+        io.deliver(publisher, publish);
+        worker.process();
+    });
+
+    if (io.sent() - sent_before != state.iterations() * 2)
+        throw std::runtime_error("fanout reached the wrong number of clients");
+    if (io.unexpected())
+        throw std::runtime_error("a queued send went out with another "
+                                 "message's bytes");
+}
+
+// One subscribe and unsubscribe against n_clients standing subscriptions,
+// then the republish and refresh a worker's next loop does. The republish
+// replays the changes onto the spare snapshot, so this should not grow
+// with n_clients.
+void subscribe_churn(ufan::bench::State& state, std::size_t n_clients) {
+    ufan::server::SubscriptionTable table;
+    const auto topic = ufan::protocol::Topic::from_string("a.b.c.d.e.f.g.h");
+    for (std::size_t i = 0; i < n_clients; i++) {
+        const auto client = table.add_client(
+            Endpoint::ip_u32(0x0A000000 + static_cast<uint32_t>(i / 50000),
+                             static_cast<uint16_t>(10000 + i % 50000)));
+        table.subscribe(client, topic);
+    }
+    table.publish_if_dirty();
+    ufan::server::SubscriptionTable::Reader reader(table);
+
+    const auto churner = table.add_client(Endpoint::ip("192.168.0.1", 9000));
+    const auto other = ufan::protocol::Topic::from_string("x.y.z");
+    state.measure([&]() {
+        table.unsubscribe(table.subscribe(churner, other));
+        table.publish_if_dirty();
+        reader.refresh();
+    });
+}
+
+struct Registrations {
+    Registrations() {
+        for (std::size_t n : {10, 1000, 100000}) {
+            ufan::bench::Register(
+                "server/fanout/" + std::to_string(n),
+                [n](ufan::bench::State& state) { fanout(state, n, 0); });
+            ufan::bench::Register("server/fanout/sequenced/" +
+                                      std::to_string(n),
+                                  [n](ufan::bench::State& state) {
+                                      fanout(state, n, 65536);
+                                  });
+        }
+        ufan::bench::Register("server/fanout/cached/10",
+                              [](ufan::bench::State& state) {
+                                  fanout(state, 10, 0, 1 << 20);
+                              });
+        ufan::bench::Register("server/fanout/journaled/10",
+                              [](ufan::bench::State& state) {
+                                  fanout(state, 10, 0, 0, true);
+                              });
+        ufan::bench::Register("server/fanout/sequenced/unmatched-frame",
+                              sequenced_unmatched);
+        for (std::size_t n : {10, 1000, 100000}) {
+            ufan::bench::Register("server/subscribe-churn/" +
+                                      std::to_string(n),
+                                  [n](ufan::bench::State& state) {
+                                      subscribe_churn(state, n);
+                                  });
+        }
+    }
+} registrations;
+
+} // namespace
@@ -0,0 +1,53 @@
+#include "bench.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <new>
+#include <string_view>
+
+void* operator new(std::size_t size) {
+    ufan::bench::allocations.fetch_add(1, std::memory_order_relaxed);
+    if (void* p = std::malloc(size ? size : 1))
+        return p;
+    throw std::bad_alloc();
+}
+
+void operator delete(void* p) noexcept { std::free(p); }
+void operator delete(void* p, std::size_t) noexcept { std::free(p); }
+
+int main(int argc, char** argv) {
+    // usage: ufan-bench [name filter]
+    std::string_view filter = argc > 1 ? argv[1] : "";
+    constexpr auto min_time = std::chrono::milliseconds(200);
+
+    std::printf("%-44s %12s %14s %12s %12s\n", "benchmark", "ns/op", "ops/s",
+                "allocs/op", "iterations");
+    for (const auto& bench_case : ufan::bench::registry()) {
+        if (bench_case.name.find(filter) == std::string_view::npos)
+            continue;
+
+        // grow the iteration count until one run takes long enough to trust
+        std::size_t iterations = 1;
+        while (true) {
+            ufan::bench::State state(iterations);
+            bench_case.run(state);
+            if (state.elapsed() >= min_time || iterations >= (1ULL << 34) ||
+                state.measured() == 0) {
+                const double ops = state.measured() ? state.measured() : 1;
+                const double ns = state.elapsed().count() / ops;
+                std::printf("%-44s %12.2f %14.0f %12.3f %12zu\n",
+                            bench_case.name.c_str(), ns, ns > 0 ? 1e9 / ns : 0,
+                            state.allocations() / ops, state.measured());
+                break;
+            }
+            const auto elapsed = std::max<int64_t>(state.elapsed().count(), 1);
+            const auto scale =
+                std::clamp<double>(1.4 * min_time.count() * 1e6 / elapsed, 2,
+                                   100);
+            iterations = static_cast<std::size_t>(iterations * scale);
+        }
+    }
+    return 0;
+}
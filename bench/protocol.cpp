@@ -0,0 +1,194 @@
+#include "bench.hpp"
+
+#include <ufan/protocol/header.hpp>
+#include <ufan/protocol/message.hpp>
+#include <ufan/protocol/schema.hpp>
+#include <ufan/protocol/topic_match.hpp>
+
+#include <cstddef>
+#include <cstdint>
+#include <random>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// Per-message protocol work on both ends: topic matching and parsing on
+// the server and subscribers, construction on publishers.
+
+namespace {
+
+struct [[gnu::packed]] Quote {
+    int64_t sent_ns;
+    double bid;
+    double ask;
+    uint32_t size;
+};
+
+} // namespace
+
+template <> struct ufan::protocol::Schema<Quote> {
+    static constexpr uint32_t id = 1;
+    static constexpr uint16_t version = 1;
+};
+
+namespace {
+
+using ufan::protocol::Header;
+using ufan::protocol::MessageConstructor;
+using ufan::protocol::MessageParser;
+using ufan::protocol::Topic;
+
+// power of two so ops can index with a mask
+constexpr std::size_t n_samples = 1024;
+
+std::string random_topic_string(std::mt19937& rng) {
+    std::string out;
+    const auto levels = 1 + rng() % 8;
+    for (std::size_t level = 0; level < levels; level++) {
+        if (level)
+            out += '.';
+        switch (rng() % 8) {
+        case 0:
+            out += '*';
+            break;
+        case 1:
+            out += '>';
+            return out;
+        default:
+            for (auto n = 1 + rng() % 3; n > 0; n--)
+                out += static_cast<char>('a' + rng() % 8);
+        }
+    }
+    return out;
+}
+
+std::vector<Topic> random_topics(uint32_t seed) {
+    std::mt19937 rng(seed);
+    std::vector<Topic> out;
+    for (std::size_t i = 0; i < n_samples; i++)
+        out.push_back(Topic::from_string(random_topic_string(rng)));
+    return out;
+}
+
+void topic_matches(ufan::bench::State& state) {
+    auto published = random_topics(1);
+    auto subscribed = random_topics(2);
+    std::size_t i = 0;
+    state.measure([&]() {
+        const auto& a = published[i & (n_samples - 1)];
+        const auto& b = subscribed[(i * 7) & (n_samples - 1)];
+        ufan::bench::do_not_optimize(a.matches(b));
+        i++;
+    });
+}
+
+// one published topic against a subscriber's n patterns, as
+// Subscriber::match does, either a pattern per Topic::matches call or
+// through the vectorized find_match
+void topic_scan(ufan::bench::State& state, std::size_t n, bool vectorized) {
+    auto published = random_topics(1);
+    auto patterns = random_topics(2);
+    patterns.resize(n);
+    std::size_t i = 0;
+    state.measure([&]() {
+        const auto& topic = published[i++ & (n_samples - 1)];
+        std::size_t matched = 0;
+        if (vectorized) {
+            for (std::size_t at = 0;; at++) {
+                at = ufan::protocol::find_match(topic, patterns, at);
+                if (at == patterns.size())
+                    break;
+                matched++;
+            }
+        } else {
+            for (const auto& pattern : patterns)
+                matched += topic.matches(pattern);
+        }
+        ufan::bench::do_not_optimize(matched);
+    });
+}
+
+void topic_from_string(ufan::bench::State& state) {
+    std::mt19937 rng(1);
+    std::vector<std::string> strings;
+    for (std::size_t i = 0; i < n_samples; i++)
+        strings.push_back(random_topic_string(rng));
+    std::size_t i = 0;
+    state.measure([&]() {
+        ufan::bench::do_not_optimize(
+            Topic::from_string(strings[i++ & (n_samples - 1)]));
+    });
+}
+
+void message_construct(ufan::bench::State& state, std::size_t payload_size) {
+    MessageConstructor constructor;
+    std::vector<std::byte> payload(payload_size, std::byte{0x2a});
+    auto topic = Topic::from_string("a.b.c.d.e.f.g.h");
+    state.measure([&]() {
+        ufan::bench::do_not_optimize(constructor.construct(
+            Header::publish(topic), std::span<const std::byte>(payload)));
+    });
+}
+
+void message_parse(ufan::bench::State& state) {
+    MessageConstructor constructor;
+    auto message = constructor.construct(
+        Header::publish(Topic::from_string("a.b.c.d.e.f.g.h")),
+        std::string_view("0123456789abcdef0123456789abcdef"));
+    std::vector<std::byte> buffer(message.begin(), message.end());
+    std::span<const std::byte> data(buffer);
+    state.measure([&]() {
+        ufan::bench::do_not_optimize(MessageParser::header(data));
+        ufan::bench::do_not_optimize(
+            MessageParser::data<std::span<const std::byte>>(data));
+    });
+}
+
+// setting the fields of a typed message in its send buffer
+void schema_write(ufan::bench::State& state) {
+    ufan::protocol::TypedMessage<Quote> quote;
+    int64_t i = 0;
+    state.measure([&]() {
+        quote->sent_ns = i;
+        quote->bid = 1.5;
+        quote->ask = 1.75;
+        quote->size = 100;
+        ufan::bench::do_not_optimize(quote.buffer().data());
+        i++;
+    });
+}
+
+// checking a received payload's tag and reading a field in place
+void schema_read(ufan::bench::State& state) {
+    ufan::protocol::TypedMessage<Quote> quote;
+    quote->bid = 1.5;
+    auto payload = std::span<const std::byte>(quote.buffer())
+                       .subspan(ufan::protocol::HeaderRoom::size);
+    state.measure([&]() {
+        auto view = ufan::protocol::TypedView<Quote>::read(payload);
+        ufan::bench::do_not_optimize(view ? view->bid : 0.0);
+    });
+}
+
+struct Registrations {
+    Registrations() {
+        ufan::bench::Register("topic/matches", topic_matches);
+        ufan::bench::Register("topic/from_string", topic_from_string);
+        ufan::bench::Register(
+            "topic/scan/256",
+            [](ufan::bench::State& state) { topic_scan(state, 256, false); });
+        ufan::bench::Register(
+            "topic/find_match/256",
+            [](ufan::bench::State& state) { topic_scan(state, 256, true); });
+        for (std::size_t n : {32, 1024}) {
+            ufan::bench::Register(
+                "message/construct/" + std::to_string(n),
+                [n](ufan::bench::State& state) { message_construct(state, n); });
+        }
+        ufan::bench::Register("message/parse", message_parse);
+        ufan::bench::Register("schema/write", schema_write);
+        ufan::bench::Register("schema/read", schema_read);
+    }
+} registrations;
+
+} // namespace
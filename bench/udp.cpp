@@ -0,0 +1,114 @@
+#include "bench.hpp"
+
+#include <ufan/common/socket.hpp>
+#include <ufan/protocol/header.hpp>
+#include <ufan/protocol/message.hpp>
+
+#include <cstddef>
+#include <span>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+// Datagrams sent and received over loopback by one thread, so ns/op is the
+// kernel's per-datagram cost on one core at both ends. Runs of
+// burst equal-sized datagrams go out either one sendmmsg entry each or as
+// a single UDP_SEGMENT send, and come back either one recvmmsg slot each
+// or coalesced by UDP_GRO. Where the kernel lacks an offload its case
+// measures the fallback. The publish cases send one message at a time,
+// its header either copied in front of the payload or gathered with it.
+
+namespace {
+
+using ufan::common::Endpoint;
+using ufan::common::Socket;
+
+constexpr std::size_t burst = 64;
+constexpr std::size_t datagram_size = 256;
+
+enum class Offload { none, gso, gso_gro };
+
+void loopback(ufan::bench::State& state, Offload offload) {
+    auto receiver = Socket::open(/*non_blocking=*/true);
+    receiver.bind(Endpoint::ip("127.0.0.1", 0));
+    const auto to = receiver.local_endpoint();
+    auto sender = Socket::open(/*non_blocking=*/true);
+    if (offload != Offload::none)
+        sender.enable_gso();
+    if (offload == Offload::gso_gro)
+        receiver.enable_gro();
+
+    std::vector<std::byte> run(burst * datagram_size, std::byte{0x2a});
+    ufan::common::RecvBatch batch(burst, 65535);
+    std::size_t queued = 0;
+
+    state.measure([&]() {
+        if (++queued < burst)
+            return;
+        queued = 0;
+        if (sender.send_segments(to, run, datagram_size) != run.size())
+            throw std::runtime_error("short send");
+
+        std::size_t received = 0;
+        while (received < burst) {
+            const auto n = receiver.recv_batch(batch);
+            if (n == 0)
+                break;
+            for (std::size_t i = 0; i < n; i++) {
+                ufan::common::for_each_segment(
+                    batch.data(i), batch.segment_size(i),
+                    [&](auto) { received++; });
+            }
+        }
+        ufan::bench::do_not_optimize(received);
+    });
+}
+
+void publish(ufan::bench::State& state, std::size_t payload_size,
+             bool gather) {
+    auto receiver = Socket::open(/*non_blocking=*/true);
+    receiver.bind(Endpoint::ip("127.0.0.1", 0));
+    const auto to = receiver.local_endpoint();
+    auto sender = Socket::open(/*non_blocking=*/true);
+
+    const auto header = ufan::protocol::Header::publish(
+        ufan::protocol::Topic::from_string("a.b.c.d.e.f.g.h"));
+    std::vector<std::byte> payload(payload_size, std::byte{0x2a});
+    std::vector<std::byte> buf(65535);
+    ufan::protocol::MessageConstructor constructor;
+
+    state.measure([&]() {
+        if (gather)
+            sender.send_to(to, header.bytes(), payload);
+        else
+            sender.send_to(to, constructor.construct(header, payload));
+        ufan::bench::do_not_optimize(receiver.recv_from(buf));
+    });
+}
+
+struct Registrations {
+    Registrations() {
+        ufan::bench::Register(
+            "udp/loopback/sendmmsg",
+            [](ufan::bench::State& state) { loopback(state, Offload::none); });
+        ufan::bench::Register(
+            "udp/loopback/gso",
+            [](ufan::bench::State& state) { loopback(state, Offload::gso); });
+        ufan::bench::Register("udp/loopback/gso+gro",
+                              [](ufan::bench::State& state) {
+                                  loopback(state, Offload::gso_gro);
+                              });
+        for (std::size_t n : {64, 8192}) {
+            ufan::bench::Register("udp/publish/copy/" + std::to_string(n),
+                                  [n](ufan::bench::State& state) {
+                                      publish(state, n, false);
+                                  });
+            ufan::bench::Register("udp/publish/gather/" + std::to_string(n),
+                                  [n](ufan::bench::State& state) {
+                                      publish(state, n, true);
+                                  });
+        }
+    }
+} registrations;
+
+} // namespace
@@ -2,6 +2,8 @@
 
 #include <ufan/client.hpp>
 #include <ufan/common/interrupts.hpp>
+#include <ufan/common/journal.hpp>
+#include <ufan/common/wait.hpp>
 #include <ufan/protocol/message.hpp>
 
 #include <arpa/inet.h>
@@ -32,14 +34,19 @@ void print_usage(const char* prog) {
               << "  " << prog
               << " publish <server_ip>:<server_port> <topic> <data>\n"
               << "  " << prog
-              << " subscribe <server_ip>:<server_port> <topic>\n\n"
+              << " subscribe <server_ip>:<server_port>"
+                 " [--multicast <interface_ip>] <topic>...\n"
+              << "  " << prog << " stats <server_ip>:<server_port>\n"
+              << "  " << prog << " journal <dir>\n\n"
               << "Examples:\n"
               << "  " << prog
-              << " publish 127.0.0.1:42069 a.b.f.a.c.e.g.h \"hello\"\n"
-              << "  " << prog << " subscribe 127.0.0.1:42069 a.b.>\n\n"
+              << " publish 127.0.0.1:42069 prices.fx.eurusd \"hello\"\n"
+              << "  " << prog << " subscribe 127.0.0.1:42069 a.b.> c.*.d\n"
+              << "  " << prog
+              << " subscribe 127.0.0.1:42069 --multicast 127.0.0.1 a.b.>\n\n"
               << "Topic rules:\n"
               << "  - Up to 8 tokens separated by '.'\n"
-              << "  - Token is one of: [a-h]+, '*', or '>'\n"
+              << "  - Token is any text without '.', or '*', or '>'\n"
               << "  - '>' must be the last token\n";
 }
 
@@ -112,15 +119,6 @@ bool validate_topic(std::string_view topic, std::string& why_bad) {
             }
             continue;
         }
-
-        for (unsigned char c : tok) {
-            if (c < 'a' || c > 'h') {
-                why_bad = "token '" + tok + "' contains invalid char '" +
-                          std::string(1, static_cast<char>(c)) +
-                          "' (allowed: a..h, '*', '>')";
-                return false;
-            }
-        }
     }
 
     return true;
@@ -189,7 +187,8 @@ int run_publish(std::string_view endpoint_sv, std::string_view topic_sv,
     return 0;
 }
 
-int run_subscribe(std::string_view endpoint_sv, std::string_view topic_sv) {
+int run_subscribe(std::string_view endpoint_sv,
+                  std::span<char* const> topic_args) {
     auto ep = parse_endpoint(endpoint_sv);
     if (!ep) {
         std::cerr << "Invalid endpoint: '" << endpoint_sv
@@ -197,32 +196,143 @@ int run_subscribe(std::string_view endpoint_sv, std::string_view topic_sv) {
         return 2;
     }
 
-    std::string why_bad;
-    if (!validate_topic(topic_sv, why_bad)) {
-        std::cerr << "Invalid topic: '" << topic_sv << "' - " << why_bad
-                  << "\n";
-        return 2;
+    // joins the groups the server advertises, on the given interface
+    std::optional<std::string> multicast_interface;
+    if (!topic_args.empty() &&
+        std::string_view(topic_args[0]) == "--multicast") {
+        if (topic_args.size() < 3) {
+            std::cerr << "--multicast needs an interface ip and a topic\n";
+            return 2;
+        }
+        multicast_interface = topic_args[1];
+        topic_args = topic_args.subspan(2);
+    }
+
+    std::vector<std::string_view> topics(topic_args.begin(), topic_args.end());
+    for (auto topic_sv : topics) {
+        std::string why_bad;
+        if (!validate_topic(topic_sv, why_bad)) {
+            std::cerr << "Invalid topic: '" << topic_sv << "' - " << why_bad
+                      << "\n";
+            return 2;
+        }
     }
 
     Endpoint server = Endpoint::ip(ep->ip, ep->port);
-    Topic topic = Topic::from_string(std::string(topic_sv));
+    ufan::Subscriber sub(server);
+    if (multicast_interface)
+        sub.enable_multicast(*multicast_interface);
+
+    // subscription ids are handed out in order, so ids index topics
+    for (auto topic_sv : topics) {
+        sub.subscribe(Topic::from_string(std::string(topic_sv)));
+        std::cout << "subscribed to " << endpoint_sv << " topic=" << topic_sv
+                  << "\n";
+    }
+    std::cout << "(Ctrl-C to exit)\n";
 
-    ufan::Subscriber sub(server, topic);
+    // an interactive subscriber has no business spinning a core
+    ufan::common::WaitStrategy wait(
+        {.mode = ufan::common::WaitMode::spin_epoll, .spin_budget = 1000});
+    wait.watch(sub.fd());
 
-    std::cout << "subscribed to " << endpoint_sv << " topic=" << topic_sv
-              << " (Ctrl-C to exit)\n";
+    ufan::common::run_forever(
+        [&]() {
+            auto msg = sub.process<std::span<const std::byte>>();
+            if (!msg)
+                return false;
 
-    ufan::common::run_forever([&]() {
-        auto msg = sub.process<std::span<const std::byte>>();
-        if (!msg)
-            return;
+            auto bytes = msg->data;
+            std::cout << "---- message (" << bytes.size()
+                      << " bytes, topic=" << topics[msg->subscription]
+                      << ") ----\n";
+            print_bytes_hex_ascii(bytes);
+            std::cout.flush();
+            return true;
+        },
+        wait);
 
-        auto bytes = msg.value();
-        std::cout << "---- message (" << bytes.size() << " bytes) ----\n";
-        print_bytes_hex_ascii(bytes);
-        std::cout.flush();
-    });
+    return 0;
+}
 
+int run_journal(std::string_view dir) {
+    ufan::common::JournalReader reader{std::string(dir)};
+    std::size_t records = 0;
+    while (auto entry = reader.next()) {
+        const auto ip = entry->source.ip_host_order();
+        std::cout << "---- " << entry->time_ns << " from " << (ip >> 24)
+                  << "." << ((ip >> 16) & 0xff) << "." << ((ip >> 8) & 0xff)
+                  << "." << (ip & 0xff) << ":"
+                  << entry->source.port_host_order() << " ("
+                  << entry->payload.size()
+                  << " bytes, topic=" << entry->topic.to_string() << ") ----\n";
+        print_bytes_hex_ascii(entry->payload);
+        records++;
+    }
+    std::cout << records << " records\n";
+    return 0;
+}
+
+void print_histogram(const char* name, std::span<const uint64_t> buckets,
+                     const char* unit) {
+    std::cout << "  " << name << ":";
+    for (size_t i = 0; i < buckets.size(); ++i) {
+        if (buckets[i] == 0) {
+            continue;
+        }
+        // bucket i holds values below 2^i
+        std::cout << " <" << (i ? (1ULL << i) : 1) << unit << "=" << buckets[i];
+    }
+    std::cout << "\n";
+}
+
+int run_stats(std::string_view endpoint_sv) {
+    auto ep = parse_endpoint(endpoint_sv);
+    if (!ep) {
+        std::cerr << "Invalid endpoint: '" << endpoint_sv
+                  << "' (expected <ipv4>:<port>)\n";
+        return 2;
+    }
+
+    auto stats = ufan::query_stats(Endpoint::ip(ep->ip, ep->port));
+    if (!stats) {
+        std::cerr << "no reply from " << endpoint_sv << "\n";
+        return 1;
+    }
+
+    for (size_t w = 0; w < stats->size(); ++w) {
+        const auto& s = (*stats)[w];
+        std::cout << "worker " << w << "\n"
+                  << "  in:  " << s.datagrams_in << " datagrams, "
+                  << s.bytes_in << " bytes, " << s.recv_calls
+                  << " recv calls\n"
+                  << "  out: " << s.datagrams_out << " datagrams, "
+                  << s.bytes_out << " bytes, " << s.send_calls
+                  << " send calls\n"
+                  << "  errors: " << s.send_dropped << " dropped, "
+                  << s.send_errors << " send errors, " << s.parse_failures
+                  << " parse failures\n"
+                  << "  clients: " << s.connects << " connects, "
+                  << s.timeouts << " timeouts\n"
+                  << "  naks: " << s.naks << " received, " << s.retransmits
+                  << " retransmits, " << s.retransmit_misses << " misses\n"
+                  << "  egress: " << s.egress_queued << " queued, "
+                  << s.egress_dropped << " dropped, " << s.egress_conflated
+                  << " conflated, " << s.evictions << " evictions, "
+                  << s.egress_depth << " waiting\n"
+                  << "  cache: " << s.cache_values << " values, "
+                  << s.cache_bytes << " bytes, " << s.cache_evictions
+                  << " evictions, " << s.cache_replays << " replays\n"
+                  << "  journal: " << s.journaled << " records, "
+                  << s.journal_dropped << " dropped\n"
+                  << "  publishes: " << s.publishes << " (by root bucket:";
+        for (size_t k = 0; k < 8; ++k) {
+            std::cout << " " << k << "=" << s.publishes_by_root[k];
+        }
+        std::cout << ")\n";
+        print_histogram("fanout", s.fanout_sizes, "");
+        print_histogram("loop", s.loop_ns, "ns");
+    }
     return 0;
 }
 
@@ -246,11 +356,28 @@ int main(int argc, char** argv) {
         }
 
         if (mode == "subscribe") {
-            if (argc != 4) {
+            if (argc < 4) {
+                print_usage(argv[0]);
+                return 2;
+            }
+            return run_subscribe(argv[2],
+                                 std::span<char* const>(argv + 3, argc - 3));
+        }
+
+        if (mode == "stats") {
+            if (argc != 3) {
+                print_usage(argv[0]);
+                return 2;
+            }
+            return run_stats(argv[2]);
+        }
+
+        if (mode == "journal") {
+            if (argc != 3) {
                 print_usage(argv[0]);
                 return 2;
             }
-            return run_subscribe(argv[2], argv[3]);
+            return run_journal(argv[2]);
         }
 
         std::cerr << "Unknown command: " << mode << "\n";
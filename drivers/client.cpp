@@ -1,11 +1,26 @@
 #include <ufan/client.hpp>
 #include <ufan/common/interrupts.hpp>
 #include <ufan/common/socket.hpp>
-#include <ufan/protocol/message.hpp>
+#include <ufan/protocol/schema.hpp>
 
 #include <chrono>
+#include <cstdint>
 #include <iostream>
 
+namespace {
+
+struct [[gnu::packed]] Ping {
+    int64_t sent_ns;
+};
+
+} // namespace
+
+template <> struct ufan::protocol::Schema<Ping> {
+    static constexpr uint32_t id = 1;
+    static constexpr uint16_t version = 1;
+};
+UFAN_SCHEMA_FIELD(Ping, sent_ns, 0);
+
 int main() {
     auto server = ufan::common::Endpoint::ip("127.0.0.1", 42069);
 
@@ -15,6 +30,7 @@ int main() {
     ufan::Publisher publisher(server);
     ufan::Subscriber subscriber(server, topic_subscribe);
 
+    ufan::protocol::TypedMessage<Ping> ping;
     int64_t next_send = 0;
 
     ufan::common::run_forever([&]() {
@@ -23,25 +39,25 @@ int main() {
                 std::chrono::system_clock::now().time_since_epoch())
                 .count();
         if (time_now > next_send) {
-            int64_t time =
+            ping->sent_ns =
                 std::chrono::duration_cast<std::chrono::nanoseconds>(
                     std::chrono::system_clock::now().time_since_epoch())
                     .count();
-            publisher.publish(
-                topic_publish,
-                std::span<const std::byte>((std::byte*)&time, sizeof(int64_t)));
+            publisher.publish(topic_publish, ping);
             next_send = time_now + 1000;
         }
 
         auto message = subscriber.process<std::span<const std::byte>>();
-        if (message) {
-            auto recv = message.value();
-            int64_t time = *((int64_t*)recv.data());
+        if (!message)
+            return;
+        if (auto received =
+                ufan::protocol::TypedView<Ping>::read(message->data)) {
             int64_t recv_time =
                 std::chrono::duration_cast<std::chrono::nanoseconds>(
                     std::chrono::system_clock::now().time_since_epoch())
                     .count();
-            std::cout << (static_cast<double>(recv_time - time) * 0.001)
+            const auto latency_ns = recv_time - received->sent_ns;
+            std::cout << (static_cast<double>(latency_ns) * 0.001)
                       << std::endl;
         }
     });
@@ -0,0 +1,432 @@
+#include <ufan/client.hpp>
+#include <ufan/common/interrupts.hpp>
+#include <ufan/common/socket.hpp>
+#include <ufan/protocol/header.hpp>
+
+#include <algorithm>
+#include <atomic>
+#include <bit>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+#include <unistd.h>
+
+// Drives a running ufan-server with publisher and subscriber threads and
+// reports end-to-end latency, loss and throughput.
+//
+// Publisher i sends to topic i % topics and subscriber j subscribes to
+// topic j % topics, so every message has a known set of receivers. Each
+// payload carries the time it was due to be sent: with a fixed rate that is
+// the schedule, not the moment the send happened, so stalls in the
+// publisher show up as latency instead of silently lowering the rate.
+
+namespace {
+
+struct Config {
+    ufan::common::Endpoint server =
+        ufan::common::Endpoint::ip("127.0.0.1", 42069);
+    std::size_t publishers = 1;
+    std::size_t subscribers = 1;
+    std::size_t topics = 1;
+    // messages per second per publisher; 0 sends as fast as possible
+    uint64_t rate = 10000;
+    // messages sent back to back per scheduling tick
+    std::size_t burst = 1;
+    std::size_t payload_size = 32;
+    double duration_s = 5;
+    // pack each burst into batch frames with Publisher::queue
+    bool coalesce = false;
+    // with coalesce, send each burst as GSO runs instead of batch frames
+    bool gso = false;
+    // publish through shared-memory rings instead of the server
+    bool shm = false;
+    // subscribers' slow consumer policy; server_default leaves the server's
+    ufan::protocol::SlowConsumerPolicy policy =
+        ufan::protocol::SlowConsumerPolicy::server_default;
+};
+
+struct [[gnu::packed]] Payload {
+    uint32_t publisher;
+    uint64_t sequence;
+    int64_t sent_ns;
+};
+
+int64_t clock_now_ns() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+               std::chrono::steady_clock::now().time_since_epoch())
+        .count();
+}
+
+ufan::protocol::Topic topic_for(std::size_t index) {
+    // three levels of a..h, enough for 512 distinct topics
+    std::string name;
+    for (std::size_t level = 0; level < 3; level++) {
+        if (level)
+            name += '.';
+        name += static_cast<char>('a' + index % 8);
+        index /= 8;
+    }
+    return ufan::protocol::Topic::from_string(name);
+}
+
+// Log-linear histogram in the style of HdrHistogram: values below
+// sub_buckets are exact, and each power of two above that is split into
+// sub_buckets / 2 linear buckets, so any value is kept to within 1/64 of
+// itself.
+class Histogram {
+  private:
+    static constexpr unsigned sub_bits = 7;
+    static constexpr uint64_t sub_buckets = 1ULL << sub_bits;
+
+    std::vector<uint64_t> m_counts;
+    uint64_t m_total = 0;
+    uint64_t m_max = 0;
+
+    static std::size_t index_of(uint64_t value) noexcept {
+        if (value < sub_buckets)
+            return value;
+        const unsigned magnitude = std::bit_width(value) - sub_bits;
+        return (magnitude + 1) * sub_buckets / 2 +
+               (value >> magnitude) - sub_buckets / 2;
+    }
+
+    static uint64_t value_at(std::size_t index) noexcept {
+        if (index < sub_buckets)
+            return index;
+        const unsigned magnitude = index / (sub_buckets / 2) - 1;
+        const uint64_t sub = index % (sub_buckets / 2) + sub_buckets / 2;
+        // upper edge of the bucket
+        return ((sub + 1) << magnitude) - 1;
+    }
+
+  public:
+    Histogram() : m_counts(index_of(~0ULL) + 1, 0) {}
+
+    void record(uint64_t value) noexcept {
+        m_counts[index_of(value)]++;
+        m_total++;
+        m_max = std::max(m_max, value);
+    }
+
+    void merge(const Histogram& other) noexcept {
+        for (std::size_t i = 0; i < m_counts.size(); i++)
+            m_counts[i] += other.m_counts[i];
+        m_total += other.m_total;
+        m_max = std::max(m_max, other.m_max);
+    }
+
+    uint64_t count() const noexcept { return m_total; }
+    uint64_t max() const noexcept { return m_max; }
+
+    uint64_t percentile(double p) const noexcept {
+        if (m_total == 0)
+            return 0;
+        const auto rank = std::max<uint64_t>(
+            1, static_cast<uint64_t>(p / 100.0 * m_total + 0.5));
+        uint64_t seen = 0;
+        for (std::size_t i = 0; i < m_counts.size(); i++) {
+            seen += m_counts[i];
+            if (seen >= rank)
+                return std::min(value_at(i), m_max);
+        }
+        return m_max;
+    }
+};
+
+struct PublisherStats {
+    uint64_t sent = 0;
+    uint64_t failed = 0;
+};
+
+struct SubscriberStats {
+    Histogram latency_ns;
+    uint64_t received = 0;
+    uint64_t malformed = 0;
+    // only counted when the server sequences publishes
+    ufan::SequenceStats sequence;
+};
+
+std::string ring_name(std::size_t publisher) {
+    return "ufan-loadgen-" + std::to_string(::getpid()) + "-" +
+           std::to_string(publisher);
+}
+
+std::unique_ptr<ufan::Publisher> make_publisher(const Config& config,
+                                                std::size_t id) {
+    ufan::PublisherConfig publisher_config;
+    publisher_config.max_datagram = 1400;
+    publisher_config.max_delay_us = 0;
+    publisher_config.gso = config.gso;
+    if (config.shm) {
+        publisher_config.shm_ring = ring_name(id);
+        publisher_config.shm_slot_size =
+            static_cast<uint32_t>(config.payload_size + 64);
+        publisher_config.udp = false;
+    }
+    return std::make_unique<ufan::Publisher>(config.server, publisher_config);
+}
+
+void run_publisher(const Config& config, std::size_t id,
+                   ufan::Publisher& publisher,
+                   const std::atomic<bool>& running, PublisherStats& stats) {
+    const auto topic = topic_for(id % config.topics);
+
+    std::vector<std::byte> buffer(config.payload_size, std::byte{0});
+    Payload payload{static_cast<uint32_t>(id), 0, 0};
+
+    const int64_t tick_ns =
+        config.rate ? static_cast<int64_t>(1e9 * config.burst / config.rate)
+                    : 0;
+    int64_t next_tick = clock_now_ns();
+
+    while (running.load(std::memory_order_relaxed)) {
+        if (tick_ns) {
+            while (clock_now_ns() < next_tick) {
+                if (!running.load(std::memory_order_relaxed))
+                    return;
+            }
+        } else {
+            next_tick = clock_now_ns();
+        }
+
+        for (std::size_t i = 0; i < config.burst; i++) {
+            payload.sequence++;
+            payload.sent_ns = next_tick;
+            std::memcpy(buffer.data(), &payload, sizeof(payload));
+            const bool ok = config.coalesce
+                                ? publisher.queue(topic, buffer)
+                                : publisher.publish(topic, buffer);
+            if (ok)
+                stats.sent++;
+            else
+                stats.failed++;
+        }
+        if (config.coalesce && !publisher.flush())
+            stats.failed++;
+        next_tick += tick_ns;
+    }
+}
+
+void run_subscriber(const Config& config, std::size_t id,
+                    std::atomic<std::size_t>& ready,
+                    const std::atomic<bool>& running, SubscriberStats& stats) {
+    ufan::Subscriber subscriber(config.server, topic_for(id % config.topics));
+    if (config.shm) {
+        for (std::size_t i = 0; i < config.publishers; i++)
+            subscriber.attach(ring_name(i));
+    }
+    if (config.policy != ufan::protocol::SlowConsumerPolicy::server_default)
+        subscriber.set_slow_consumer_policy(config.policy);
+
+    while (!subscriber.subscribed()) {
+        if (!running.load(std::memory_order_relaxed))
+            return;
+        subscriber.drain([](const auto&) {});
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    ready.fetch_add(1);
+
+    while (running.load(std::memory_order_relaxed)) {
+        subscriber.drain<std::span<const std::byte>>([&](const auto& message) {
+            if (message.data.size() < sizeof(Payload)) {
+                stats.malformed++;
+                return;
+            }
+            Payload payload;
+            std::memcpy(&payload, message.data.data(), sizeof(payload));
+            const auto latency = clock_now_ns() - payload.sent_ns;
+            stats.latency_ns.record(std::max<int64_t>(latency, 0));
+            stats.received++;
+        });
+    }
+    stats.sequence = subscriber.sequence_stats();
+}
+
+void print_usage(const char* prog) {
+    std::cerr << "usage: " << prog
+              << " [--server ip:port] [--publishers N] [--subscribers N]"
+                 " [--topics N] [--rate msgs/s] [--burst N] [--size bytes]"
+                 " [--duration s] [--coalesce] [--gso] [--shm]"
+                 " [--policy drop-oldest|conflate|disconnect]\n"
+                 "  --rate is per publisher; 0 sends as fast as possible\n";
+}
+
+bool parse_args(int argc, char** argv, Config& config) {
+    for (int i = 1; i < argc; i++) {
+        std::string_view arg = argv[i];
+        if (arg == "--coalesce") {
+            config.coalesce = true;
+            continue;
+        }
+        if (arg == "--gso") {
+            config.coalesce = true;
+            config.gso = true;
+            continue;
+        }
+        if (arg == "--shm") {
+            config.shm = true;
+            continue;
+        }
+        if (i + 1 >= argc) {
+            std::cerr << "missing value for " << arg << "\n";
+            return false;
+        }
+        std::string value = argv[++i];
+        if (arg == "--server") {
+            const auto colon = value.rfind(':');
+            if (colon == std::string::npos)
+                return false;
+            config.server = ufan::common::Endpoint::ip(
+                value.substr(0, colon),
+                static_cast<uint16_t>(std::stoul(value.substr(colon + 1))));
+        } else if (arg == "--publishers") {
+            config.publishers = std::stoul(value);
+        } else if (arg == "--subscribers") {
+            config.subscribers = std::stoul(value);
+        } else if (arg == "--topics") {
+            config.topics = std::stoul(value);
+        } else if (arg == "--rate") {
+            config.rate = std::stoull(value);
+        } else if (arg == "--burst") {
+            config.burst = std::stoul(value);
+        } else if (arg == "--size") {
+            config.payload_size = std::stoul(value);
+        } else if (arg == "--duration") {
+            config.duration_s = std::stod(value);
+        } else if (arg == "--policy") {
+            auto policy =
+                ufan::protocol::slow_consumer_policy_from_string(value);
+            if (!policy) {
+                std::cerr << "--policy must be drop-oldest, conflate or"
+                             " disconnect\n";
+                return false;
+            }
+            config.policy = *policy;
+        } else {
+            std::cerr << "unknown option " << arg << "\n";
+            return false;
+        }
+    }
+    if (config.topics == 0 || config.topics > 512 || config.burst == 0) {
+        std::cerr << "--topics must be 1..512 and --burst at least 1\n";
+        return false;
+    }
+    config.payload_size = std::max(config.payload_size, sizeof(Payload));
+    return true;
+}
+
+} // namespace
+
+int main(int argc, char** argv) {
+    Config config;
+    if (!parse_args(argc, argv, config)) {
+        print_usage(argv[0]);
+        return 2;
+    }
+
+    std::atomic<bool> subscribers_running{true};
+    std::atomic<bool> publishers_running{true};
+    std::atomic<std::size_t> ready{0};
+
+    std::vector<SubscriberStats> subscriber_stats(config.subscribers);
+    std::vector<PublisherStats> publisher_stats(config.publishers);
+    std::vector<std::thread> subscribers;
+    std::vector<std::thread> publishers;
+
+    // created up front so subscribers can attach to their rings
+    std::vector<std::unique_ptr<ufan::Publisher>> publisher_handles;
+    for (std::size_t i = 0; i < config.publishers; i++)
+        publisher_handles.push_back(make_publisher(config, i));
+
+    for (std::size_t i = 0; i < config.subscribers; i++) {
+        subscribers.emplace_back([&, i]() {
+            run_subscriber(config, i, ready, subscribers_running,
+                           subscriber_stats[i]);
+        });
+    }
+
+    ufan::common::interrupts_impl::setup();
+    while (ready.load() < config.subscribers &&
+           ufan::common::interrupts_impl::should_run) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    std::cerr << "all " << config.subscribers
+              << " subscribers connected, publishing for "
+              << config.duration_s << "s\n";
+
+    const auto start = clock_now_ns();
+    for (std::size_t i = 0; i < config.publishers; i++) {
+        publishers.emplace_back([&, i]() {
+            run_publisher(config, i, *publisher_handles[i], publishers_running,
+                          publisher_stats[i]);
+        });
+    }
+
+    const auto end = start + static_cast<int64_t>(config.duration_s * 1e9);
+    while (clock_now_ns() < end && ufan::common::interrupts_impl::should_run)
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+
+    publishers_running.store(false);
+    for (auto& thread : publishers)
+        thread.join();
+    const double elapsed_s = (clock_now_ns() - start) * 1e-9;
+
+    // let in-flight messages land before counting them lost
+    std::this_thread::sleep_for(std::chrono::milliseconds(500));
+    subscribers_running.store(false);
+    for (auto& thread : subscribers)
+        thread.join();
+
+    // each subscriber should see every message published to its topic
+    std::vector<uint64_t> sent_per_topic(config.topics, 0);
+    uint64_t sent = 0;
+    uint64_t failed = 0;
+    for (std::size_t i = 0; i < config.publishers; i++) {
+        sent_per_topic[i % config.topics] += publisher_stats[i].sent;
+        sent += publisher_stats[i].sent;
+        failed += publisher_stats[i].failed;
+    }
+
+    Histogram latency;
+    uint64_t expected = 0;
+    uint64_t received = 0;
+    uint64_t malformed = 0;
+    ufan::SequenceStats sequence;
+    for (std::size_t i = 0; i < config.subscribers; i++) {
+        expected += sent_per_topic[i % config.topics];
+        received += subscriber_stats[i].received;
+        malformed += subscriber_stats[i].malformed;
+        sequence.gaps += subscriber_stats[i].sequence.gaps;
+        sequence.recovered += subscriber_stats[i].sequence.recovered;
+        sequence.unrecoverable += subscriber_stats[i].sequence.unrecoverable;
+        latency.merge(subscriber_stats[i].latency_ns);
+    }
+
+    const double loss =
+        expected ? 1.0 - static_cast<double>(received) / expected : 0.0;
+    std::printf("published   %llu msgs (%.0f msgs/s), %llu send failures\n",
+                (unsigned long long)sent, sent / elapsed_s,
+                (unsigned long long)failed);
+    std::printf("received    %llu of %llu expected (%.0f msgs/s), loss "
+                "%.4f%%, %llu malformed\n",
+                (unsigned long long)received, (unsigned long long)expected,
+                received / elapsed_s, loss * 100,
+                (unsigned long long)malformed);
+    std::printf("gaps        %llu msgs, %llu recovered, %llu unrecoverable\n",
+                (unsigned long long)sequence.gaps,
+                (unsigned long long)sequence.recovered,
+                (unsigned long long)sequence.unrecoverable);
+    std::printf("latency us  p50 %.1f  p99 %.1f  p99.9 %.1f  max %.1f\n",
+                latency.percentile(50) * 1e-3, latency.percentile(99) * 1e-3,
+                latency.percentile(99.9) * 1e-3, latency.max() * 1e-3);
+    return 0;
+}
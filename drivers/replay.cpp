@@ -0,0 +1,224 @@
+#include <ufan/client.hpp>
+#include <ufan/common/interrupts.hpp>
+#include <ufan/common/journal.hpp>
+#include <ufan/common/socket.hpp>
+#include <ufan/protocol/header.hpp>
+
+#include <algorithm>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <exception>
+#include <iostream>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+// Records traffic from a ufan-server and publishes it back with its timing.
+//
+// capture subscribes to everything, or to the given patterns, and appends
+// each message to a journal directory in the format the server's --journal
+// writes, so either kind of recording can be replayed. replay reads one
+// back and publishes every record at its recorded offset from the first,
+// divided by --speed, or back to back with --speed max. Sends are paced by
+// spinning on the clock: a sleep wakes tens of microseconds late, which
+// would smear the bursts the recording is there to reproduce.
+
+namespace {
+
+struct Config {
+    std::string mode;
+    std::string dir;
+    ufan::common::Endpoint server =
+        ufan::common::Endpoint::ip("127.0.0.1", 42069);
+    // playback rate relative to the recording; 0 is as fast as possible
+    double speed = 1;
+    std::size_t segment_bytes = 64 << 20;
+    std::vector<ufan::protocol::Topic> patterns;
+};
+
+int64_t clock_now_ns() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+               std::chrono::steady_clock::now().time_since_epoch())
+        .count();
+}
+
+int64_t wall_now_ns() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+               std::chrono::system_clock::now().time_since_epoch())
+        .count();
+}
+
+int run_capture(const Config& config) {
+    ufan::Subscriber subscriber(config.server);
+    if (config.patterns.empty()) {
+        // '>' only matches topics with all 8 levels, so take every depth
+        std::string pattern = "*";
+        for (std::size_t i = 0; i < ufan::protocol::Topic::levels; i++) {
+            subscriber.subscribe(ufan::protocol::Topic::from_string(pattern));
+            pattern += ".*";
+        }
+    }
+    for (const auto& pattern : config.patterns)
+        subscriber.subscribe(pattern);
+
+    ufan::common::JournalWriter writer(config.dir, config.segment_bytes);
+    while (!subscriber.subscribed() &&
+           ufan::common::interrupts_impl::should_run) {
+        subscriber.drain([](const auto&) {});
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    std::cerr << "capturing to " << config.dir << " segment "
+              << writer.segment() << ", ctrl-c to stop\n";
+
+    uint64_t captured = 0;
+    uint64_t bytes = 0;
+    ufan::common::run_forever([&]() {
+        subscriber.drain<std::span<const std::byte>>([&](const auto& message) {
+            writer.append(wall_now_ns(), config.server, message.topic,
+                          message.data);
+            captured++;
+            bytes += message.data.size();
+        });
+    });
+
+    std::printf("captured    %llu msgs, %llu payload bytes\n",
+                (unsigned long long)captured, (unsigned long long)bytes);
+    return 0;
+}
+
+int run_replay(const Config& config) {
+    ufan::common::JournalReader reader(config.dir);
+    ufan::Publisher publisher(config.server);
+    ufan::common::interrupts_impl::setup();
+
+    uint64_t sent = 0;
+    uint64_t failed = 0;
+    int64_t late_total_ns = 0;
+    int64_t late_max_ns = 0;
+    int64_t first_time_ns = 0;
+    int64_t recorded_ns = 0;
+    const auto start = clock_now_ns();
+
+    while (ufan::common::interrupts_impl::should_run) {
+        auto entry = reader.next();
+        if (!entry)
+            break;
+        if (sent + failed == 0)
+            first_time_ns = entry->time_ns;
+        // records from different server workers may be slightly out of
+        // order; those just go out at once
+        recorded_ns = std::max(recorded_ns, entry->time_ns - first_time_ns);
+
+        if (config.speed > 0) {
+            const auto due =
+                start + static_cast<int64_t>(
+                            (entry->time_ns - first_time_ns) / config.speed);
+            auto now = clock_now_ns();
+            while (now < due && ufan::common::interrupts_impl::should_run)
+                now = clock_now_ns();
+            const auto late = std::max<int64_t>(now - due, 0);
+            late_total_ns += late;
+            late_max_ns = std::max(late_max_ns, late);
+        }
+
+        if (publisher.publish(entry->topic, entry->payload))
+            sent++;
+        else
+            failed++;
+    }
+    const double elapsed_s = (clock_now_ns() - start) * 1e-9;
+
+    const auto total = sent + failed;
+    std::printf("replayed    %llu msgs in %.3fs (%.0f msgs/s), %llu send "
+                "failures\n",
+                (unsigned long long)sent, elapsed_s,
+                elapsed_s > 0 ? total / elapsed_s : 0.0,
+                (unsigned long long)failed);
+    std::printf("recorded    over %.3fs\n", recorded_ns * 1e-9);
+    if (config.speed > 0 && total) {
+        std::printf("pacing      late avg %.2fus max %.2fus\n",
+                    late_total_ns * 1e-3 / total, late_max_ns * 1e-3);
+    }
+    return 0;
+}
+
+void print_usage(const char* prog) {
+    std::cerr << "usage: " << prog
+              << " capture <dir> [--server ip:port] [--segment bytes]"
+                 " [pattern...]\n"
+              << "       " << prog
+              << " replay <dir> [--server ip:port] [--speed N|max]\n"
+                 "  capture subscribes to every topic unless given patterns"
+                 " (e.g. prices.*.>)\n"
+                 "  replay also reads journals written by ufan-server"
+                 " --journal\n";
+}
+
+bool parse_args(int argc, char** argv, Config& config) {
+    if (argc < 3)
+        return false;
+    config.mode = argv[1];
+    config.dir = argv[2];
+    if (config.mode != "capture" && config.mode != "replay") {
+        std::cerr << "unknown command " << config.mode << "\n";
+        return false;
+    }
+
+    for (int i = 3; i < argc; i++) {
+        std::string_view arg = argv[i];
+        if (!arg.starts_with("--")) {
+            if (config.mode != "capture") {
+                std::cerr << "unexpected argument " << arg << "\n";
+                return false;
+            }
+            config.patterns.push_back(ufan::protocol::Topic::from_string(arg));
+            continue;
+        }
+        if (i + 1 >= argc) {
+            std::cerr << "missing value for " << arg << "\n";
+            return false;
+        }
+        std::string value = argv[++i];
+        if (arg == "--server") {
+            const auto colon = value.rfind(':');
+            if (colon == std::string::npos)
+                return false;
+            config.server = ufan::common::Endpoint::ip(
+                value.substr(0, colon),
+                static_cast<uint16_t>(std::stoul(value.substr(colon + 1))));
+        } else if (arg == "--speed" && config.mode == "replay") {
+            config.speed = value == "max" ? 0 : std::stod(value);
+            if (config.speed < 0 || (config.speed == 0 && value != "max")) {
+                std::cerr << "--speed must be positive or max\n";
+                return false;
+            }
+        } else if (arg == "--segment" && config.mode == "capture") {
+            config.segment_bytes = std::stoull(value);
+        } else {
+            std::cerr << "unknown option " << arg << "\n";
+            return false;
+        }
+    }
+    return true;
+}
+
+} // namespace
+
+int main(int argc, char** argv) {
+    Config config;
+    try {
+        if (!parse_args(argc, argv, config)) {
+            print_usage(argv[0]);
+            return 2;
+        }
+        if (config.mode == "capture")
+            return run_capture(config);
+        return run_replay(config);
+    } catch (const std::exception& e) {
+        std::cerr << "error: " << e.what() << "\n";
+        return 1;
+    }
+}
@@ -1,184 +1,219 @@
-#include <ufan/common/interrupts.hpp>
 #include <ufan/common/socket.hpp>
-#include <ufan/protocol/message.hpp>
+#include <ufan/common/wait.hpp>
+#include <ufan/server/io.hpp>
+#include <ufan/server/server.hpp>
 
 #include <quill/Backend.h>
-#include <quill/Frontend.h>
-#include <quill/LogMacros.h>
-#include <quill/Logger.h>
-#include <quill/sinks/ConsoleSink.h>
-#include <quill/sinks/FileSink.h>
 
-#include <chrono>
-#include <cstddef>
-#include <flat_map>
+#include <algorithm>
+#include <charconv>
+#include <cstdint>
+#include <exception>
+#include <iostream>
+#include <iterator>
 #include <optional>
+#include <stdexcept>
 #include <string>
+#include <string_view>
+
+namespace {
+
+// the whole of value as a T; throws on anything else, including a trailing
+// suffix or a value out of T's range
+template <typename T> T number(std::string_view value) {
+    T out{};
+    const auto* end = value.data() + value.size();
+    auto [ptr, ec] = std::from_chars(value.data(), end, out);
+    if (ec != std::errc{} || ptr != end)
+        throw std::invalid_argument(std::string(value));
+    return out;
+}
 
-namespace ufan {
-
-class Server {
-  private:
-    struct ClientData {
-        protocol::Topic topic{};
-        int64_t last_heartbeat;
-
-        ClientData() { std::memset(topic.keys, 0, sizeof(topic.keys)); }
-    };
-
-    quill::Logger* m_logger;
-
-    quill::Logger* logger() { return m_logger; }
-    const quill::Logger* logger() const { return m_logger; }
-
-    common::Endpoint m_endpoint;
-    common::Socket m_socket;
-
-    protocol::MessageConstructor m_constructor;
-
-    std::vector<std::byte> m_recv_buf;
-    std::flat_map<ufan::common::Endpoint, ClientData> m_clients;
-
-    int64_t m_time_now;
-    static constexpr int64_t m_heartbeat_timeout = 10000;
-
-    void cache_time_now() {
-        m_time_now = std::chrono::duration_cast<std::chrono::milliseconds>(
-                         std::chrono::system_clock::now().time_since_epoch())
-                         .count();
+// <pattern>=<group ip>:<port>, e.g. a.b.>=239.1.1.1:43000
+std::optional<ufan::server::MulticastRoute>
+parse_multicast(std::string_view arg) {
+    const auto equals = arg.find('=');
+    const auto colon = arg.rfind(':');
+    if (equals == std::string_view::npos || colon == std::string_view::npos ||
+        colon < equals)
+        return std::nullopt;
+    try {
+        auto group = ufan::common::Endpoint::ip(
+            arg.substr(equals + 1, colon - equals - 1),
+            number<uint16_t>(arg.substr(colon + 1)));
+        if (!IN_MULTICAST(group.ip_host_order()))
+            return std::nullopt;
+        auto pattern = std::string(arg.substr(0, equals));
+        return ufan::server::MulticastRoute{
+            ufan::protocol::Topic::from_string(pattern), group};
+    } catch (const std::exception&) {
+        return std::nullopt;
     }
+}
 
-    int64_t time_now() const { return m_time_now; }
+// every option takes a value
+constexpr std::string_view options[] = {
+    "--port",
+    "--batch-size",
+    "--workers",
+    "--first-core",
+    "--io",
+    "--wait",
+    "--spin",
+    "--busy-poll-us",
+    "--gro",
+    "--multicast",
+    "--multicast-if",
+    "--multicast-ttl",
+    "--retransmit-slots",
+    "--retransmit-max-message",
+    "--egress-depth",
+    "--slow-consumer",
+    "--last-value-cache",
+    "--cache-eviction",
+    "--journal",
+    "--journal-segment",
+};
 
-    void send(const common::Endpoint& endpoint,
-              std::span<const std::byte> data) {
-        LOG_DEBUG(this->logger(), "[{}] < ({}) {} bytes", endpoint.id(),
-                  (char)protocol::MessageParser::header(data).type(),
-                  data.size());
-        m_socket.send_to(endpoint, data);
-    }
+void print_usage(const char* prog) {
+    std::cerr << "usage: " << prog
+              << " [--port N] [--batch-size N] [--workers N]"
+                 " [--first-core N] [--io uring|recvmmsg]"
+                 " [--wait busy|yield|epoll] [--spin N]"
+                 " [--busy-poll-us N] [--gro on|off]"
+                 " [--multicast PATTERN=GROUP:PORT]..."
+                 " [--multicast-if IP] [--multicast-ttl N]"
+                 " [--retransmit-slots N]"
+                 " [--retransmit-max-message BYTES]"
+                 " [--egress-depth N]"
+                 " [--slow-consumer drop-oldest|conflate|disconnect]"
+                 " [--last-value-cache BYTES]"
+                 " [--cache-eviction lru|reject]"
+                 " [--journal DIR] [--journal-segment BYTES]\n";
+}
 
-    void handle_heartbeat(const common::Endpoint& endpoint,
-                          std::span<const std::byte> data) {
-        if (m_clients.find(endpoint) == m_clients.end()) {
-            LOG_INFO(this->logger(), "[{}] connected", endpoint.id());
-        }
+} // namespace
 
-        auto& client_data = m_clients[endpoint];
-        client_data.last_heartbeat =
-            protocol::MessageParser::header(data).timestamp();
+int main(int argc, char** argv) {
+    uint16_t port = 42069;
+    ufan::server::ServerConfig config;
 
-        if (client_data.last_heartbeat > time_now()) {
-            client_data.last_heartbeat = time_now();
+    for (int i = 1; i < argc; i++) {
+        std::string_view arg = argv[i];
+        if (std::find(std::begin(options), std::end(options), arg) ==
+            std::end(options)) {
+            std::cerr << "unknown option " << arg << "\n";
+            print_usage(argv[0]);
+            return 2;
         }
-
-        send(endpoint,
-             m_constructor.construct(
-                 protocol::Header::heartbeat(client_data.last_heartbeat),
-                 std::span<const std::byte>((std::byte*)&client_data.topic,
-                                            sizeof(client_data.topic))));
-    }
-
-    void handle_subscribe(const common::Endpoint& endpoint,
-                          std::span<const std::byte> data) {
-        if (m_clients.find(endpoint) == m_clients.end()) {
-            LOG_INFO(this->logger(), "[{}] connected", endpoint.id());
+        if (i + 1 >= argc) {
+            std::cerr << "missing value for " << arg << "\n";
+            return 2;
         }
-        auto topic = protocol::MessageParser::header(data).topic();
-
-        LOG_INFO(this->logger(), "[{}] subscribed to {}.{}.{}.{}.{}.{}.{}.{}",
-                 endpoint.id(), topic.keys[0], topic.keys[1], topic.keys[2],
-                 topic.keys[3], topic.keys[4], topic.keys[5], topic.keys[6],
-                 topic.keys[7]);
-
-        auto& client_data = m_clients[endpoint];
-        client_data.topic = topic;
-        send(endpoint,
-             m_constructor.construct(
-                 protocol::Header::heartbeat(time_now()),
-                 std::span<const std::byte>((std::byte*)&client_data.topic,
-                                            sizeof(client_data.topic))));
-    }
-
-    void handle_publish(const common::Endpoint& endpoint,
-                        std::span<const std::byte> data) {
-        auto to_publish = protocol::MessageParser::data<std::string_view>(data);
-        auto topic = protocol::MessageParser::header(data).topic();
-
-        for (auto it = m_clients.begin(); it != m_clients.end();) {
-            const auto& [endpoint, client_data] = *it;
-
-            if ((time_now() - client_data.last_heartbeat) >
-                m_heartbeat_timeout) {
-                LOG_INFO(this->logger(), "[{}] timed out", endpoint.id());
-                it = m_clients.erase(it);
-                continue;
-            }
-
-            if (client_data.topic.matches(topic)) {
-                send(endpoint,
-                     m_constructor.construct(protocol::Header::publish(topic),
-                                             to_publish));
+        try {
+            if (arg == "--port") {
+                port = number<uint16_t>(argv[++i]);
+            } else if (arg == "--batch-size") {
+                config.batch_size = number<std::size_t>(argv[++i]);
+            } else if (arg == "--workers") {
+                config.workers = number<std::size_t>(argv[++i]);
+            } else if (arg == "--first-core") {
+                config.first_core = number<int>(argv[++i]);
+            } else if (arg == "--io") {
+                std::string_view io = argv[++i];
+                if (io != "uring" && io != "recvmmsg") {
+                    std::cerr << "--io must be uring or recvmmsg\n";
+                    return 2;
+                }
+                config.io_uring = io == "uring";
+            } else if (arg == "--wait") {
+                auto mode = ufan::common::wait_mode_from_string(argv[++i]);
+                if (!mode) {
+                    std::cerr << "--wait must be busy, yield or epoll\n";
+                    return 2;
+                }
+                config.wait.mode = *mode;
+            } else if (arg == "--spin") {
+                config.wait.spin_budget = number<uint32_t>(argv[++i]);
+            } else if (arg == "--busy-poll-us") {
+                config.busy_poll_us = number<int>(argv[++i]);
+            } else if (arg == "--gro") {
+                std::string_view gro = argv[++i];
+                if (gro != "on" && gro != "off") {
+                    std::cerr << "--gro must be on or off\n";
+                    return 2;
+                }
+                config.gro = gro == "on";
+            } else if (arg == "--multicast") {
+                auto route = parse_multicast(argv[++i]);
+                if (!route) {
+                    std::cerr << "--multicast must be <pattern>=<group "
+                                 "ip>:<port> with a multicast group\n";
+                    return 2;
+                }
+                config.multicast.push_back(*route);
+            } else if (arg == "--multicast-if") {
+                config.multicast_interface = argv[++i];
+            } else if (arg == "--multicast-ttl") {
+                config.multicast_ttl = number<int>(argv[++i]);
+            } else if (arg == "--retransmit-slots") {
+                config.retransmit_slots = number<uint64_t>(argv[++i]);
+            } else if (arg == "--retransmit-max-message") {
+                config.retransmit_max_message =
+                    number<std::size_t>(argv[++i]);
+            } else if (arg == "--egress-depth") {
+                config.egress_queue_depth = number<std::size_t>(argv[++i]);
+            } else if (arg == "--slow-consumer") {
+                auto policy =
+                    ufan::protocol::slow_consumer_policy_from_string(argv[++i]);
+                if (!policy) {
+                    std::cerr << "--slow-consumer must be drop-oldest, conflate"
+                                 " or disconnect\n";
+                    return 2;
+                }
+                config.slow_consumer_policy = *policy;
+            } else if (arg == "--last-value-cache") {
+                config.last_value_cache_bytes =
+                    number<std::size_t>(argv[++i]);
+            } else if (arg == "--cache-eviction") {
+                auto eviction =
+                    ufan::server::cache_eviction_from_string(argv[++i]);
+                if (!eviction) {
+                    std::cerr << "--cache-eviction must be lru or reject\n";
+                    return 2;
+                }
+                config.last_value_eviction = *eviction;
+            } else if (arg == "--journal") {
+                config.journal_dir = argv[++i];
+            } else if (arg == "--journal-segment") {
+                config.journal_segment_bytes =
+                    number<std::size_t>(argv[++i]);
             }
-            ++it;
+        } catch (const std::exception&) {
+            std::cerr << "invalid value " << argv[i] << " for " << arg
+                      << "\n";
+            print_usage(argv[0]);
+            return 2;
         }
     }
 
-    void process() {
-        auto info_opt = m_socket.recv_from(m_recv_buf);
-        if (!info_opt.has_value())
-            return;
-
-        cache_time_now();
-
-        const auto& info = info_opt.value();
-        std::span<const std::byte> buf(m_recv_buf.data(), info.size);
+    quill::Backend::start();
+    auto endpoint = ufan::common::Endpoint::ip("0.0.0.0", port);
 
+    if (config.io_uring) {
+        std::optional<ufan::server::Server<ufan::server::UringIO>> server;
         try {
-            auto header = protocol::MessageParser::header(buf);
-            LOG_DEBUG(this->logger(), "[{}] > ({}) {} bytes", info.from.id(),
-                      (char)header.type(), info.size);
-
-            switch (header.type()) {
-            case protocol::MessageType::heartbeat:
-                handle_heartbeat(info.from, buf);
-                break;
-            case protocol::MessageType::subscribe:
-                handle_subscribe(info.from, buf);
-                break;
-            case protocol::MessageType::publish:
-                handle_publish(info.from, buf);
-                break;
-            default:
-                break;
-            }
+            server.emplace(endpoint, config);
         } catch (const std::exception& e) {
-            LOG_ERROR(this->logger(), "parse failed with {}", e.what());
+            std::cerr << "io_uring unavailable (" << e.what()
+                      << "), falling back to recvmmsg\n";
+        }
+        if (server) {
+            server->run();
+            return 0;
         }
     }
 
-  public:
-    Server(common::Endpoint endpoint)
-        : m_logger(quill::Frontend::create_or_get_logger(
-              "server", quill::Frontend::create_or_get_sink<quill::ConsoleSink>(
-                            "default"))),
-          m_endpoint(endpoint),
-          m_socket(common::Socket::open(/*non_blocking=*/true)) {
-        m_socket.bind(m_endpoint);
-        m_recv_buf.resize(65535);
-    }
-
-    void run() {
-        LOG_INFO(this->logger(), "starting server");
-        common::run_forever([&]() { this->process(); });
-        LOG_INFO(this->logger(), "stopping server");
-    }
-};
-
-} // namespace ufan
-
-int main() {
-    quill::Backend::start();
-    ufan::Server(ufan::common::Endpoint::ip("0.0.0.0", 42069)).run();
+    ufan::server::Server<ufan::server::SocketIO>(endpoint, config).run();
     return 0;
 }
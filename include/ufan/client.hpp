@@ -1,39 +1,235 @@
 #pragma once
 
+#include <ufan/common/shm_ring.hpp>
 #include <ufan/common/socket.hpp>
+#include <ufan/common/wait.hpp>
 #include <ufan/protocol/message.hpp>
+#include <ufan/protocol/schema.hpp>
+#include <ufan/protocol/stats.hpp>
+#include <ufan/protocol/topic_match.hpp>
 
+#include <algorithm>
 #include <chrono>
 #include <cstddef>
+#include <cstring>
 #include <optional>
 #include <span>
+#include <string>
 #include <string_view>
+#include <thread>
 #include <type_traits>
+#include <unordered_map>
+#include <vector>
 
 namespace ufan {
 
+struct PublisherConfig {
+    // largest batch frame queue() will build; keep it under the path MTU
+    std::size_t max_datagram = 1400;
+    // how long a partly filled frame may wait for flush_if_due()
+    int64_t max_delay_us = 100;
+    // queue() sends runs of equal-sized messages as their own datagrams in
+    // one UDP_SEGMENT send (GSO) instead of packing batch frames; where
+    // the kernel lacks GSO a run goes out in one sendmmsg
+    bool gso = false;
+    // when set, every message is also written to this /dev/shm ring, which
+    // same-host subscribers read with Subscriber::attach
+    std::string shm_ring;
+    uint64_t shm_slots = 4096;
+    uint32_t shm_slot_size = 256;
+    // whether to keep sending over UDP while shm_ring is set; a subscriber
+    // reading the ring and subscribed over UDP gets both copies, so turn
+    // this off when every subscriber is on the same host
+    bool udp = true;
+};
+
+// publish() sends each message as its own datagram. queue() instead packs
+// records into batch frames, sent when the next record wouldn't fit or
+// when flush()/flush_if_due() is called; the server unpacks them and fans
+// out each record separately, so subscribers see no difference. With gso
+// set, queue() collects whole messages instead and the kernel splits them
+// into datagrams. Queued records are not sent on destruction; flush()
+// first. With shm_ring set, messages also go to a shared-memory ring that
+// bypasses the server.
 class Publisher {
   private:
     common::Endpoint m_server;
     common::Socket m_socket;
-    protocol::MessageConstructor m_constructor;
+    protocol::BatchConstructor m_batch;
+    // used by queue() in place of m_batch when config.gso is set
+    std::optional<protocol::SegmentConstructor> m_segments;
+    PublisherConfig m_config;
+    std::optional<common::ShmWriter> m_shm;
+    int64_t m_flush_deadline = 0;
+
+    static int64_t clock_now_us() {
+        return std::chrono::duration_cast<std::chrono::microseconds>(
+                   std::chrono::steady_clock::now().time_since_epoch())
+            .count();
+    }
+
+    // the header goes out ahead of data with a gather write, so data is
+    // never copied
+    bool send_udp(protocol::Topic topic, std::span<const std::byte> data) {
+        const auto header = protocol::Header::publish(topic);
+        return sizeof(header) + data.size() ==
+               m_socket.send_to(m_server, header.bytes(), data);
+    }
+
+    bool queue_segment(protocol::Topic topic,
+                       std::span<const std::byte> data) {
+        const auto header = protocol::Header::publish(topic);
+        if (m_segments->append(header, data)) {
+            if (m_segments->segments() == 1)
+                m_flush_deadline = clock_now_us() + m_config.max_delay_us;
+            return true;
+        }
+        bool ok = flush();
+        if (data.size() > m_segments->max_payload())
+            return send_udp(topic, data) && ok;
+        m_segments->append(header, data);
+        m_flush_deadline = clock_now_us() + m_config.max_delay_us;
+        return ok;
+    }
+
+    bool queue_udp(protocol::Topic topic, std::span<const std::byte> data) {
+        if (m_segments)
+            return queue_segment(topic, data);
+        if (m_batch.append(topic, data)) {
+            if (m_batch.records() == 1)
+                m_flush_deadline = clock_now_us() + m_config.max_delay_us;
+            return true;
+        }
+        bool ok = flush();
+        if (data.size() > m_batch.max_payload())
+            return send_udp(topic, data) && ok;
+        m_batch.append(topic, data);
+        m_flush_deadline = clock_now_us() + m_config.max_delay_us;
+        return ok;
+    }
 
   public:
-    Publisher(const common::Endpoint& server)
+    Publisher(const common::Endpoint& server, PublisherConfig config = {})
         : m_server(server),
-          m_socket(common::Socket::open(/*non_blocking=*/true)) {}
+          m_socket(common::Socket::open(/*non_blocking=*/true)),
+          m_batch(config.max_datagram), m_config(config) {
+        if (m_config.gso) {
+            m_socket.enable_gso();
+            m_segments.emplace(m_config.max_datagram,
+                               common::Socket::max_segments_size,
+                               common::Socket::max_segments);
+        }
+        if (!m_config.shm_ring.empty()) {
+            m_shm.emplace(m_config.shm_ring, m_config.shm_slots,
+                          m_config.shm_slot_size);
+        }
+    }
 
+    // Returns false if a send came up short or the message is too large
+    // for the shm ring.
     bool publish(protocol::Topic topic, std::span<const std::byte> data) {
-        auto packet =
-            m_constructor.construct(protocol::Header::publish(topic), data);
-        return packet.size() == m_socket.send_to(m_server, packet);
+        bool ok = true;
+        if (m_shm)
+            ok = m_shm->write(topic, data);
+        if (m_config.udp)
+            ok = send_udp(topic, data) && ok;
+        return ok;
     }
 
     bool publish(protocol::Topic topic, std::string_view data) {
-        auto packet =
-            m_constructor.construct(protocol::Header::publish(topic), data);
-        return packet.size() == m_socket.send_to(m_server, packet);
+        return publish(topic, std::span<const std::byte>(
+                                  (const std::byte*)data.data(), data.size()));
+    }
+
+    // Publishes payload_size bytes serialized into
+    // protocol::HeaderRoom::payload(buffer), writing the header into the
+    // room left for it and sending the buffer as it is.
+    bool publish_in_place(protocol::Topic topic, std::span<std::byte> buffer,
+                          std::size_t payload_size) {
+        auto message = protocol::HeaderRoom::seal(
+            buffer, protocol::Header::publish(topic), payload_size);
+        bool ok = true;
+        if (m_shm)
+            ok = m_shm->write(topic,
+                              message.subspan(protocol::HeaderRoom::size));
+        if (m_config.udp)
+            ok = message.size() == m_socket.send_to(m_server, message) && ok;
+        return ok;
+    }
+
+    // publishes a typed message straight from its buffer; subscribers read
+    // it with protocol::TypedView<T>
+    template <protocol::Schematic T>
+    bool publish(protocol::Topic topic, protocol::TypedMessage<T>& message) {
+        return publish_in_place(topic, message.buffer(),
+                                message.payload_size());
     }
+
+    // Adds a record to the pending frame, first sending the frame if the
+    // record doesn't fit. Records too large for any frame are published
+    // directly. The shm ring, if any, is written immediately. Returns false
+    // if a send came up short.
+    bool queue(protocol::Topic topic, std::span<const std::byte> data) {
+        bool shm_ok = true;
+        if (m_shm)
+            shm_ok = m_shm->write(topic, data);
+        if (!m_config.udp)
+            return shm_ok;
+        return queue_udp(topic, data) && shm_ok;
+    }
+
+    bool queue(protocol::Topic topic, std::string_view data) {
+        return queue(topic, std::span<const std::byte>(
+                                (const std::byte*)data.data(), data.size()));
+    }
+
+    // sends the pending frame or run, if any
+    bool flush() {
+        if (m_segments && !m_segments->empty()) {
+            auto run = m_segments->data();
+            bool ok = run.size() == m_socket.send_segments(
+                                        m_server, run,
+                                        m_segments->segment_size());
+            m_segments->clear();
+            return ok;
+        }
+        if (m_batch.empty())
+            return true;
+        auto frame = m_batch.finish();
+        bool ok = frame.size() == m_socket.send_to(m_server, frame);
+        m_batch.clear();
+        return ok;
+    }
+
+    // sends the pending frame once it has waited max_delay_us; call this
+    // from the publishing loop
+    bool flush_if_due() {
+        if (pending() == 0 || clock_now_us() < m_flush_deadline)
+            return true;
+        return flush();
+    }
+
+    std::size_t pending() const noexcept {
+        return m_segments ? m_segments->segments() : m_batch.records();
+    }
+};
+
+// A received publish along with the subscription it matched; when several
+// of the subscriber's patterns match, subscription is the lowest id.
+template <typename RecvType> struct Message {
+    RecvType data;
+    protocol::Topic topic;
+    std::size_t subscription;
+};
+
+// Loss on sequenced publishes, counted in messages.
+struct SequenceStats {
+    // found missing from a stream
+    uint64_t gaps = 0;
+    // resent by the server after a nak and delivered
+    uint64_t recovered = 0;
+    // given up on: gone from the server's ring, or naks went unanswered
+    uint64_t unrecoverable = 0;
 };
 
 class Subscriber {
@@ -41,8 +237,16 @@ class Subscriber {
     common::Endpoint m_server;
     common::Socket m_socket;
     protocol::MessageConstructor m_constructor;
-    protocol::Topic m_topic;
-    protocol::Topic m_subscribed_topic;
+    // indexed by subscription id; unsubscribed ids are empty until reused
+    std::vector<std::optional<protocol::Topic>> m_topics;
+    // the same patterns packed contiguously for protocol::find_match; an
+    // unsubscribed id keeps its stale pattern, checked against m_topics
+    std::vector<protocol::Topic> m_patterns;
+    // the set the server last reported
+    std::vector<protocol::Topic> m_subscribed_topics;
+    // what the server does once this subscriber's egress queue is full
+    protocol::SlowConsumerPolicy m_policy =
+        protocol::SlowConsumerPolicy::server_default;
 
     int64_t m_time_now;
     int64_t m_next_heartbeat = 0;
@@ -51,6 +255,69 @@ class Subscriber {
     static constexpr int64_t m_heartbeat_timeout = 10000;
 
     std::vector<std::byte> m_recv_buf;
+    // what process() has yet to hand out of the last socket read into
+    // m_recv_buf, which with GRO may hold several datagrams
+    struct Coalesced {
+        common::Endpoint from;
+        std::size_t offset = 0;
+        std::size_t size = 0;
+        std::size_t segment_size = 0;
+    };
+    Coalesced m_coalesced;
+    // drain() slots, allocated on first use
+    std::optional<common::RecvBatch> m_recv_batch;
+    // same-host publishers' rings, read before the socket
+    std::vector<common::ShmReader> m_rings;
+    // set by enable_multicast: the interface groups are joined on
+    std::optional<std::string> m_multicast_interface;
+    // a joined group socket per subscribed topic the server multicasts
+    struct Group {
+        protocol::Topic topic;
+        common::Socket socket;
+    };
+    std::vector<Group> m_groups;
+    // the socket plus every group socket, so fd() wakes for either
+    std::optional<common::WaitStrategy> m_wake;
+
+    // Sequenced publishes, tracked per server stream and topic. A gap is
+    // nak'ed at once and again every m_nak_interval until it is filled,
+    // reported lost, or m_max_naks went unanswered; newer messages are
+    // delivered meanwhile and resends whenever they arrive.
+    struct StreamKey {
+        uint16_t stream;
+        protocol::Topic topic;
+        bool operator==(const StreamKey&) const = default;
+    };
+    struct StreamKeyHash {
+        std::size_t operator()(const StreamKey& key) const noexcept {
+            return std::hash<protocol::Topic>{}(key.topic) * 31 + key.stream;
+        }
+    };
+    struct Gap {
+        uint64_t first;
+        // ring position of the message that revealed the gap
+        uint64_t position;
+        std::vector<bool> missing;
+        std::size_t remaining;
+        int64_t deadline;
+        uint32_t naks;
+    };
+    struct Stream {
+        uint64_t next = 0;
+        std::vector<Gap> gaps;
+    };
+    std::unordered_map<StreamKey, Stream, StreamKeyHash> m_streams;
+    // the server's epoch; streams from an older one are not tracked
+    uint32_t m_epoch = 0;
+    std::size_t m_open_gaps = 0;
+    int64_t m_next_gap_check = 0;
+    SequenceStats m_sequence_stats;
+    // larger gaps only ask for their newest m_max_gap messages
+    static constexpr uint64_t m_max_gap = protocol::max_nak;
+    static constexpr int64_t m_nak_interval = 20;
+    static constexpr uint32_t m_max_naks = 3;
+    // datagrams dropped as malformed or not from the server
+    uint64_t m_discarded = 0;
 
     int64_t time_now() const { return m_time_now; }
 
@@ -60,78 +327,603 @@ class Subscriber {
                          .count();
     }
 
+    bool wants(const protocol::Topic& topic) const noexcept {
+        for (const auto& wanted : m_topics)
+            if (wanted && *wanted == topic)
+                return true;
+        return false;
+    }
+
+    bool server_has(const protocol::Topic& topic) const noexcept {
+        for (const auto& subscribed : m_subscribed_topics)
+            if (subscribed == topic)
+                return true;
+        return false;
+    }
+
     void send_heartbeat() {
         m_socket.send_to(
             m_server,
             m_constructor.construct(protocol::Header::heartbeat(time_now())));
-        if (!subscribed()) {
-            m_socket.send_to(
-                m_server,
-                m_constructor.construct(protocol::Header::subscribe(m_topic)));
+        // repeated so it survives loss and server restarts
+        if (m_policy != protocol::SlowConsumerPolicy::server_default)
+            send_policy();
+
+        // reconcile with what the server reported, covering lost
+        // subscribe/unsubscribe datagrams and server restarts
+        for (const auto& wanted : m_topics) {
+            if (wanted && !server_has(*wanted)) {
+                m_socket.send_to(m_server,
+                                 m_constructor.construct(
+                                     protocol::Header::subscribe(*wanted)));
+            }
+        }
+        for (const auto& subscribed : m_subscribed_topics) {
+            if (!wants(subscribed)) {
+                m_socket.send_to(
+                    m_server, m_constructor.construct(
+                                  protocol::Header::unsubscribe(subscribed)));
+            }
         }
     }
 
+    void send_policy() {
+        m_socket.send_to(
+            m_server,
+            m_constructor.construct(protocol::Header::configure(m_policy)));
+    }
+
     void handle_heartbeat(std::span<const std::byte> data) {
-        if (data.size() !=
-            (sizeof(protocol::Header) + sizeof(protocol::Topic))) {
-            throw std::runtime_error("invalid heartbeat");
+        auto topics =
+            protocol::MessageParser::data<std::span<const std::byte>>(data);
+        if (topics.size() % sizeof(protocol::Topic) != 0) {
+            throw protocol::ParseError("invalid heartbeat");
         }
 
         m_last_heartbeat = protocol::MessageParser::header(data).timestamp();
-        m_subscribed_topic = *(
-            (protocol::Topic*)
-                protocol::MessageParser::data<std::span<const std::byte>>(data)
-                    .data());
+        m_subscribed_topics.resize(topics.size() / sizeof(protocol::Topic));
+        std::memcpy(m_subscribed_topics.data(), topics.data(), topics.size());
+    }
+
+    // Joins the group the server advertised for a subscription, then tells
+    // the server so it stops unicasting it. Any failure to join leaves the
+    // subscription on unicast; the server re-advertises with each heartbeat.
+    void handle_multicast(std::span<const std::byte> data) {
+        auto topic = protocol::MessageParser::header(data).topic();
+        auto payload =
+            protocol::MessageParser::data<std::span<const std::byte>>(data);
+        if (payload.size() != sizeof(protocol::MulticastGroup))
+            throw protocol::ParseError("invalid multicast");
+        if (!m_multicast_interface || !wants(topic))
+            return;
+
+        auto joined = std::find_if(m_groups.begin(), m_groups.end(),
+                                   [&](const Group& group) {
+                                       return group.topic == topic;
+                                   });
+        if (joined == m_groups.end()) {
+            protocol::MulticastGroup advert;
+            std::memcpy(&advert, payload.data(), sizeof(advert));
+            common::Endpoint group{};
+            group.addr.sin_family = AF_INET;
+            group.addr.sin_addr.s_addr = advert.address;
+            group.addr.sin_port = advert.port;
+            try {
+                auto socket = common::Socket::open(/*non_blocking=*/true);
+                socket.set_reuse_addr(true);
+                socket.bind(group);
+                socket.join_group(group, *m_multicast_interface);
+                m_wake->watch(socket.fd());
+                m_groups.push_back({topic, std::move(socket)});
+            } catch (const std::exception&) {
+                return;
+            }
+        }
+        m_socket.send_to(
+            m_server, m_constructor.construct(protocol::Header::join(topic)));
+    }
+
+    void send_nak(const StreamKey& key, const Gap& gap) {
+        // narrowed to the missing range; resends of anything already
+        // received are dropped as duplicates
+        std::size_t low = 0;
+        while (!gap.missing[low])
+            low++;
+        std::size_t high = gap.missing.size() - 1;
+        while (!gap.missing[high])
+            high--;
+        protocol::Nak nak{m_epoch, key.stream, gap.first + low,
+                          gap.first + high, gap.position};
+        m_socket.send_to(m_server,
+                         m_constructor.construct(
+                             protocol::Header::nak(key.topic),
+                             std::span<const std::byte>(
+                                 (const std::byte*)&nak, sizeof(nak))));
+    }
+
+    void open_gap(const StreamKey& key, Stream& stream,
+                  const protocol::Sequence& sequence) {
+        auto first = stream.next;
+        m_sequence_stats.gaps += sequence.seq - first;
+        if (sequence.seq - first > m_max_gap) {
+            m_sequence_stats.unrecoverable +=
+                sequence.seq - first - m_max_gap;
+            first = sequence.seq - m_max_gap;
+        }
+        const auto size = sequence.seq - first;
+        Gap gap{first,
+                sequence.position,
+                std::vector<bool>(size, true),
+                size,
+                time_now() + m_nak_interval,
+                1};
+        send_nak(key, gap);
+        stream.gaps.push_back(std::move(gap));
+        m_open_gaps++;
+    }
+
+    void close_gap(Stream& stream, std::size_t i) {
+        stream.gaps[i] = std::move(stream.gaps.back());
+        stream.gaps.pop_back();
+        m_open_gaps--;
+    }
+
+    // Records a sequenced publish, opening a gap if seqs were skipped;
+    // returns false for a duplicate.
+    bool track(protocol::Topic topic, const protocol::Sequence& sequence) {
+        if (sequence.epoch < m_epoch)
+            return true;
+        if (sequence.epoch > m_epoch) {
+            // the server restarted, so nothing missing can be resent
+            for (auto& [key, stream] : m_streams)
+                for (const auto& gap : stream.gaps)
+                    m_sequence_stats.unrecoverable += gap.remaining;
+            m_streams.clear();
+            m_open_gaps = 0;
+            m_epoch = sequence.epoch;
+        }
+
+        const StreamKey key{sequence.stream, topic};
+        auto [it, inserted] = m_streams.try_emplace(key);
+        auto& stream = it->second;
+        if (inserted || sequence.seq >= stream.next) {
+            if (!inserted && sequence.seq > stream.next)
+                open_gap(key, stream, sequence);
+            stream.next = sequence.seq + 1;
+            return true;
+        }
+
+        for (std::size_t i = 0; i < stream.gaps.size(); i++) {
+            auto& gap = stream.gaps[i];
+            if (sequence.seq < gap.first ||
+                sequence.seq - gap.first >= gap.missing.size())
+                continue;
+            if (!gap.missing[sequence.seq - gap.first])
+                return false;
+            gap.missing[sequence.seq - gap.first] = false;
+            m_sequence_stats.recovered++;
+            if (--gap.remaining == 0)
+                close_gap(stream, i);
+            return true;
+        }
+        return false;
+    }
+
+    // the server no longer has seqs first..last of a stream
+    void handle_nak(std::span<const std::byte> data) {
+        auto topic = protocol::MessageParser::header(data).topic();
+        auto nak = protocol::MessageParser::prefix<protocol::Nak>(data);
+        if (nak.epoch != m_epoch)
+            return;
+        auto it = m_streams.find(StreamKey{nak.stream, topic});
+        if (it == m_streams.end())
+            return;
+
+        auto& stream = it->second;
+        for (std::size_t i = stream.gaps.size(); i-- > 0;) {
+            auto& gap = stream.gaps[i];
+            for (auto seq = std::max(nak.first, gap.first);
+                 seq <= nak.last && seq - gap.first < gap.missing.size();
+                 seq++) {
+                if (gap.missing[seq - gap.first]) {
+                    gap.missing[seq - gap.first] = false;
+                    gap.remaining--;
+                    m_sequence_stats.unrecoverable++;
+                }
+            }
+            if (gap.remaining == 0)
+                close_gap(stream, i);
+        }
+    }
+
+    // re-naks gaps whose deadline passed, giving up after m_max_naks
+    void check_gaps() {
+        if (m_open_gaps == 0 || time_now() < m_next_gap_check)
+            return;
+        m_next_gap_check = time_now() + m_nak_interval;
+        for (auto& [key, stream] : m_streams) {
+            for (std::size_t i = stream.gaps.size(); i-- > 0;) {
+                auto& gap = stream.gaps[i];
+                if (time_now() < gap.deadline)
+                    continue;
+                if (gap.naks >= m_max_naks) {
+                    m_sequence_stats.unrecoverable += gap.remaining;
+                    close_gap(stream, i);
+                    continue;
+                }
+                gap.naks++;
+                gap.deadline = time_now() + m_nak_interval;
+                send_nak(key, gap);
+            }
+        }
+    }
+
+    // streams of topics no subscription matches any more, so a later
+    // resubscribe doesn't nak what was published in between
+    void forget_streams() {
+        std::erase_if(m_streams, [&](const auto& entry) {
+            const auto& [key, stream] = entry;
+            if (match(key.topic))
+                return false;
+            m_open_gaps -= stream.gaps.size();
+            return true;
+        });
+    }
+
+    void leave_group(const protocol::Topic& topic) {
+        std::erase_if(m_groups,
+                      [&](const Group& group) { return group.topic == topic; });
     }
 
   public:
-    Subscriber(const common::Endpoint& server, protocol::Topic topic)
+    explicit Subscriber(const common::Endpoint& server)
         : m_server(server),
-          m_socket(common::Socket::open(/*non_blocking=*/true)),
-          m_topic(topic) {
+          m_socket(common::Socket::open(/*non_blocking=*/true)) {
         cache_time_now();
-        std::memset(m_subscribed_topic.keys, 0,
-                    sizeof(m_subscribed_topic.keys));
         m_recv_buf.resize(65535);
+        // runs of datagrams from the server may then arrive in one read;
+        // without it the kernel hands them over one by one
+        m_socket.enable_gro();
     }
 
-    template <typename RecvType = std::string_view>
-    std::optional<RecvType> process() {
-        static_assert(std::is_same_v<RecvType, std::span<const std::byte>> ||
-                      std::is_same_v<RecvType, std::string_view>);
+    Subscriber(const common::Endpoint& server, protocol::Topic topic)
+        : Subscriber(server) {
+        subscribe(topic);
+    }
 
+    // Returns an id for the subscription, stable until it is unsubscribed.
+    // Subscribing to a topic twice yields two ids for one server-side entry.
+    std::size_t subscribe(protocol::Topic topic) {
+        std::size_t id = 0;
+        while (id < m_topics.size() && m_topics[id])
+            id++;
+        if (id == m_topics.size()) {
+            if (m_topics.size() >= protocol::max_subscriptions)
+                throw std::runtime_error("too many subscriptions");
+            m_topics.emplace_back();
+            m_patterns.emplace_back();
+        }
+        m_topics[id] = topic;
+        m_patterns[id] = topic;
+
+        m_socket.send_to(
+            m_server,
+            m_constructor.construct(protocol::Header::subscribe(topic)));
+        return id;
+    }
+
+    void unsubscribe(std::size_t id) {
+        if (id >= m_topics.size() || !m_topics[id])
+            throw std::runtime_error("invalid subscription id");
+        auto topic = *m_topics[id];
+        m_topics[id].reset();
+
+        forget_streams();
+        if (!wants(topic)) {
+            leave_group(topic);
+            m_socket.send_to(
+                m_server,
+                m_constructor.construct(protocol::Header::unsubscribe(topic)));
+        }
+    }
+
+    // Lets the server move subscriptions it multicasts onto their groups,
+    // joined on the interface holding interface_ip ("0.0.0.0" lets the
+    // kernel pick). Without it every subscription stays on unicast.
+    void enable_multicast(std::string interface_ip = "0.0.0.0") {
+        if (!m_wake) {
+            m_wake.emplace(common::WaitConfig{
+                .mode = common::WaitMode::spin_epoll});
+            m_wake->watch(m_socket.fd());
+        }
+        m_multicast_interface = std::move(interface_ip);
+    }
+
+    // Picks what the server does with publishes for this subscriber once
+    // its egress queue is full, overriding the server's --slow-consumer.
+    void set_slow_consumer_policy(protocol::SlowConsumerPolicy policy) {
+        m_policy = policy;
+        send_policy();
+    }
+
+  private:
+    void tick() {
         cache_time_now();
         if (time_now() > m_next_heartbeat) {
             m_next_heartbeat = time_now() + m_heartbeat_frequency;
             send_heartbeat();
         }
+        check_gaps();
+    }
 
-        if (auto r = m_socket.recv_from(m_recv_buf)) {
-            if (r->from != m_server) {
-                throw std::runtime_error("wtf");
-            }
+    // lowest subscription id whose pattern matches topic
+    std::optional<std::size_t> match(const protocol::Topic& topic) const {
+        for (std::size_t id = 0;; id++) {
+            id = protocol::find_match(topic, m_patterns, id);
+            if (id == m_patterns.size())
+                return std::nullopt;
+            if (m_topics[id])
+                return id;
+        }
+    }
 
-            std::span<const std::byte> data(m_recv_buf.data(), r->size);
+    template <typename RecvType>
+    static RecvType as(std::span<const std::byte> data) {
+        if constexpr (std::is_same_v<RecvType, std::string_view>) {
+            return std::string_view((const char*)data.data(), data.size());
+        } else {
+            return data;
+        }
+    }
+
+    // Handles control messages and returns matching publishes. A datagram
+    // from elsewhere or one that fails to parse is counted and skipped, so
+    // it never costs the rest of a batched read; a reply that fails to
+    // send, e.g. a NAK, is a local error and propagates.
+    template <typename RecvType>
+    std::optional<Message<RecvType>>
+    handle_datagram(const common::Endpoint& from,
+                    std::span<const std::byte> data) {
+        if (from != m_server) {
+            m_discarded++;
+            return std::nullopt;
+        }
+
+        try {
             auto header = protocol::MessageParser::header(data);
             switch (header.type()) {
             case protocol::MessageType::heartbeat:
                 handle_heartbeat(data);
                 break;
+            case protocol::MessageType::multicast:
+                handle_multicast(data);
+                break;
             case protocol::MessageType::publish:
-                if (header.topic().matches(m_topic)) {
-                    return protocol::MessageParser::data<RecvType>(data);
-                }
+                return handle_publish<RecvType>(data);
+            case protocol::MessageType::sequenced:
+                return handle_sequenced<RecvType>(data);
+            case protocol::MessageType::nak:
+                handle_nak(data);
                 break;
             default:
                 break;
             }
+        } catch (const protocol::ParseError&) {
+            m_discarded++;
         }
+        return std::nullopt;
+    }
 
+    template <typename RecvType>
+    std::optional<Message<RecvType>>
+    handle_publish(std::span<const std::byte> data) {
+        auto topic = protocol::MessageParser::header(data).topic();
+        if (auto id = match(topic)) {
+            return Message<RecvType>{
+                protocol::MessageParser::data<RecvType>(data), topic, *id};
+        }
         return std::nullopt;
     }
 
+    template <typename RecvType>
+    std::optional<Message<RecvType>>
+    handle_sequenced(std::span<const std::byte> data) {
+        auto topic = protocol::MessageParser::header(data).topic();
+        auto sequence =
+            protocol::MessageParser::prefix<protocol::Sequence>(data);
+        if (!track(topic, sequence))
+            return std::nullopt;
+        if (auto id = match(topic)) {
+            return Message<RecvType>{
+                as<RecvType>(data.subspan(sizeof(protocol::Header) +
+                                          sizeof(protocol::Sequence))),
+                topic, *id};
+        }
+        return std::nullopt;
+    }
+
+    // group sockets carry nothing but publishes, from whichever address
+    // the server sends multicast from
+    template <typename RecvType>
+    std::optional<Message<RecvType>>
+    handle_group_datagram(std::span<const std::byte> data) {
+        try {
+            switch (protocol::MessageParser::header(data).type()) {
+            case protocol::MessageType::publish:
+                return handle_publish<RecvType>(data);
+            case protocol::MessageType::sequenced:
+                return handle_sequenced<RecvType>(data);
+            default:
+                break;
+            }
+        } catch (const protocol::ParseError&) {
+            m_discarded++;
+        }
+        return std::nullopt;
+    }
+
+    // handles the rest of m_coalesced up to the first matching publish
+    template <typename RecvType>
+    std::optional<Message<RecvType>> process_coalesced() {
+        auto& read = m_coalesced;
+        while (read.offset < read.size) {
+            const auto size =
+                std::min(read.segment_size, read.size - read.offset);
+            std::span<const std::byte> datagram(m_recv_buf.data() + read.offset,
+                                                size);
+            read.offset += size;
+            if (auto message = handle_datagram<RecvType>(read.from, datagram))
+                return message;
+        }
+        return std::nullopt;
+    }
+
+  public:
+    template <typename RecvType = std::string_view>
+    std::optional<Message<RecvType>> process() {
+        static_assert(std::is_same_v<RecvType, std::span<const std::byte>> ||
+                      std::is_same_v<RecvType, std::string_view>);
+
+        tick();
+        // finish a coalesced read before anything reuses m_recv_buf
+        if (auto message = process_coalesced<RecvType>())
+            return message;
+
+        for (auto& ring : m_rings) {
+            std::optional<Message<RecvType>> message;
+            auto on_message = [&](protocol::Topic topic,
+                                  std::span<const std::byte> data) {
+                if (auto id = match(topic))
+                    message = Message<RecvType>{as<RecvType>(data), topic, *id};
+            };
+            while (!message && ring.poll(on_message, 1)) {
+            }
+            if (message)
+                return message;
+        }
+
+        for (auto& group : m_groups) {
+            while (auto r = group.socket.recv_from(m_recv_buf)) {
+                if (auto message = handle_group_datagram<RecvType>(
+                        std::span<const std::byte>(m_recv_buf.data(),
+                                                   r->size)))
+                    return message;
+            }
+        }
+
+        if (auto r = m_socket.recv_from(m_recv_buf)) {
+            m_coalesced = {r->from, 0, r->size, r->segment_size};
+            return process_coalesced<RecvType>();
+        }
+        return std::nullopt;
+    }
+
+    // Receives up to max reads with one recvmmsg call, each one datagram or
+    // with GRO a run of them, after reading up to max messages from each
+    // attached ring, and calls callback(const Message<RecvType>&) for each
+    // matching publish. The clock read and heartbeat check happen once per
+    // call rather than per message. Messages are only valid inside the
+    // callback. Returns the number of messages delivered.
+    template <typename RecvType = std::string_view, typename F>
+    std::size_t drain(F&& callback, std::size_t max = 64) {
+        static_assert(std::is_same_v<RecvType, std::span<const std::byte>> ||
+                      std::is_same_v<RecvType, std::string_view>);
+        if (max == 0)
+            return 0;
+
+        if (!m_recv_batch || m_recv_batch->capacity() < max)
+            m_recv_batch.emplace(max, m_recv_buf.size());
+
+        tick();
+        std::size_t delivered = 0;
+        // process() may have left part of a coalesced read in m_recv_buf
+        while (auto message = process_coalesced<RecvType>()) {
+            callback(*message);
+            delivered++;
+        }
+
+        for (auto& ring : m_rings) {
+            ring.poll(
+                [&](protocol::Topic topic, std::span<const std::byte> data) {
+                    if (auto id = match(topic)) {
+                        callback(Message<RecvType>{as<RecvType>(data), topic,
+                                                   *id});
+                        delivered++;
+                    }
+                },
+                max);
+        }
+
+        for (auto& group : m_groups) {
+            for (std::size_t i = 0; i < max; i++) {
+                auto r = group.socket.recv_from(m_recv_buf);
+                if (!r)
+                    break;
+                if (auto message = handle_group_datagram<RecvType>(
+                        std::span<const std::byte>(m_recv_buf.data(),
+                                                   r->size))) {
+                    callback(*message);
+                    delivered++;
+                }
+            }
+        }
+
+        auto n = m_socket.recv_batch(*m_recv_batch, max);
+        const auto& batch = *m_recv_batch;
+        for (std::size_t i = 0; i < n; i++) {
+            common::for_each_segment(
+                batch.data(i), batch.segment_size(i), [&](auto datagram) {
+                    auto message =
+                        handle_datagram<RecvType>(batch.from(i), datagram);
+                    if (message) {
+                        callback(*message);
+                        delivered++;
+                    }
+                });
+        }
+        return delivered;
+    }
+
+    // Also reads messages from a same-host publisher's shared-memory ring
+    // (PublisherConfig::shm_ring), starting with the next one written. They
+    // are matched against this subscriber's subscriptions like UDP
+    // publishes, and delivered without syscalls, copied once out of the
+    // ring. A restarted publisher is followed to its new ring.
+    void attach(const std::string& ring) { m_rings.emplace_back(ring); }
+
+    // loss on publishes from a server that sequences them
+    const SequenceStats& sequence_stats() const noexcept {
+        return m_sequence_stats;
+    }
+
+    // datagrams skipped as malformed or from an address other than the
+    // server's
+    uint64_t discarded() const noexcept { return m_discarded; }
+
+    // ring messages skipped because a publisher lapped this subscriber
+    uint64_t shm_lost() const noexcept {
+        uint64_t lost = 0;
+        for (const auto& ring : m_rings)
+            lost += ring.lost();
+        return lost;
+    }
+
+    // fd to wait on for readability, e.g. with common::WaitStrategy; with
+    // multicast enabled it is an epoll fd covering the joined groups too.
+    // Attached rings don't wake it, so spin when reading them.
+    int fd() const noexcept { return m_wake ? m_wake->fd() : m_socket.fd(); }
+
+    // true once the server reports exactly the topics subscribed to here
     bool subscribed() const noexcept {
-        return connected() && (m_subscribed_topic == m_topic);
+        if (!connected())
+            return false;
+        for (const auto& wanted : m_topics)
+            if (wanted && !server_has(*wanted))
+                return false;
+        for (const auto& subscribed : m_subscribed_topics)
+            if (!wants(subscribed))
+                return false;
+        return true;
     }
 
     bool connected() const noexcept {
@@ -139,4 +931,38 @@ class Subscriber {
     }
 };
 
+// Asks the server for its per-worker counters. Returns nullopt if no reply
+// arrives within timeout.
+inline std::optional<std::vector<protocol::Stats>>
+query_stats(const common::Endpoint& server,
+            std::chrono::milliseconds timeout = std::chrono::seconds(1)) {
+    auto socket = common::Socket::open(/*non_blocking=*/true);
+    protocol::MessageConstructor constructor;
+    socket.send_to(server, constructor.construct(protocol::Header::stats(0)));
+
+    std::vector<std::byte> buf(65535);
+    const auto deadline = std::chrono::steady_clock::now() + timeout;
+    while (std::chrono::steady_clock::now() < deadline) {
+        auto r = socket.recv_from(buf);
+        if (!r) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+            continue;
+        }
+        std::span<const std::byte> data(buf.data(), r->size);
+        if (r->from != server || protocol::MessageParser::header(data).type() !=
+                                     protocol::MessageType::stats)
+            continue;
+
+        auto payload =
+            protocol::MessageParser::data<std::span<const std::byte>>(data);
+        if (payload.size() % sizeof(protocol::Stats) != 0)
+            throw std::runtime_error("invalid stats reply");
+        std::vector<protocol::Stats> out(payload.size() /
+                                         sizeof(protocol::Stats));
+        std::memcpy(out.data(), payload.data(), payload.size());
+        return out;
+    }
+    return std::nullopt;
+}
+
 } // namespace ufan
@@ -0,0 +1,321 @@
+#pragma once
+
+#include <ufan/common/shm_ring.hpp>
+#include <ufan/common/socket.hpp>
+#include <ufan/protocol/header.hpp>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cinttypes>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <optional>
+#include <span>
+#include <stdexcept>
+#include <string>
+#include <system_error>
+#include <utility>
+
+namespace ufan::common {
+
+// Append-only journal of published messages in numbered segment files.
+//
+// A segment is a fixed-size file mapped whole: a SegmentHeader, then records
+// back to back, each a JournalRecord followed by its payload and padded to 8
+// bytes. The rest of the file reads as zeros until written. A record's length
+// is stored last, so a reader tailing the journal, or one opening it after a
+// crash, sees each record either whole or not at all. A record that doesn't
+// fit the rest of a segment goes first in the next one, and the segment it
+// skipped is closed with a length of end_of_segment. Fields are in host byte
+// order.
+
+struct JournalRecord {
+    // whole record including padding; 0 past the last one
+    uint32_t length;
+    uint16_t payload_size;
+    uint16_t source_port;
+    uint32_t source_ip;
+    uint32_t reserved;
+    // wall clock when the server received it
+    int64_t time_ns;
+    protocol::Topic topic;
+
+    static constexpr uint32_t end_of_segment = ~uint32_t(0);
+
+    static constexpr uint32_t length_for(std::size_t payload_size) noexcept {
+        return static_cast<uint32_t>((sizeof(JournalRecord) + payload_size +
+                                      7) &
+                                     ~std::size_t(7));
+    }
+};
+
+static_assert(sizeof(JournalRecord) == 56);
+
+// a record read back in place
+struct JournalEntry {
+    int64_t time_ns;
+    Endpoint source;
+    protocol::Topic topic;
+    std::span<const std::byte> payload;
+};
+
+namespace journal_impl {
+
+inline constexpr uint64_t magic = 0x6c6e726a6e616675ULL; // "ufanjrnl"
+inline constexpr uint32_t version = 1;
+
+struct alignas(64) SegmentHeader {
+    uint64_t magic;
+    uint32_t version;
+    uint32_t reserved;
+    uint64_t index;
+};
+
+inline constexpr std::size_t records_offset = sizeof(SegmentHeader);
+
+inline std::filesystem::path segment_path(const std::filesystem::path& dir,
+                                          uint64_t index) {
+    char name[32];
+    std::snprintf(name, sizeof(name), "%016" PRIu64 ".journal", index);
+    return dir / name;
+}
+
+// the lowest and highest segment numbers in dir, if it has any
+inline std::optional<std::pair<uint64_t, uint64_t>>
+segment_range(const std::filesystem::path& dir) {
+    std::optional<std::pair<uint64_t, uint64_t>> out;
+    std::error_code ec;
+    for (const auto& file : std::filesystem::directory_iterator(dir, ec)) {
+        const auto name = file.path().filename().string();
+        uint64_t index;
+        char extension[16];
+        if (std::sscanf(name.c_str(), "%16" SCNu64 ".%15s", &index,
+                        extension) != 2 ||
+            std::string_view(extension) != "journal")
+            continue;
+        if (!out)
+            out.emplace(index, index);
+        out->first = std::min(out->first, index);
+        out->second = std::max(out->second, index);
+    }
+    return out;
+}
+
+inline std::atomic_ref<uint32_t> length_at(std::byte* p) noexcept {
+    return std::atomic_ref<uint32_t>(*reinterpret_cast<uint32_t*>(p));
+}
+
+} // namespace journal_impl
+
+// Appends to the journal in a directory from one thread.
+class JournalWriter {
+  private:
+    std::filesystem::path m_dir;
+    std::size_t m_segment_size;
+    uint64_t m_index = 0;
+    shm_impl::Mapping m_mapping;
+    std::size_t m_offset = 0;
+
+    void open_segment(uint64_t index) {
+        const auto path = journal_impl::segment_path(m_dir, index);
+        shm_impl::FileDescriptor fd(
+            ::open(path.c_str(), O_CREAT | O_EXCL | O_RDWR, 0644));
+        if (fd.get() < 0)
+            throw std::runtime_error(shm_impl::err("open", path.string()));
+        // reserved up front, so a full disk fails here rather than as a
+        // SIGBUS on a store into the mapping
+        if (int e = ::posix_fallocate(fd.get(), 0,
+                                      static_cast<off_t>(m_segment_size))) {
+            errno = e;
+            throw std::runtime_error(
+                shm_impl::err("posix_fallocate", path.string()));
+        }
+        m_mapping = shm_impl::Mapping(fd.get(), m_segment_size,
+                                      PROT_READ | PROT_WRITE);
+        auto* header = reinterpret_cast<journal_impl::SegmentHeader*>(
+            m_mapping.data());
+        header->version = journal_impl::version;
+        header->index = index;
+        std::atomic_ref<uint64_t>(header->magic)
+            .store(journal_impl::magic, std::memory_order_release);
+        m_index = index;
+        m_offset = journal_impl::records_offset;
+    }
+
+  public:
+    // Starts a segment after any already in dir, which is created if
+    // missing; segment_size is rounded up to whole pages.
+    explicit JournalWriter(std::filesystem::path dir,
+                           std::size_t segment_size = 64 << 20)
+        : m_dir(std::move(dir)),
+          m_segment_size((segment_size + 4095) & ~std::size_t(4095)) {
+        if (m_segment_size < journal_impl::records_offset +
+                                 JournalRecord::length_for(UINT16_MAX))
+            throw std::runtime_error("journal segment too small");
+        std::filesystem::create_directories(m_dir);
+        const auto existing = journal_impl::segment_range(m_dir);
+        open_segment(existing ? existing->second + 1 : 0);
+    }
+
+    ~JournalWriter() {
+        if (m_mapping.mapped())
+            ::msync(m_mapping.data(), m_mapping.size(), MS_SYNC);
+    }
+
+    JournalWriter(JournalWriter&&) = default;
+
+    uint64_t segment() const noexcept { return m_index; }
+
+    // head.length must be JournalRecord::length_for(payload.size())
+    void append(const JournalRecord& head,
+                std::span<const std::byte> payload) {
+        if (m_offset + head.length > m_segment_size) {
+            if (m_offset + sizeof(uint32_t) <= m_segment_size)
+                journal_impl::length_at(m_mapping.data() + m_offset)
+                    .store(JournalRecord::end_of_segment,
+                           std::memory_order_release);
+            ::msync(m_mapping.data(), m_segment_size, MS_ASYNC);
+            open_segment(m_index + 1);
+        }
+
+        auto* at = m_mapping.data() + m_offset;
+        constexpr auto skip = sizeof(head.length);
+        std::memcpy(at + skip, reinterpret_cast<const std::byte*>(&head) + skip,
+                    sizeof(head) - skip);
+        std::memcpy(at + sizeof(head), payload.data(), payload.size());
+        journal_impl::length_at(at).store(head.length,
+                                          std::memory_order_release);
+        m_offset += head.length;
+    }
+
+    void append(int64_t time_ns, const Endpoint& source,
+                const protocol::Topic& topic,
+                std::span<const std::byte> payload) {
+        append(JournalRecord{JournalRecord::length_for(payload.size()),
+                             static_cast<uint16_t>(payload.size()),
+                             source.port_host_order(), source.ip_host_order(),
+                             0, time_ns, topic},
+               payload);
+    }
+};
+
+// Streams a journal back from its oldest segment, reading records where
+// they lie in the mapped files. It may tail a journal being written:
+// next() returns nothing at the end and picks up whatever is appended.
+class JournalReader {
+  private:
+    std::filesystem::path m_dir;
+    std::optional<uint64_t> m_index;
+    shm_impl::Mapping m_mapping;
+    std::size_t m_offset = 0;
+
+    // maps segment m_index if it exists and has its header
+    bool open_segment() {
+        const auto path = journal_impl::segment_path(m_dir, *m_index);
+        shm_impl::FileDescriptor fd(::open(path.c_str(), O_RDONLY));
+        if (fd.get() < 0) {
+            if (errno == ENOENT)
+                return false;
+            throw std::runtime_error(shm_impl::err("open", path.string()));
+        }
+        struct stat st;
+        if (::fstat(fd.get(), &st) < 0)
+            throw std::runtime_error(shm_impl::err("fstat", path.string()));
+        const auto size = static_cast<std::size_t>(st.st_size);
+        if (size < journal_impl::records_offset)
+            return false;
+
+        shm_impl::Mapping mapping(fd.get(), size, PROT_READ);
+        const auto* header =
+            reinterpret_cast<journal_impl::SegmentHeader*>(mapping.data());
+        if (std::atomic_ref<const uint64_t>(header->magic)
+                .load(std::memory_order_acquire) != journal_impl::magic)
+            return false;
+        if (header->version != journal_impl::version)
+            throw std::runtime_error("unsupported journal version in " +
+                                     path.string());
+
+        m_mapping = std::move(mapping);
+        m_offset = journal_impl::records_offset;
+        return true;
+    }
+
+    void next_segment() {
+        m_mapping = {};
+        ++*m_index;
+    }
+
+  public:
+    explicit JournalReader(std::filesystem::path dir) : m_dir(std::move(dir)) {}
+
+    // The next record, or nullopt at the end of what has been written so
+    // far. Its payload stays valid until next() moves on to another segment.
+    std::optional<JournalEntry> next() {
+        if (!m_index) {
+            const auto existing = journal_impl::segment_range(m_dir);
+            if (!existing)
+                return std::nullopt;
+            m_index = existing->first;
+        }
+
+        while (true) {
+            if (!m_mapping.mapped() && !open_segment())
+                return std::nullopt;
+
+            if (m_offset + sizeof(uint32_t) > m_mapping.size()) {
+                next_segment();
+                continue;
+            }
+            auto* at = m_mapping.data() + m_offset;
+            const auto length =
+                std::atomic_ref<const uint32_t>(
+                    *reinterpret_cast<const uint32_t*>(at))
+                    .load(std::memory_order_acquire);
+            if (length == JournalRecord::end_of_segment) {
+                next_segment();
+                continue;
+            }
+            if (length == 0) {
+                // A writer that stopped mid-segment left the rest unwritten
+                // and a later one started the next segment. A live writer
+                // finishes this segment before it creates the next, so once
+                // that exists, a length still 0 is final.
+                if (!std::filesystem::exists(
+                        journal_impl::segment_path(m_dir, *m_index + 1)))
+                    return std::nullopt;
+                if (std::atomic_ref<const uint32_t>(
+                        *reinterpret_cast<const uint32_t*>(at))
+                        .load(std::memory_order_acquire) == 0)
+                    next_segment();
+                continue;
+            }
+
+            JournalRecord head;
+            std::memcpy(&head, at, sizeof(head));
+            if (length < sizeof(head) ||
+                length < JournalRecord::length_for(head.payload_size) ||
+                m_offset + length > m_mapping.size())
+                throw std::runtime_error("corrupt journal record in " +
+                                         journal_impl::segment_path(
+                                             m_dir, *m_index)
+                                             .string());
+            m_offset += length;
+            return JournalEntry{
+                head.time_ns,
+                Endpoint::ip_u32(head.source_ip, head.source_port),
+                head.topic,
+                std::span<const std::byte>(at + sizeof(head),
+                                           head.payload_size)};
+        }
+    }
+};
+
+} // namespace ufan::common
@@ -0,0 +1,370 @@
+#pragma once
+
+#include <ufan/protocol/header.hpp>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <bit>
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <new>
+#include <span>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace ufan::common {
+
+// Single-writer broadcast ring in POSIX shared memory (/dev/shm).
+//
+// The writer never waits for readers: like the UDP path it is lossy, and a
+// reader that falls a full ring behind skips ahead and counts what it
+// missed. Each slot is guarded by its own sequence number, written odd
+// while the slot is being filled and even once it is complete, so readers
+// need no locks and no syscalls. Readers copy a message out and check the
+// sequence again afterwards, so one the writer lapped mid-copy is dropped
+// rather than delivered torn.
+//
+// A restarted writer replaces the ring with a fresh object. The header's
+// generation moves on in the old one when it is replaced or its writer
+// exits, and readers still mapping it reattach by name.
+
+namespace shm_impl {
+
+inline constexpr uint64_t magic = 0x676e69726e616675ULL; // "ufanring"
+inline constexpr uint32_t version = 3;
+
+struct RingHeader {
+    // written last by the writer, once the rest of the header is valid
+    std::atomic<uint64_t> magic;
+    uint32_t version;
+    uint32_t slot_size;
+    uint64_t slot_count;
+    // one more than the ring this one replaced; bumped again once this
+    // ring is retired
+    std::atomic<uint64_t> generation;
+    alignas(64) std::atomic<uint64_t> write_index;
+};
+
+struct SlotHeader {
+    // 2n + 1 while message n is written, 2n + 2 once it is complete
+    std::atomic<uint64_t> seq;
+    uint16_t size;
+    protocol::Topic topic;
+};
+
+inline constexpr std::size_t slots_offset = 128;
+static_assert(sizeof(RingHeader) <= slots_offset);
+static_assert(std::atomic<uint64_t>::is_always_lock_free);
+
+inline std::string shm_path(const std::string& name) {
+    return name.starts_with('/') ? name : "/" + name;
+}
+
+inline std::string err(const char* what, const std::string& name) {
+    return std::string(what) + " " + name + ": " + std::strerror(errno);
+}
+
+// shared mapping of a whole shm object, unmapped on destruction
+class Mapping {
+  private:
+    void* m_ptr = MAP_FAILED;
+    std::size_t m_size = 0;
+
+  public:
+    Mapping() = default;
+    Mapping(int fd, std::size_t size, int prot) : m_size(size) {
+        m_ptr = ::mmap(nullptr, size, prot, MAP_SHARED | MAP_POPULATE, fd, 0);
+        if (m_ptr == MAP_FAILED)
+            throw std::runtime_error(std::string("mmap failed: ") +
+                                     std::strerror(errno));
+    }
+    ~Mapping() {
+        if (m_ptr != MAP_FAILED)
+            ::munmap(m_ptr, m_size);
+    }
+    Mapping(Mapping&& o) noexcept : m_ptr(o.m_ptr), m_size(o.m_size) {
+        o.m_ptr = MAP_FAILED;
+    }
+    Mapping& operator=(Mapping&& o) noexcept {
+        std::swap(m_ptr, o.m_ptr);
+        std::swap(m_size, o.m_size);
+        return *this;
+    }
+
+    std::byte* data() const noexcept { return static_cast<std::byte*>(m_ptr); }
+    std::size_t size() const noexcept { return m_size; }
+    bool mapped() const noexcept { return m_ptr != MAP_FAILED; }
+};
+
+// closes the descriptor once the mapping exists
+class FileDescriptor {
+  private:
+    int m_fd;
+
+  public:
+    explicit FileDescriptor(int fd) : m_fd(fd) {}
+    ~FileDescriptor() {
+        if (m_fd >= 0)
+            ::close(m_fd);
+    }
+    FileDescriptor(const FileDescriptor&) = delete;
+    FileDescriptor& operator=(const FileDescriptor&) = delete;
+    int get() const noexcept { return m_fd; }
+};
+
+// Moves the generation of the ring at path on, so its readers reattach,
+// and returns the generation a replacement should take; 1 if there is no
+// ring there.
+inline uint64_t retire(const std::string& path) {
+    FileDescriptor fd(::shm_open(path.c_str(), O_RDWR, 0));
+    struct stat st;
+    if (fd.get() < 0 || ::fstat(fd.get(), &st) < 0 ||
+        static_cast<std::size_t>(st.st_size) < slots_offset)
+        return 1;
+    Mapping mapping(fd.get(), slots_offset, PROT_READ | PROT_WRITE);
+    auto* header = reinterpret_cast<RingHeader*>(mapping.data());
+    if (header->magic.load(std::memory_order_acquire) != magic ||
+        header->version != version)
+        return 1;
+    return header->generation.fetch_add(1, std::memory_order_release) + 1;
+}
+
+} // namespace shm_impl
+
+class ShmWriter {
+  private:
+    std::string m_path;
+    shm_impl::Mapping m_mapping;
+    shm_impl::RingHeader* m_header = nullptr;
+    uint64_t m_slot_count = 0;
+    uint32_t m_slot_size = 0;
+    uint64_t m_next = 0;
+
+    shm_impl::SlotHeader* slot(uint64_t n) const noexcept {
+        return reinterpret_cast<shm_impl::SlotHeader*>(
+            m_mapping.data() + shm_impl::slots_offset +
+            (n & (m_slot_count - 1)) * m_slot_size);
+    }
+
+  public:
+    // Creates (or replaces) the ring at /dev/shm/<name>. slot_count must be
+    // a power of two; slot_size is rounded up to a whole cache line.
+    ShmWriter(const std::string& name, uint64_t slot_count,
+              uint32_t slot_size)
+        : m_path(shm_impl::shm_path(name)), m_slot_count(slot_count),
+          m_slot_size((slot_size + 63) & ~uint32_t(63)) {
+        if (!std::has_single_bit(slot_count))
+            throw std::runtime_error("shm ring slot count must be a power "
+                                     "of 2");
+        if (m_slot_size < sizeof(shm_impl::SlotHeader) + 1)
+            throw std::runtime_error("shm ring slot size too small");
+
+        // a fresh object, so readers of a previous ring never see its
+        // slots reset under them; the old one tells them to reattach
+        const auto generation = shm_impl::retire(m_path);
+        ::shm_unlink(m_path.c_str());
+        shm_impl::FileDescriptor fd(
+            ::shm_open(m_path.c_str(), O_CREAT | O_EXCL | O_RDWR, 0644));
+        if (fd.get() < 0)
+            throw std::runtime_error(shm_impl::err("shm_open", m_path));
+
+        const auto size = shm_impl::slots_offset + slot_count * m_slot_size;
+        if (::ftruncate(fd.get(), static_cast<off_t>(size)) < 0) {
+            ::shm_unlink(m_path.c_str());
+            throw std::runtime_error(shm_impl::err("ftruncate", m_path));
+        }
+        m_mapping = shm_impl::Mapping(fd.get(), size, PROT_READ | PROT_WRITE);
+
+        // zero-filled by ftruncate: every slot seq starts at 0
+        m_header = new (m_mapping.data()) shm_impl::RingHeader{};
+        m_header->slot_size = m_slot_size;
+        m_header->slot_count = slot_count;
+        m_header->version = shm_impl::version;
+        m_header->generation.store(generation, std::memory_order_relaxed);
+        m_header->magic.store(shm_impl::magic, std::memory_order_release);
+    }
+
+    ~ShmWriter() {
+        if (m_header) {
+            m_header->generation.fetch_add(1, std::memory_order_release);
+            ::shm_unlink(m_path.c_str());
+        }
+    }
+
+    ShmWriter(ShmWriter&& o) noexcept
+        : m_path(std::move(o.m_path)), m_mapping(std::move(o.m_mapping)),
+          m_header(std::exchange(o.m_header, nullptr)),
+          m_slot_count(o.m_slot_count), m_slot_size(o.m_slot_size),
+          m_next(o.m_next) {}
+    ShmWriter& operator=(ShmWriter&&) = delete;
+
+    std::size_t max_payload() const noexcept {
+        return std::min<std::size_t>(m_slot_size - sizeof(shm_impl::SlotHeader),
+                                     UINT16_MAX);
+    }
+
+    // returns false if data doesn't fit in a slot
+    bool write(protocol::Topic topic, std::span<const std::byte> data) {
+        if (data.size() > max_payload())
+            return false;
+
+        auto* s = slot(m_next);
+        s->seq.store(2 * m_next + 1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+        s->size = static_cast<uint16_t>(data.size());
+        s->topic = topic;
+        std::memcpy(reinterpret_cast<std::byte*>(s + 1), data.data(),
+                    data.size());
+        s->seq.store(2 * m_next + 2, std::memory_order_release);
+
+        m_next++;
+        m_header->write_index.store(m_next, std::memory_order_release);
+        return true;
+    }
+};
+
+class ShmReader {
+  private:
+    std::string m_path;
+    shm_impl::Mapping m_mapping;
+    const shm_impl::RingHeader* m_header = nullptr;
+    uint64_t m_generation = 0;
+    uint64_t m_slot_count = 0;
+    uint32_t m_slot_size = 0;
+    uint64_t m_next = 0;
+    uint64_t m_lost = 0;
+    // the message being delivered, copied out of its slot
+    std::vector<std::byte> m_payload;
+
+    const shm_impl::SlotHeader* slot(uint64_t n) const noexcept {
+        return reinterpret_cast<const shm_impl::SlotHeader*>(
+            m_mapping.data() + shm_impl::slots_offset +
+            (n & (m_slot_count - 1)) * m_slot_size);
+    }
+
+    std::size_t max_payload() const noexcept {
+        return m_slot_size - sizeof(shm_impl::SlotHeader);
+    }
+
+    // maps the ring now at m_path and starts at its newest message
+    void open() {
+        shm_impl::FileDescriptor fd(::shm_open(m_path.c_str(), O_RDONLY, 0));
+        if (fd.get() < 0)
+            throw std::runtime_error(shm_impl::err("shm_open", m_path));
+
+        struct stat st;
+        if (::fstat(fd.get(), &st) < 0)
+            throw std::runtime_error(shm_impl::err("fstat", m_path));
+        const auto size = static_cast<std::size_t>(st.st_size);
+        if (size < shm_impl::slots_offset)
+            throw std::runtime_error("shm ring " + m_path + " is not ready");
+        shm_impl::Mapping mapping(fd.get(), size, PROT_READ);
+
+        const auto* header =
+            reinterpret_cast<const shm_impl::RingHeader*>(mapping.data());
+        if (header->magic.load(std::memory_order_acquire) !=
+                shm_impl::magic ||
+            header->version != shm_impl::version)
+            throw std::runtime_error("shm ring " + m_path + " is not ready");
+
+        const auto slot_count = header->slot_count;
+        const auto slot_size = header->slot_size;
+        if (!std::has_single_bit(slot_count) ||
+            slot_size <= sizeof(shm_impl::SlotHeader) ||
+            size < shm_impl::slots_offset + slot_count * slot_size)
+            throw std::runtime_error("shm ring " + m_path + " is corrupt");
+
+        m_mapping = std::move(mapping);
+        m_header = header;
+        m_generation = m_header->generation.load(std::memory_order_acquire);
+        m_slot_count = slot_count;
+        m_slot_size = slot_size;
+        m_payload.resize(max_payload());
+        m_next = m_header->write_index.load(std::memory_order_acquire);
+    }
+
+    // follows a restarted writer to its new ring; until one exists the
+    // retired ring stays mapped and delivers nothing new
+    void reattach() {
+        try {
+            open();
+        } catch (const std::runtime_error&) {
+        }
+    }
+
+    void skip_to_writer() noexcept {
+        const auto head = m_header->write_index.load(std::memory_order_acquire);
+        // the oldest slot may be mid-overwrite, so resume half a ring back
+        const auto resume = head > m_slot_count / 2 ? head - m_slot_count / 2
+                                                    : 0;
+        if (resume > m_next) {
+            m_lost += resume - m_next;
+            m_next = resume;
+        } else {
+            // a malformed slot the writer has not lapped yet
+            m_lost++;
+            m_next++;
+        }
+    }
+
+  public:
+    // Maps an existing ring read-only and starts at its newest message.
+    explicit ShmReader(const std::string& name)
+        : m_path(shm_impl::shm_path(name)) {
+        open();
+    }
+
+    // messages skipped because the writer lapped this reader
+    uint64_t lost() const noexcept { return m_lost; }
+
+    // Calls f(topic, data) for up to max complete messages, data pointing
+    // into a copy that stays valid until the next poll. Returns the number
+    // of messages delivered.
+    template <typename F> std::size_t poll(F&& f, std::size_t max = SIZE_MAX) {
+        if (m_header->generation.load(std::memory_order_acquire) !=
+            m_generation)
+            reattach();
+
+        std::size_t delivered = 0;
+        while (delivered < max) {
+            const auto* s = slot(m_next);
+            const auto ready = 2 * m_next + 2;
+            const auto seq = s->seq.load(std::memory_order_acquire);
+            if (seq < ready)
+                break;
+            if (seq > ready) {
+                skip_to_writer();
+                continue;
+            }
+
+            const auto size = s->size;
+            const auto topic = s->topic;
+            std::memcpy(m_payload.data(),
+                        reinterpret_cast<const std::byte*>(s + 1),
+                        std::min<std::size_t>(size, max_payload()));
+            // the copy must be of message m_next, not a later lap
+            std::atomic_thread_fence(std::memory_order_acquire);
+            if (s->seq.load(std::memory_order_relaxed) != ready ||
+                size > max_payload()) {
+                skip_to_writer();
+                continue;
+            }
+
+            m_next++;
+            delivered++;
+            f(topic, std::span<const std::byte>(m_payload.data(), size));
+        }
+        return delivered;
+    }
+};
+
+} // namespace ufan::common
@@ -1,5 +1,6 @@
 #pragma once
 
+#include <algorithm>
 #include <arpa/inet.h>
 #include <cerrno>
 #include <cstddef>
@@ -7,14 +8,25 @@
 #include <cstring>
 #include <fcntl.h>
 #include <netinet/in.h>
+#include <netinet/udp.h>
 #include <optional>
 #include <span>
 #include <stdexcept>
 #include <string>
 #include <string_view>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <tuple>
 #include <unistd.h>
+#include <vector>
+
+// older libc headers lack the UDP offload options
+#ifndef UDP_SEGMENT
+#define UDP_SEGMENT 103
+#endif
+#ifndef UDP_GRO
+#define UDP_GRO 104
+#endif
 
 namespace ufan::common {
 
@@ -73,11 +85,195 @@ struct Endpoint {
 struct RecvFrom {
     std::size_t size{};
     Endpoint from{};
+    // size of each datagram coalesced into the read with UDP_GRO; equal
+    // to size when it holds just one
+    std::size_t segment_size{};
+};
+
+// Calls f(datagram) for each datagram of a read holding back-to-back
+// segment_size datagrams, only the last of which may be shorter, as
+// UDP_GRO delivers them.
+template <typename Byte, typename F>
+void for_each_segment(std::span<Byte> data, std::size_t segment_size,
+                      F&& f) {
+    if (segment_size == 0)
+        segment_size = data.size();
+    for (std::size_t offset = 0; offset < data.size(); offset += segment_size)
+        f(data.subspan(offset, std::min(segment_size, data.size() - offset)));
+}
+
+namespace socket_impl {
+
+// room for the one control message a read asks for, the UDP_GRO size
+inline constexpr std::size_t control_size = CMSG_SPACE(sizeof(int));
+
+// the UDP_GRO segment size in hdr's control messages, or 0 if none
+inline std::size_t gro_segment_size(const msghdr& hdr) noexcept {
+    auto& h = const_cast<msghdr&>(hdr);
+    for (auto* c = CMSG_FIRSTHDR(&h); c; c = CMSG_NXTHDR(&h, c)) {
+        if (c->cmsg_level == IPPROTO_UDP && c->cmsg_type == UDP_GRO) {
+            int size;
+            std::memcpy(&size, CMSG_DATA(c), sizeof(size));
+            return size > 0 ? static_cast<std::size_t>(size) : 0;
+        }
+    }
+    return 0;
+}
+
+} // namespace socket_impl
+
+// Preallocated receive slots for Socket::recv_batch. Each slot owns a
+// buffer_size region of one contiguous allocation; slot contents stay valid
+// until the next recv_batch into the same RecvBatch. With GRO enabled on
+// the socket a slot may hold several datagrams; see segment_size().
+class RecvBatch {
+  private:
+    std::size_t m_buffer_size;
+    std::size_t m_count = 0;
+    std::vector<std::byte> m_buffers;
+    std::vector<Endpoint> m_from;
+    std::vector<iovec> m_iovs;
+    std::vector<mmsghdr> m_msgs;
+    // control_size bytes per slot, kept aligned for cmsghdr
+    std::vector<cmsghdr> m_control;
+
+    static constexpr std::size_t control_headers =
+        (socket_impl::control_size + sizeof(cmsghdr) - 1) / sizeof(cmsghdr);
+
+    friend class Socket;
+
+    void prepare() noexcept {
+        for (std::size_t i = 0; i < m_msgs.size(); i++) {
+            m_msgs[i].msg_hdr.msg_namelen = sizeof(sockaddr_in);
+            m_msgs[i].msg_hdr.msg_controllen = socket_impl::control_size;
+            m_msgs[i].msg_len = 0;
+        }
+        m_count = 0;
+    }
+
+  public:
+    RecvBatch(std::size_t capacity, std::size_t buffer_size)
+        : m_buffer_size(buffer_size), m_buffers(capacity * buffer_size),
+          m_from(capacity), m_iovs(capacity), m_msgs(capacity),
+          m_control(capacity * control_headers) {
+        if (capacity == 0)
+            throw std::runtime_error("RecvBatch capacity must be non-zero");
+        for (std::size_t i = 0; i < capacity; i++) {
+            m_iovs[i].iov_base = m_buffers.data() + i * m_buffer_size;
+            m_iovs[i].iov_len = m_buffer_size;
+            std::memset(&m_msgs[i], 0, sizeof(mmsghdr));
+            m_msgs[i].msg_hdr.msg_name = &m_from[i].addr;
+            m_msgs[i].msg_hdr.msg_namelen = sizeof(sockaddr_in);
+            m_msgs[i].msg_hdr.msg_iov = &m_iovs[i];
+            m_msgs[i].msg_hdr.msg_iovlen = 1;
+            m_msgs[i].msg_hdr.msg_control = &m_control[i * control_headers];
+            m_msgs[i].msg_hdr.msg_controllen = socket_impl::control_size;
+        }
+    }
+
+    RecvBatch(RecvBatch&&) noexcept = default;
+    RecvBatch& operator=(RecvBatch&&) noexcept = default;
+    RecvBatch(const RecvBatch&) = delete;
+    RecvBatch& operator=(const RecvBatch&) = delete;
+
+    std::size_t capacity() const noexcept { return m_msgs.size(); }
+    std::size_t size() const noexcept { return m_count; }
+    bool empty() const noexcept { return m_count == 0; }
+
+    std::span<std::byte> data(std::size_t i) noexcept {
+        return {m_buffers.data() + i * m_buffer_size, m_msgs[i].msg_len};
+    }
+    std::span<const std::byte> data(std::size_t i) const noexcept {
+        return {m_buffers.data() + i * m_buffer_size, m_msgs[i].msg_len};
+    }
+    const Endpoint& from(std::size_t i) const noexcept { return m_from[i]; }
+
+    // size of each datagram in slot i, for common::for_each_segment; the
+    // whole slot unless the kernel coalesced several with UDP_GRO
+    std::size_t segment_size(std::size_t i) const noexcept {
+        const auto size = socket_impl::gro_segment_size(m_msgs[i].msg_hdr);
+        return size ? size : m_msgs[i].msg_len;
+    }
+};
+
+enum class SendResult : uint8_t {
+    sent,
+    // the socket buffer was full; worth retrying once it drains
+    would_block,
+    // refused for this datagram alone, e.g. an unroutable destination
+    failed,
+};
+
+// Outgoing datagrams queued for one Socket::send_batch call. Only the
+// destination is copied; payload spans must stay alive until the batch is
+// cleared. After a send, result(i) says what became of each datagram.
+class SendBatch {
+  private:
+    std::size_t m_count = 0;
+    std::vector<Endpoint> m_to;
+    std::vector<iovec> m_iovs;
+    std::vector<mmsghdr> m_msgs;
+    std::vector<SendResult> m_results;
+
+    friend class Socket;
+    friend class UringSocket;
+
+  public:
+    explicit SendBatch(std::size_t capacity)
+        : m_to(capacity), m_iovs(capacity), m_msgs(capacity),
+          m_results(capacity, SendResult::would_block) {
+        if (capacity == 0)
+            throw std::runtime_error("SendBatch capacity must be non-zero");
+        for (std::size_t i = 0; i < capacity; i++) {
+            std::memset(&m_msgs[i], 0, sizeof(mmsghdr));
+            m_msgs[i].msg_hdr.msg_name = &m_to[i].addr;
+            m_msgs[i].msg_hdr.msg_namelen = sizeof(sockaddr_in);
+            m_msgs[i].msg_hdr.msg_iov = &m_iovs[i];
+            m_msgs[i].msg_hdr.msg_iovlen = 1;
+        }
+    }
+
+    SendBatch(SendBatch&&) noexcept = default;
+    SendBatch& operator=(SendBatch&&) noexcept = default;
+    SendBatch(const SendBatch&) = delete;
+    SendBatch& operator=(const SendBatch&) = delete;
+
+    std::size_t capacity() const noexcept { return m_msgs.size(); }
+    std::size_t size() const noexcept { return m_count; }
+    bool empty() const noexcept { return m_count == 0; }
+    bool full() const noexcept { return m_count == m_msgs.size(); }
+
+    void clear() noexcept { m_count = 0; }
+
+    void push(const Endpoint& to, std::span<const std::byte> data) {
+        if (full())
+            throw std::runtime_error("push on full SendBatch");
+        m_to[m_count] = to;
+        m_iovs[m_count].iov_base = const_cast<std::byte*>(data.data());
+        m_iovs[m_count].iov_len = data.size();
+        m_results[m_count] = SendResult::would_block;
+        ++m_count;
+    }
+
+    const Endpoint& to(std::size_t i) const noexcept { return m_to[i]; }
+    std::span<const std::byte> data(std::size_t i) const noexcept {
+        return std::span<const std::byte>(
+            static_cast<const std::byte*>(m_iovs[i].iov_base),
+            m_iovs[i].iov_len);
+    }
+    SendResult result(std::size_t i) const noexcept { return m_results[i]; }
+    // for senders other than Socket and UringSocket, e.g. fakes in benches
+    void set_result(std::size_t i, SendResult result) noexcept {
+        m_results[i] = result;
+    }
 };
 
 class Socket {
   private:
     int m_fd{-1};
+    // set by enable_gso() and enable_gro() once the kernel accepted them
+    bool m_gso = false;
+    bool m_gro = false;
 
     static std::string err(const char* what) {
         return std::string(what) + " failed: " + std::strerror(errno);
@@ -98,11 +294,16 @@ class Socket {
 
     ~Socket() { close(); }
 
-    Socket(Socket&& o) noexcept : m_fd(o.m_fd) { o.m_fd = -1; }
+    Socket(Socket&& o) noexcept
+        : m_fd(o.m_fd), m_gso(o.m_gso), m_gro(o.m_gro) {
+        o.m_fd = -1;
+    }
     Socket& operator=(Socket&& o) noexcept {
         if (this != &o) {
             close();
             m_fd = o.m_fd;
+            m_gso = o.m_gso;
+            m_gro = o.m_gro;
             o.m_fd = -1;
         }
         return *this;
@@ -135,6 +336,112 @@ class Socket {
             throw std::runtime_error(err("fcntl(F_SETFL)"));
     }
 
+    // lets several sockets bind the same port; the kernel spreads incoming
+    // datagrams across them by source address
+    void set_reuse_port(bool on) {
+        if (m_fd < 0)
+            throw std::runtime_error("set_reuse_port on closed socket");
+        int value = on ? 1 : 0;
+        if (::setsockopt(m_fd, SOL_SOCKET, SO_REUSEPORT, &value,
+                         sizeof(value)) < 0)
+            throw std::runtime_error(err("setsockopt(SO_REUSEPORT)"));
+    }
+
+    // asks the kernel to busy poll the device queue for up to usec on
+    // blocking reads and epoll waits; raising it past
+    // net.core.busy_read needs CAP_NET_ADMIN
+    void set_busy_poll(int usec) {
+        if (m_fd < 0)
+            throw std::runtime_error("set_busy_poll on closed socket");
+        if (::setsockopt(m_fd, SOL_SOCKET, SO_BUSY_POLL, &usec,
+                         sizeof(usec)) < 0)
+            throw std::runtime_error(err("setsockopt(SO_BUSY_POLL)"));
+    }
+
+    // lets several sockets bind the same multicast group and port, each
+    // receiving every datagram sent to it
+    void set_reuse_addr(bool on) {
+        if (m_fd < 0)
+            throw std::runtime_error("set_reuse_addr on closed socket");
+        int value = on ? 1 : 0;
+        if (::setsockopt(m_fd, SOL_SOCKET, SO_REUSEADDR, &value,
+                         sizeof(value)) < 0)
+            throw std::runtime_error(err("setsockopt(SO_REUSEADDR)"));
+    }
+
+    // sends multicast out of the interface holding ip rather than the one
+    // the routing table picks; "127.0.0.1" keeps it on loopback
+    void set_multicast_interface(std::string_view ip) {
+        if (m_fd < 0)
+            throw std::runtime_error("set_multicast_interface on closed "
+                                     "socket");
+        auto interface = Endpoint::ip(ip, 0).addr.sin_addr;
+        if (::setsockopt(m_fd, IPPROTO_IP, IP_MULTICAST_IF, &interface,
+                         sizeof(interface)) < 0)
+            throw std::runtime_error(err("setsockopt(IP_MULTICAST_IF)"));
+    }
+
+    void set_multicast_ttl(int ttl) {
+        if (m_fd < 0)
+            throw std::runtime_error("set_multicast_ttl on closed socket");
+        if (::setsockopt(m_fd, IPPROTO_IP, IP_MULTICAST_TTL, &ttl,
+                         sizeof(ttl)) < 0)
+            throw std::runtime_error(err("setsockopt(IP_MULTICAST_TTL)"));
+    }
+
+    // joins group on the interface holding interface_ip; "0.0.0.0" lets
+    // the kernel pick one
+    void join_group(const Endpoint& group, std::string_view interface_ip) {
+        if (m_fd < 0)
+            throw std::runtime_error("join_group on closed socket");
+        ip_mreq request{};
+        request.imr_multiaddr = group.addr.sin_addr;
+        request.imr_interface = Endpoint::ip(interface_ip, 0).addr.sin_addr;
+        if (::setsockopt(m_fd, IPPROTO_IP, IP_ADD_MEMBERSHIP, &request,
+                         sizeof(request)) < 0)
+            throw std::runtime_error(err("setsockopt(IP_ADD_MEMBERSHIP)"));
+    }
+
+    // Lets send_segments hand the kernel a whole run of datagrams as one
+    // UDP_SEGMENT send (GSO), split at the device or, failing that, late
+    // in the stack. Returns false if the kernel lacks it, in which case
+    // send_segments uses sendmmsg.
+    bool enable_gso() {
+        if (m_fd < 0)
+            throw std::runtime_error("enable_gso on closed socket");
+        int value = 0;
+        socklen_t size = sizeof(value);
+        m_gso = ::getsockopt(m_fd, IPPROTO_UDP, UDP_SEGMENT, &value,
+                             &size) == 0;
+        return m_gso;
+    }
+
+    // Lets the kernel coalesce datagrams of one flow into a single read
+    // (UDP_GRO), reported through RecvFrom::segment_size and
+    // RecvBatch::segment_size. Returns false if the kernel lacks it.
+    bool enable_gro() {
+        if (m_fd < 0)
+            throw std::runtime_error("enable_gro on closed socket");
+        int value = 1;
+        m_gro = ::setsockopt(m_fd, IPPROTO_UDP, UDP_GRO, &value,
+                             sizeof(value)) == 0;
+        return m_gro;
+    }
+
+    bool gso() const noexcept { return m_gso; }
+    bool gro() const noexcept { return m_gro; }
+
+    Endpoint local_endpoint() const {
+        if (m_fd < 0)
+            throw std::runtime_error("local_endpoint on closed socket");
+        Endpoint local{};
+        socklen_t size = sizeof(sockaddr_in);
+        if (::getsockname(m_fd, reinterpret_cast<sockaddr*>(&local.addr),
+                          &size) < 0)
+            throw std::runtime_error(err("getsockname"));
+        return local;
+    }
+
     void bind(const Endpoint& local) {
         if (m_fd < 0)
             throw std::runtime_error("bind on closed socket");
@@ -155,15 +462,132 @@ class Socket {
         return static_cast<std::size_t>(n);
     }
 
+    // largest run send_segments takes, the kernel's UDP_MAX_SEGMENTS
+    static constexpr std::size_t max_segments = 64;
+    // largest UDP payload, which bounds a whole run
+    static constexpr std::size_t max_segments_size = 65507;
+
+    // Sends data, back-to-back segment_size datagrams of which only the
+    // last may be shorter, to one destination in one syscall: a single
+    // UDP_SEGMENT send once enable_gso() succeeded, else sendmmsg. A
+    // device that turns GSO down makes this socket fall back for good.
+    // Returns the bytes sent, short if the socket buffer filled part way.
+    std::size_t send_segments(const Endpoint& to,
+                              std::span<const std::byte> data,
+                              std::size_t segment_size) {
+        if (m_fd < 0)
+            throw std::runtime_error("send_segments on closed socket");
+        if (segment_size == 0 || data.size() > max_segments_size ||
+            (data.size() + segment_size - 1) / segment_size > max_segments)
+            throw std::runtime_error("invalid segments");
+
+        if (m_gso && data.size() > segment_size) {
+            iovec iov{const_cast<std::byte*>(data.data()), data.size()};
+            cmsghdr control[(CMSG_SPACE(sizeof(uint16_t)) + sizeof(cmsghdr) -
+                             1) /
+                            sizeof(cmsghdr)];
+            msghdr hdr{};
+            hdr.msg_name = const_cast<sockaddr_in*>(&to.addr);
+            hdr.msg_namelen = sizeof(sockaddr_in);
+            hdr.msg_iov = &iov;
+            hdr.msg_iovlen = 1;
+            hdr.msg_control = control;
+            hdr.msg_controllen = CMSG_SPACE(sizeof(uint16_t));
+            auto* c = CMSG_FIRSTHDR(&hdr);
+            c->cmsg_level = IPPROTO_UDP;
+            c->cmsg_type = UDP_SEGMENT;
+            c->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+            const auto size = static_cast<uint16_t>(segment_size);
+            std::memcpy(CMSG_DATA(c), &size, sizeof(size));
+
+            auto n = ::sendmsg(m_fd, &hdr, 0);
+            if (n >= 0)
+                return static_cast<std::size_t>(n);
+            // EIO: the device can't checksum the segments
+            if (errno != EIO && errno != EINVAL && errno != EOPNOTSUPP)
+                throw std::runtime_error(err("sendmsg(UDP_SEGMENT)"));
+            m_gso = false;
+        }
+
+        iovec iovs[max_segments];
+        mmsghdr msgs[max_segments];
+        std::size_t count = 0;
+        for_each_segment(data, segment_size, [&](auto segment) {
+            iovs[count] = {const_cast<std::byte*>(segment.data()),
+                           segment.size()};
+            std::memset(&msgs[count], 0, sizeof(mmsghdr));
+            msgs[count].msg_hdr.msg_name = const_cast<sockaddr_in*>(&to.addr);
+            msgs[count].msg_hdr.msg_namelen = sizeof(sockaddr_in);
+            msgs[count].msg_hdr.msg_iov = &iovs[count];
+            msgs[count].msg_hdr.msg_iovlen = 1;
+            count++;
+        });
+
+        std::size_t sent = 0;
+        std::size_t next = 0;
+        while (next < count) {
+            auto n = ::sendmmsg(m_fd, msgs + next,
+                                static_cast<unsigned int>(count - next), 0);
+            if (n < 0) {
+                if (sent > 0 && (errno == EAGAIN || errno == EWOULDBLOCK ||
+                                 errno == ENOBUFS))
+                    break;
+                throw std::runtime_error(err("sendmmsg"));
+            }
+            for (int i = 0; i < n; i++)
+                sent += iovs[next++].iov_len;
+        }
+        return sent;
+    }
+
+    // Sends head followed by payload as one datagram with a gather write,
+    // so a header need not be copied in front of a payload kept elsewhere.
+    std::size_t send_to(const Endpoint& to, std::span<const std::byte> head,
+                        std::span<const std::byte> payload) {
+        if (m_fd < 0)
+            throw std::runtime_error("send_to on closed socket");
+        iovec iov[2] = {
+            {const_cast<std::byte*>(head.data()), head.size()},
+            {const_cast<std::byte*>(payload.data()), payload.size()},
+        };
+        msghdr hdr{};
+        hdr.msg_name = const_cast<sockaddr_in*>(&to.addr);
+        hdr.msg_namelen = sizeof(sockaddr_in);
+        hdr.msg_iov = iov;
+        hdr.msg_iovlen = 2;
+        auto n = ::sendmsg(m_fd, &hdr, 0);
+        if (n < 0)
+            throw std::runtime_error(err("sendmsg"));
+        return static_cast<std::size_t>(n);
+    }
+
     std::optional<RecvFrom> recv_from(std::span<std::byte> out) {
         if (m_fd < 0)
             throw std::runtime_error("recv_from on closed socket");
 
         Endpoint from{};
-        socklen_t from_len = sizeof(sockaddr_in);
-
-        auto n = ::recvfrom(m_fd, out.data(), out.size(), 0,
-                            reinterpret_cast<sockaddr*>(&from.addr), &from_len);
+        ssize_t n;
+        std::size_t segment_size = 0;
+        if (m_gro) {
+            // recvmsg only when a coalesced read needs its segment size
+            iovec iov{out.data(), out.size()};
+            cmsghdr control[RecvBatch::control_headers];
+            msghdr hdr{};
+            hdr.msg_name = &from.addr;
+            hdr.msg_namelen = sizeof(sockaddr_in);
+            hdr.msg_iov = &iov;
+            hdr.msg_iovlen = 1;
+            hdr.msg_control = control;
+            hdr.msg_controllen = socket_impl::control_size;
+            n = ::recvmsg(m_fd, &hdr, 0);
+            if (n > 0)
+                segment_size = socket_impl::gro_segment_size(hdr);
+        } else {
+            socklen_t from_len = sizeof(sockaddr_in);
+            n = ::recvfrom(m_fd, out.data(), out.size(), 0,
+                           reinterpret_cast<sockaddr*>(&from.addr),
+                           &from_len);
+        }
 
         if (n < 0) {
             if (errno == EAGAIN || errno == EWOULDBLOCK)
@@ -173,7 +597,58 @@ class Socket {
 
         if (n == 0)
             return std::nullopt;
-        return RecvFrom{static_cast<std::size_t>(n), from};
+        const auto size = static_cast<std::size_t>(n);
+        return RecvFrom{size, from, segment_size ? segment_size : size};
+    }
+
+    // Receives up to min(max, batch.capacity()) datagrams with one recvmmsg
+    // call. Returns the number received (0 on EAGAIN).
+    std::size_t recv_batch(RecvBatch& batch, std::size_t max = SIZE_MAX) {
+        if (m_fd < 0)
+            throw std::runtime_error("recv_batch on closed socket");
+
+        batch.prepare();
+        auto n = ::recvmmsg(
+            m_fd, batch.m_msgs.data(),
+            static_cast<unsigned int>(std::min(max, batch.capacity())),
+            MSG_WAITFORONE, nullptr);
+        if (n < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return 0;
+            throw std::runtime_error(err("recvmmsg"));
+        }
+
+        batch.m_count = static_cast<std::size_t>(n);
+        return batch.m_count;
+    }
+
+    // Sends every queued datagram using as few sendmmsg calls as the kernel
+    // allows and records each one's SendResult; the caller clears the
+    // batch. A datagram the kernel refuses outright is skipped rather than
+    // failing the rest, and a full socket buffer leaves the remainder
+    // would_block. Returns the number of datagrams sent.
+    std::size_t send_batch(SendBatch& batch) {
+        if (m_fd < 0)
+            throw std::runtime_error("send_batch on closed socket");
+
+        std::size_t sent = 0;
+        std::size_t next = 0;
+        while (next < batch.size()) {
+            auto n = ::sendmmsg(m_fd, batch.m_msgs.data() + next,
+                                static_cast<unsigned int>(batch.size() - next),
+                                0);
+            if (n < 0) {
+                if (errno == EAGAIN || errno == EWOULDBLOCK ||
+                    errno == ENOBUFS)
+                    break;
+                batch.m_results[next++] = SendResult::failed;
+                continue;
+            }
+            for (int i = 0; i < n; i++)
+                batch.m_results[next++] = SendResult::sent;
+            sent += static_cast<std::size_t>(n);
+        }
+        return sent;
     }
 };
 
@@ -0,0 +1,447 @@
+#pragma once
+
+#include "socket.hpp"
+
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include <algorithm>
+#include <atomic>
+#include <bit>
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <span>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+namespace ufan::common {
+
+namespace uring_impl {
+inline int setup(unsigned entries, io_uring_params* params) {
+    return static_cast<int>(::syscall(__NR_io_uring_setup, entries, params));
+}
+
+inline int enter(int fd, unsigned to_submit, unsigned min_complete,
+                 unsigned flags) {
+    return static_cast<int>(::syscall(__NR_io_uring_enter, fd, to_submit,
+                                      min_complete, flags, nullptr, 0));
+}
+
+inline int register_(int fd, unsigned opcode, void* arg, unsigned nr_args) {
+    return static_cast<int>(
+        ::syscall(__NR_io_uring_register, fd, opcode, arg, nr_args));
+}
+
+template <typename T> inline T load_acquire(T* p) {
+    return std::atomic_ref<T>(*p).load(std::memory_order_acquire);
+}
+
+template <typename T> inline void store_release(T* p, T v) {
+    std::atomic_ref<T>(*p).store(v, std::memory_order_release);
+}
+
+// anonymous mapping that is unmapped on destruction
+class Mapping {
+  private:
+    void* m_ptr = MAP_FAILED;
+    std::size_t m_size = 0;
+
+  public:
+    Mapping() = default;
+    Mapping(int fd, std::size_t size, off_t offset) : m_size(size) {
+        m_ptr = ::mmap(nullptr, size, PROT_READ | PROT_WRITE,
+                       fd < 0 ? (MAP_PRIVATE | MAP_ANONYMOUS)
+                              : (MAP_SHARED | MAP_POPULATE),
+                       fd, offset);
+        if (m_ptr == MAP_FAILED)
+            throw std::runtime_error(std::string("mmap failed: ") +
+                                     std::strerror(errno));
+    }
+    ~Mapping() {
+        if (m_ptr != MAP_FAILED)
+            ::munmap(m_ptr, m_size);
+    }
+    Mapping(Mapping&& o) noexcept : m_ptr(o.m_ptr), m_size(o.m_size) {
+        o.m_ptr = MAP_FAILED;
+    }
+    Mapping& operator=(Mapping&& o) noexcept {
+        std::swap(m_ptr, o.m_ptr);
+        std::swap(m_size, o.m_size);
+        return *this;
+    }
+
+    template <typename T = std::byte> T* at(std::size_t offset) const {
+        return reinterpret_cast<T*>(static_cast<std::byte*>(m_ptr) + offset);
+    }
+};
+} // namespace uring_impl
+
+// io_uring alternative to the Socket batch API for a bound UDP socket.
+//
+// Receives come from one multishot recvmsg into a ring of kernel-provided
+// buffers, so an idle-to-busy transition needs no syscall and no per-recv
+// SQE. Received datagrams are handed out in place and their buffers are
+// recycled on the next recv_batch, matching the RecvBatch lifetime rules.
+// send_batch turns a whole SendBatch into SENDMSG SQEs and submits and
+// waits for them with a single io_uring_enter.
+//
+// Needs Linux 6.0 (multishot recvmsg, buffer rings); construction throws
+// on older kernels so callers can fall back to Socket.
+class UringSocket {
+  private:
+    static constexpr uint64_t recv_tag = 1;
+    static constexpr uint64_t send_tag = 2;
+    static constexpr uint16_t buffer_group = 0;
+
+    struct Received {
+        Endpoint from;
+        std::span<std::byte> data;
+    };
+
+    Socket m_socket;
+    int m_ring_fd = -1;
+
+    uring_impl::Mapping m_rings;
+    uring_impl::Mapping m_sqe_mapping;
+    io_uring_sqe* m_sqes;
+    unsigned* m_sq_head;
+    unsigned* m_sq_tail;
+    unsigned* m_sq_flags;
+    unsigned m_sq_mask;
+    unsigned m_sq_entries;
+    unsigned* m_cq_head;
+    unsigned* m_cq_tail;
+    unsigned m_cq_mask;
+    io_uring_cqe* m_cqes;
+    unsigned m_pending_sqes = 0;
+
+    std::size_t m_buffer_size;
+    unsigned m_n_buffers;
+    uring_impl::Mapping m_buffer_pool;
+    uring_impl::Mapping m_buffer_ring_mapping;
+    // io_uring_buf_ring can't be used directly from C++: its flexible array
+    // sits behind an empty struct that is one byte here and zero in C. The
+    // ring is an array of io_uring_buf whose first resv field is the tail.
+    io_uring_buf* m_buffer_ring;
+    uint16_t* m_buffer_ring_tail_ptr;
+    uint16_t m_buffer_ring_tail = 0;
+    std::vector<uint16_t> m_held_buffers;
+
+    msghdr m_recv_msghdr{};
+    bool m_recv_armed = false;
+
+    std::vector<Received> m_received;
+    std::vector<io_uring_cqe> m_deferred_recvs;
+
+    static std::string err(const char* what, int error) {
+        return std::string(what) + " failed: " + std::strerror(error);
+    }
+
+    std::byte* buffer(uint16_t id) const {
+        return m_buffer_pool.at(static_cast<std::size_t>(id) * m_buffer_size);
+    }
+
+    void provide_buffer(uint16_t id) {
+        auto& entry =
+            m_buffer_ring[m_buffer_ring_tail & (m_n_buffers - 1)];
+        entry.addr = reinterpret_cast<uint64_t>(buffer(id));
+        entry.len = static_cast<uint32_t>(m_buffer_size);
+        entry.bid = id;
+        ++m_buffer_ring_tail;
+    }
+
+    void commit_buffers() {
+        uring_impl::store_release(m_buffer_ring_tail_ptr, m_buffer_ring_tail);
+    }
+
+    io_uring_sqe* next_sqe() {
+        const unsigned head = uring_impl::load_acquire(m_sq_head);
+        const unsigned tail = *m_sq_tail;
+        if (tail - head >= m_sq_entries)
+            return nullptr;
+        auto* sqe = &m_sqes[tail & m_sq_mask];
+        std::memset(sqe, 0, sizeof(*sqe));
+        uring_impl::store_release(m_sq_tail, tail + 1);
+        ++m_pending_sqes;
+        return sqe;
+    }
+
+    int submit(unsigned min_complete, bool get_events = false) {
+        unsigned flags =
+            (min_complete || get_events) ? IORING_ENTER_GETEVENTS : 0;
+        int n = uring_impl::enter(m_ring_fd, m_pending_sqes, min_complete,
+                                  flags);
+        if (n < 0) {
+            if (errno == EINTR || errno == EAGAIN || errno == EBUSY)
+                return 0;
+            throw std::runtime_error(err("io_uring_enter", errno));
+        }
+        m_pending_sqes -= static_cast<unsigned>(n);
+        return n;
+    }
+
+    void arm_recv() {
+        auto* sqe = next_sqe();
+        if (!sqe)
+            return;
+        sqe->opcode = IORING_OP_RECVMSG;
+        sqe->fd = m_socket.fd();
+        sqe->addr = reinterpret_cast<uint64_t>(&m_recv_msghdr);
+        sqe->len = 1;
+        sqe->ioprio = IORING_RECV_MULTISHOT;
+        sqe->flags = IOSQE_BUFFER_SELECT;
+        sqe->buf_group = buffer_group;
+        sqe->user_data = recv_tag;
+        m_recv_armed = true;
+    }
+
+    template <typename F> void reap(F&& on_cqe) {
+        unsigned head = *m_cq_head;
+        const unsigned tail = uring_impl::load_acquire(m_cq_tail);
+        for (; head != tail; ++head) {
+            on_cqe(m_cqes[head & m_cq_mask]);
+        }
+        uring_impl::store_release(m_cq_head, head);
+    }
+
+    void on_recv(const io_uring_cqe& cqe) {
+        if (!(cqe.flags & IORING_CQE_F_MORE))
+            m_recv_armed = false;
+
+        if (cqe.res < 0) {
+            // out of provided buffers: re-armed once buffers are recycled
+            if (cqe.res == -ENOBUFS)
+                return;
+            throw std::runtime_error(err("recvmsg", -cqe.res));
+        }
+        if (!(cqe.flags & IORING_CQE_F_BUFFER))
+            return;
+
+        const auto id = static_cast<uint16_t>(cqe.flags >>
+                                              IORING_CQE_BUFFER_SHIFT);
+        m_held_buffers.push_back(id);
+
+        auto* base = buffer(id);
+        const auto* out = reinterpret_cast<const io_uring_recvmsg_out*>(base);
+        if ((out->flags & MSG_TRUNC) || out->namelen > sizeof(sockaddr_in))
+            return;
+
+        Received received;
+        std::memcpy(&received.from.addr, base + sizeof(io_uring_recvmsg_out),
+                    sizeof(sockaddr_in));
+        received.data = {base + sizeof(io_uring_recvmsg_out) +
+                             m_recv_msghdr.msg_namelen +
+                             m_recv_msghdr.msg_controllen,
+                         out->payloadlen};
+        m_received.push_back(received);
+    }
+
+  public:
+    UringSocket(Socket socket, unsigned n_buffers = 256,
+                std::size_t max_datagram = 65535)
+        : m_socket(std::move(socket)) {
+        if (!m_socket)
+            throw std::runtime_error("UringSocket on closed socket");
+        if (n_buffers == 0 || n_buffers > 32768)
+            throw std::runtime_error("UringSocket needs 1..32768 buffers");
+        m_n_buffers = std::bit_ceil(n_buffers);
+        m_buffer_size =
+            sizeof(io_uring_recvmsg_out) + sizeof(sockaddr_in) + max_datagram;
+
+        constexpr unsigned sq_entries = 64;
+        io_uring_params params{};
+        params.flags = IORING_SETUP_CQSIZE | IORING_SETUP_COOP_TASKRUN |
+                       IORING_SETUP_TASKRUN_FLAG;
+        params.cq_entries = std::max(m_n_buffers * 2, sq_entries * 2);
+        m_ring_fd = uring_impl::setup(sq_entries, &params);
+        if (m_ring_fd < 0 && errno == EINVAL) {
+            params = {};
+            params.flags = IORING_SETUP_CQSIZE;
+            params.cq_entries = std::max(m_n_buffers * 2, sq_entries * 2);
+            m_ring_fd = uring_impl::setup(sq_entries, &params);
+        }
+        if (m_ring_fd < 0)
+            throw std::runtime_error(err("io_uring_setup", errno));
+
+        try {
+            if (!(params.features & IORING_FEAT_SINGLE_MMAP))
+                throw std::runtime_error("io_uring lacks FEAT_SINGLE_MMAP");
+
+            const std::size_t sq_size =
+                params.sq_off.array + params.sq_entries * sizeof(unsigned);
+            const std::size_t cq_size =
+                params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+            m_rings = uring_impl::Mapping(m_ring_fd, std::max(sq_size, cq_size),
+                                          IORING_OFF_SQ_RING);
+            m_sqe_mapping = uring_impl::Mapping(
+                m_ring_fd, params.sq_entries * sizeof(io_uring_sqe),
+                IORING_OFF_SQES);
+
+            m_sqes = m_sqe_mapping.at<io_uring_sqe>(0);
+            m_sq_head = m_rings.at<unsigned>(params.sq_off.head);
+            m_sq_tail = m_rings.at<unsigned>(params.sq_off.tail);
+            m_sq_flags = m_rings.at<unsigned>(params.sq_off.flags);
+            m_sq_mask = *m_rings.at<unsigned>(params.sq_off.ring_mask);
+            m_sq_entries = *m_rings.at<unsigned>(params.sq_off.ring_entries);
+            m_cq_head = m_rings.at<unsigned>(params.cq_off.head);
+            m_cq_tail = m_rings.at<unsigned>(params.cq_off.tail);
+            m_cq_mask = *m_rings.at<unsigned>(params.cq_off.ring_mask);
+            m_cqes = m_rings.at<io_uring_cqe>(params.cq_off.cqes);
+
+            // SQ index array is the identity; slots are used in order
+            auto* sq_array = m_rings.at<unsigned>(params.sq_off.array);
+            for (unsigned i = 0; i < m_sq_entries; i++)
+                sq_array[i] = i;
+
+            m_buffer_pool =
+                uring_impl::Mapping(-1, m_n_buffers * m_buffer_size, 0);
+            m_buffer_ring_mapping = uring_impl::Mapping(
+                -1, m_n_buffers * sizeof(io_uring_buf), 0);
+            m_buffer_ring = m_buffer_ring_mapping.at<io_uring_buf>(0);
+            m_buffer_ring_tail_ptr = m_buffer_ring_mapping.at<uint16_t>(
+                offsetof(io_uring_buf, resv));
+
+            io_uring_buf_reg reg{};
+            reg.ring_addr = reinterpret_cast<uint64_t>(m_buffer_ring);
+            reg.ring_entries = m_n_buffers;
+            reg.bgid = buffer_group;
+            if (uring_impl::register_(m_ring_fd, IORING_REGISTER_PBUF_RING,
+                                      &reg, 1) < 0)
+                throw std::runtime_error(
+                    err("io_uring_register(PBUF_RING)", errno));
+
+            for (unsigned i = 0; i < m_n_buffers; i++)
+                provide_buffer(static_cast<uint16_t>(i));
+            commit_buffers();
+        } catch (...) {
+            ::close(m_ring_fd);
+            throw;
+        }
+
+        m_recv_msghdr.msg_namelen = sizeof(sockaddr_in);
+        m_held_buffers.reserve(m_n_buffers);
+        m_received.reserve(m_n_buffers);
+    }
+
+    ~UringSocket() {
+        if (m_ring_fd >= 0)
+            ::close(m_ring_fd);
+    }
+
+    UringSocket(const UringSocket&) = delete;
+    UringSocket& operator=(const UringSocket&) = delete;
+
+    int fd() const noexcept { return m_socket.fd(); }
+
+    // readable while completions are waiting in the CQ; a sleeping wait
+    // on it is interrupted (EINTR) when a receive needs its task work run
+    int ring_fd() const noexcept { return m_ring_fd; }
+
+    std::size_t send_to(const Endpoint& to, std::span<const std::byte> data) {
+        return m_socket.send_to(to, data);
+    }
+    std::size_t send_to(const Endpoint& to, std::span<const std::byte> head,
+                        std::span<const std::byte> payload) {
+        return m_socket.send_to(to, head, payload);
+    }
+
+    // Reaps received datagrams, recycling the buffers handed out by the
+    // previous call. Stops reading the CQ after max datagrams, though
+    // completions parked during send_batch are always returned. Returns the
+    // number available through from(i) and data(i).
+    std::size_t recv_batch(std::size_t max) {
+        for (auto id : m_held_buffers)
+            provide_buffer(id);
+        if (!m_held_buffers.empty())
+            commit_buffers();
+        m_held_buffers.clear();
+        m_received.clear();
+
+        if (!m_recv_armed)
+            arm_recv();
+
+        // with COOP_TASKRUN completions wait for us to enter the kernel, so
+        // only do so when there is something to submit or run
+        const bool run_tasks =
+            uring_impl::load_acquire(m_sq_flags) & IORING_SQ_TASKRUN;
+        if (m_pending_sqes || run_tasks)
+            submit(0, run_tasks);
+
+        for (const auto& cqe : m_deferred_recvs)
+            on_recv(cqe);
+        m_deferred_recvs.clear();
+
+        unsigned head = *m_cq_head;
+        const unsigned tail = uring_impl::load_acquire(m_cq_tail);
+        for (; head != tail && m_received.size() < max; ++head) {
+            const auto& cqe = m_cqes[head & m_cq_mask];
+            if (cqe.user_data == recv_tag)
+                on_recv(cqe);
+        }
+        uring_impl::store_release(m_cq_head, head);
+
+        return m_received.size();
+    }
+
+    const Endpoint& from(std::size_t i) const noexcept {
+        return m_received[i].from;
+    }
+    std::span<std::byte> data(std::size_t i) const noexcept {
+        return m_received[i].data;
+    }
+
+    // Submits every queued datagram and waits for their completions with
+    // one io_uring_enter per SQ-full of messages, recording each one's
+    // SendResult. Returns the number sent, mirroring Socket::send_batch.
+    std::size_t send_batch(SendBatch& batch) {
+        std::size_t sent = 0;
+
+        std::size_t next = 0;
+        while (next < batch.size()) {
+            unsigned queued = 0;
+            while (next < batch.size()) {
+                auto* sqe = next_sqe();
+                if (!sqe)
+                    break;
+                sqe->opcode = IORING_OP_SENDMSG;
+                sqe->fd = m_socket.fd();
+                sqe->addr =
+                    reinterpret_cast<uint64_t>(&batch.m_msgs[next].msg_hdr);
+                sqe->len = 1;
+                // the low byte tags sends, the rest is the batch index
+                sqe->user_data = send_tag | (next << 8);
+                ++queued;
+                ++next;
+            }
+
+            unsigned completed = 0;
+            while (completed < queued) {
+                submit(queued - completed);
+                reap([&](const io_uring_cqe& cqe) {
+                    // parked for the next recv_batch so no datagram is lost
+                    if (cqe.user_data == recv_tag) {
+                        m_deferred_recvs.push_back(cqe);
+                        return;
+                    }
+                    ++completed;
+                    auto& result = batch.m_results[cqe.user_data >> 8];
+                    if (cqe.res >= 0) {
+                        result = SendResult::sent;
+                        ++sent;
+                    } else if (cqe.res == -EAGAIN || cqe.res == -ENOBUFS) {
+                        result = SendResult::would_block;
+                    } else {
+                        result = SendResult::failed;
+                    }
+                });
+            }
+        }
+        return sent;
+    }
+};
+
+} // namespace ufan::common
@@ -0,0 +1,156 @@
+#pragma once
+
+#include "interrupts.hpp"
+
+#include <sched.h>
+#include <sys/epoll.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+
+namespace ufan::common {
+
+enum class WaitMode : uint8_t {
+    // never give up the core; lowest latency
+    busy_poll,
+    // spin for the budget, then sched_yield between polls
+    spin_yield,
+    // spin for the budget, then block in epoll_wait on the watched fds
+    spin_epoll,
+};
+
+inline std::optional<WaitMode> wait_mode_from_string(std::string_view name) {
+    if (name == "busy")
+        return WaitMode::busy_poll;
+    if (name == "yield")
+        return WaitMode::spin_yield;
+    if (name == "epoll")
+        return WaitMode::spin_epoll;
+    return std::nullopt;
+}
+
+struct WaitConfig {
+    WaitMode mode = WaitMode::busy_poll;
+    // consecutive empty polls before yielding or blocking
+    uint32_t spin_budget = 10000;
+    // upper bound on one epoll_wait, so timers still run while idle
+    int epoll_timeout_ms = 100;
+};
+
+// Decides what a poll loop does after a poll that found no work. Call
+// idle() after every empty poll and reset() after every productive one.
+class WaitStrategy {
+  private:
+    WaitConfig m_config;
+    int m_epoll_fd = -1;
+    uint32_t m_idle_polls = 0;
+
+    static std::string err(const char* what) {
+        return std::string(what) + " failed: " + std::strerror(errno);
+    }
+
+    void control(int op, int fd, uint32_t events) {
+        if (m_epoll_fd < 0)
+            return;
+        epoll_event event{};
+        event.events = events;
+        event.data.fd = fd;
+        if (::epoll_ctl(m_epoll_fd, op, fd, &event) < 0)
+            throw std::runtime_error(err("epoll_ctl"));
+    }
+
+  public:
+    explicit WaitStrategy(WaitConfig config = {}) : m_config(config) {
+        if (m_config.mode == WaitMode::spin_epoll) {
+            m_epoll_fd = ::epoll_create1(EPOLL_CLOEXEC);
+            if (m_epoll_fd < 0)
+                throw std::runtime_error(err("epoll_create1"));
+        }
+    }
+
+    ~WaitStrategy() {
+        if (m_epoll_fd >= 0)
+            ::close(m_epoll_fd);
+    }
+
+    WaitStrategy(WaitStrategy&& o) noexcept
+        : m_config(o.m_config), m_epoll_fd(o.m_epoll_fd),
+          m_idle_polls(o.m_idle_polls) {
+        o.m_epoll_fd = -1;
+    }
+    WaitStrategy& operator=(WaitStrategy&&) = delete;
+    WaitStrategy(const WaitStrategy&) = delete;
+    WaitStrategy& operator=(const WaitStrategy&) = delete;
+
+    const WaitConfig& config() const noexcept { return m_config; }
+
+    // the epoll fd in spin_epoll mode, -1 otherwise; it is itself readable
+    // while any watched fd is, so it can be watched in turn
+    int fd() const noexcept { return m_epoll_fd; }
+
+    // wakes an epoll wait on events on fd, readability by default; no-op
+    // in other modes
+    void watch(int fd, uint32_t events = EPOLLIN) {
+        control(EPOLL_CTL_ADD, fd, events);
+    }
+
+    // replaces the events watched on fd
+    void rewatch(int fd, uint32_t events) {
+        control(EPOLL_CTL_MOD, fd, events);
+    }
+
+    void reset() noexcept { m_idle_polls = 0; }
+
+    // true if the next idle() blocks in epoll_wait
+    bool will_block() const noexcept {
+        return m_config.mode == WaitMode::spin_epoll &&
+               m_idle_polls >= m_config.spin_budget;
+    }
+
+    // Returns true if the thread yielded or slept, i.e. time may have
+    // passed and periodic work is due a check.
+    bool idle() {
+        if (m_config.mode == WaitMode::busy_poll)
+            return false;
+        if (m_idle_polls < m_config.spin_budget) {
+            ++m_idle_polls;
+            return false;
+        }
+        if (m_config.mode == WaitMode::spin_yield) {
+            ::sched_yield();
+            return true;
+        }
+
+        epoll_event event;
+        int n = ::epoll_wait(m_epoll_fd, &event, 1, m_config.epoll_timeout_ms);
+        if (n < 0 && errno != EINTR)
+            throw std::runtime_error(err("epoll_wait"));
+        // woken by traffic, or by io_uring task work interrupting the
+        // wait: spin again in case more follows; on timeout go straight
+        // back to sleep on the next empty poll
+        if (n > 0 || (n < 0 && errno == EINTR))
+            m_idle_polls = 0;
+        return true;
+    }
+};
+
+// run_forever for lambdas that report whether they found work, letting
+// wait decide how to idle between empty polls
+template <typename F> inline void run_forever(F&& lambda, WaitStrategy& wait) {
+    interrupts_impl::setup();
+    while (interrupts_impl::should_run) {
+        if (lambda()) {
+            wait.reset();
+        } else {
+            wait.idle();
+        }
+    }
+}
+
+} // namespace ufan::common
@@ -2,60 +2,144 @@
 
 #include <cstddef>
 #include <cstdint>
-#include <sstream>
+#include <cstdio>
+#include <cstring>
+#include <functional>
+#include <optional>
+#include <span>
 #include <string>
+#include <string_view>
 
 namespace ufan::protocol {
 
 enum class MessageType : uint8_t {
     heartbeat = 'H',
     subscribe = 'S',
+    unsubscribe = 'U',
     publish = 'P',
+    batch = 'B',
+    stats = 'T',
+    multicast = 'M',
+    join = 'J',
+    sequenced = 'Q',
+    nak = 'N',
+    configure = 'C',
     error = 'E',
 };
 
+// What the server does with a subscriber whose egress queue is full, i.e.
+// one it can't send to as fast as publishes arrive.
+enum class SlowConsumerPolicy : uint8_t {
+    // whatever the server is configured with
+    server_default = 0,
+    // discard the oldest queued message
+    drop_oldest = 1,
+    // keep only the newest queued message per topic, else drop the oldest
+    conflate = 2,
+    // drop everything queued and the client's subscriptions
+    disconnect = 3,
+};
+
+inline std::optional<SlowConsumerPolicy>
+slow_consumer_policy_from_string(std::string_view name) {
+    if (name == "drop-oldest")
+        return SlowConsumerPolicy::drop_oldest;
+    if (name == "conflate")
+        return SlowConsumerPolicy::conflate;
+    if (name == "disconnect")
+        return SlowConsumerPolicy::disconnect;
+    return std::nullopt;
+}
+
+// A topic is up to 8 dot-separated levels. Each level is a 32-bit key:
+// a Bloom signature of the level's token (key_bits bits picked by its
+// hash), all ones for a '*' wildcard, and 0 where the topic has no such
+// level. A published topic matches a pattern when at every level its key
+// is covered by the pattern's, i.e. (published & pattern) == published,
+// except that an absent level only matches an absent level. A pattern key
+// may OR several tokens' keys together to accept any of them. Two
+// distinct tokens share a key about once in 5000 (32 choose 3), so
+// subscribers still check what they receive but rarely discard anything.
 struct [[gnu::packed]] Topic {
-    uint8_t keys[8];
+    static constexpr std::size_t levels = 8;
+    static constexpr uint32_t wildcard = ~uint32_t(0);
+    // bits set per token; more cuts false matches between single tokens
+    // but fills ORed pattern keys sooner
+    static constexpr unsigned key_bits = 3;
+
+    uint32_t keys[levels];
 
     bool operator==(const Topic& other) const noexcept {
-        static_assert(sizeof(Topic) == sizeof(uint64_t));
-        return (*((const uint64_t*)keys)) == (*((const uint64_t*)other.keys));
+        return std::memcmp(keys, other.keys, sizeof(keys)) == 0;
     };
 
-    bool matches(const Topic& other) const noexcept {
-        for (size_t i = 0; i < 8; i++) {
-            if ((keys[i] != other.keys[i]) && (!(keys[i] & other.keys[i])))
-                return false;
+    // whether this published topic matches pattern; see also
+    // protocol::find_match for many patterns at once
+    bool matches(const Topic& pattern) const noexcept {
+        bool ok = true;
+        for (std::size_t i = 0; i < levels; i++) {
+            const uint32_t p = keys[i];
+            const uint32_t s = pattern.keys[i];
+            ok &= (p & s) == p && (p != 0 || s == 0);
         }
-        return true;
+        return ok;
     }
 
-    static Topic from_string(const std::string topic) {
-        Topic out;
-        std::memset(out.keys, 0, sizeof(out.keys));
+    static constexpr uint32_t key_of(std::string_view token) noexcept {
+        // FNV-1a, then a 64-bit finalizer to spread it over every bit
+        uint64_t h = 0xcbf29ce484222325ULL;
+        for (char c : token) {
+            h ^= static_cast<uint8_t>(c);
+            h *= 0x100000001b3ULL;
+        }
+        h ^= h >> 33;
+        h *= 0xff51afd7ed558ccdULL;
+        h ^= h >> 33;
+        h *= 0xc4ceb9fe1a85ec53ULL;
+        h ^= h >> 33;
 
-        std::string token;
-        std::stringstream stream(topic);
+        uint32_t key = 0;
+        for (unsigned i = 0; i < key_bits; i++, h >>= 5)
+            key |= uint32_t(1) << (h & 31);
+        return key;
+    }
 
-        size_t idx = 0;
-        while (std::getline(stream, token, '.')) {
-            if (token == "*") {
-                out.keys[idx] = 0xFF;
-            } else if (token == ">") {
-                for (size_t i = idx; i < 8; i++) {
-                    out.keys[i] = 0xFF;
-                }
+    // "a.b.c" names a topic; in patterns "*" matches any one level and a
+    // final ">" any remaining levels. Levels past the eighth are ignored.
+    static constexpr Topic from_string(std::string_view topic) noexcept {
+        Topic out{};
+        std::size_t level = 0;
+        while (level < levels) {
+            const auto dot = topic.find('.');
+            const auto token = topic.substr(0, dot);
+            if (token == ">") {
+                for (; level < levels; level++)
+                    out.keys[level] = wildcard;
                 break;
-            } else {
-                for (auto c : token) {
-                    out.keys[idx] |= 1 << (c - 'a');
-                }
             }
-            ++idx;
-            if (idx >= 8)
+            out.keys[level++] = token == "*" ? wildcard : key_of(token);
+            if (dot == std::string_view::npos)
                 break;
+            topic.remove_prefix(dot + 1);
         }
+        return out;
+    }
 
+    // the keys in hex, for logs; the token names are not kept
+    std::string to_string() const {
+        std::string out;
+        char key[9];
+        for (std::size_t i = 0; i < levels; i++) {
+            if (i)
+                out += '.';
+            const uint32_t k = keys[i];
+            if (k == wildcard) {
+                out += '*';
+            } else {
+                std::snprintf(key, sizeof(key), "%x", k);
+                out += key;
+            }
+        }
         return out;
     }
 };
@@ -89,13 +173,114 @@ struct [[gnu::packed]] Header {
     static Header subscribe(Topic topic) {
         return Header(MessageType::subscribe, topic);
     }
+    static Header unsubscribe(Topic topic) {
+        return Header(MessageType::unsubscribe, topic);
+    }
+    // a packed frame of publish records; the timestamp field holds the
+    // record count
+    static Header batch(int64_t records) {
+        return Header(MessageType::batch, records);
+    }
+    // a stats request, or a reply carrying one protocol::Stats per worker
+    static Header stats(int64_t timestamp) {
+        return Header(MessageType::stats, timestamp);
+    }
+    // tells a subscriber which group carries a subscription; the payload
+    // is a MulticastGroup
+    static Header multicast(Topic topic) {
+        return Header(MessageType::multicast, topic);
+    }
+    // a subscriber's reply once it has joined the group for topic
+    static Header join(Topic topic) { return Header(MessageType::join, topic); }
+    // a publish followed by its Sequence, sent to subscribers when the
+    // server keeps a retransmit ring
+    static Header sequenced(Topic topic) {
+        return Header(MessageType::sequenced, topic);
+    }
+    // from a subscriber, asks for the messages a Nak names; from the
+    // server, says they are gone
+    static Header nak(Topic topic) { return Header(MessageType::nak, topic); }
+    // sets the sender's SlowConsumerPolicy, carried in the timestamp field
+    static Header configure(SlowConsumerPolicy policy) {
+        return Header(MessageType::configure, static_cast<int64_t>(policy));
+    }
     static Header error() { return Header(MessageType::error, 0); }
 
     MessageType type() const { return type_; }
     Topic topic() const { return topic_or_timestamp_.topic; }
     int64_t timestamp() const { return topic_or_timestamp_.timestamp; }
+
+    // the header in wire form, e.g. to send ahead of a payload kept
+    // elsewhere with Socket::send_to(to, head, payload)
+    std::span<const std::byte> bytes() const noexcept {
+        return {reinterpret_cast<const std::byte*>(this), sizeof(Header)};
+    }
+};
+
+static_assert(sizeof(Header) == 2 + sizeof(Topic));
+
+// Prefix of one record in a batch frame, followed by size payload bytes.
+// It is the same size as Header so the server can rewrite a record in place
+// into a standalone publish message.
+struct [[gnu::packed]] RecordHeader {
+    uint16_t size;
+    Topic topic;
 };
 
-static_assert(sizeof(Header) == 10ULL);
+static_assert(sizeof(RecordHeader) == sizeof(Header));
+
+// Payload of a multicast message: the IPv4 group and port, both in network
+// byte order.
+struct [[gnu::packed]] MulticastGroup {
+    uint32_t address;
+    uint16_t port;
+};
+
+// Follows the header of a sequenced publish, ahead of the payload. seq
+// counts the header topic's messages through one server stream (a worker,
+// numbered from 1) and restarts when the server's epoch changes. position
+// is the message's place in the stream's retransmit ring and prev that of
+// the topic's previous message, or no_position. Host byte order.
+struct [[gnu::packed]] Sequence {
+    uint32_t epoch;
+    uint16_t stream;
+    uint64_t seq;
+    uint64_t position;
+    uint64_t prev;
+};
+
+inline constexpr uint64_t no_position = ~uint64_t(0);
+
+// Payload of a nak: seqs first..last of the header topic in a stream are
+// missing, and position is where the message that revealed the gap sits in
+// the ring. The server walks back from there through each message's prev.
+struct [[gnu::packed]] Nak {
+    uint32_t epoch;
+    uint16_t stream;
+    uint64_t first;
+    uint64_t last;
+    uint64_t position;
+};
+
+// most seqs one nak may name; the server ignores larger ranges, so a nak
+// can never ask for more than this many resends
+inline constexpr uint64_t max_nak = 1024;
+
+// subscriptions the server keeps per endpoint; heartbeat replies list them
+// all, so this bounds the reply size
+inline constexpr std::size_t max_subscriptions = 256;
 
 } // namespace ufan::protocol
+
+namespace std {
+template <> struct hash<ufan::protocol::Topic> {
+    std::size_t operator()(const ufan::protocol::Topic& topic) const noexcept {
+        uint64_t words[sizeof(topic) / sizeof(uint64_t)];
+        std::memcpy(words, &topic, sizeof(words));
+        uint64_t h = 0;
+        for (auto word : words)
+            h = (h ^ word) * 0x9e3779b97f4a7c15ULL;
+        return std::hash<uint64_t>{}(h ^ (h >> 29));
+    }
+};
+} // namespace std
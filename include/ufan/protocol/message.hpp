@@ -2,7 +2,10 @@
 
 #include "header.hpp"
 
+#include <algorithm>
 #include <cstddef>
+#include <cstdint>
+#include <cstring>
 #include <span>
 #include <stdexcept>
 #include <string>
@@ -17,6 +20,15 @@ class MessageConstructor {
     std::vector<std::byte> m_message;
 
   public:
+    // overwrites the header of an already serialized message in place
+    static void rewrite(std::span<std::byte> message, Header header) {
+        if (message.size() < sizeof(Header)) {
+            throw std::runtime_error("invalid header");
+        }
+        std::copy((std::byte*)&header, ((std::byte*)&header) + sizeof(Header),
+                  message.data());
+    }
+
     std::span<const std::byte> construct(Header header) {
         m_message.resize(sizeof(Header));
         std::copy((std::byte*)&header, ((std::byte*)&header) + sizeof(Header),
@@ -46,11 +58,173 @@ class MessageConstructor {
     }
 };
 
+// Room for a header in front of a caller's own buffer, so a payload can be
+// serialized in place and sent as a message without being copied:
+//
+//   std::array<std::byte, 256> buffer;
+//   auto n = serialize(HeaderRoom::payload(buffer));
+//   publisher.publish_in_place(topic, buffer, n);
+struct HeaderRoom {
+    static constexpr std::size_t size = sizeof(Header);
+
+    // where the payload goes in buffer
+    static std::span<std::byte> payload(std::span<std::byte> buffer) {
+        if (buffer.size() < size) {
+            throw std::runtime_error("no room for header");
+        }
+        return buffer.subspan(size);
+    }
+
+    // writes header in front of the first payload_size payload bytes and
+    // returns the message
+    static std::span<const std::byte>
+    seal(std::span<std::byte> buffer, Header header, std::size_t payload_size) {
+        if (buffer.size() < size || buffer.size() - size < payload_size) {
+            throw std::runtime_error("payload overruns buffer");
+        }
+        MessageConstructor::rewrite(buffer, header);
+        return buffer.first(size + payload_size);
+    }
+};
+
+// Packs publish records into one batch frame of at most max_size bytes.
+class BatchConstructor {
+  private:
+    std::vector<std::byte> m_message;
+    std::size_t m_max_size;
+    int64_t m_records = 0;
+
+  public:
+    explicit BatchConstructor(std::size_t max_size) : m_max_size(max_size) {
+        if (max_size < sizeof(Header) + sizeof(RecordHeader)) {
+            throw std::runtime_error("batch size too small");
+        }
+        m_message.reserve(max_size);
+        m_message.resize(sizeof(Header));
+    }
+
+    std::size_t max_size() const noexcept { return m_max_size; }
+    int64_t records() const noexcept { return m_records; }
+    bool empty() const noexcept { return m_records == 0; }
+
+    // largest payload a record in an otherwise empty frame can carry
+    std::size_t max_payload() const noexcept {
+        return std::min<std::size_t>(
+            m_max_size - sizeof(Header) - sizeof(RecordHeader), UINT16_MAX);
+    }
+
+    // appends a record, or returns false if it would overflow the frame
+    bool append(Topic topic, std::span<const std::byte> data) {
+        if (data.size() > UINT16_MAX ||
+            m_message.size() + sizeof(RecordHeader) + data.size() >
+                m_max_size) {
+            return false;
+        }
+        RecordHeader record{static_cast<uint16_t>(data.size()), topic};
+        const auto offset = m_message.size();
+        m_message.resize(offset + sizeof(RecordHeader) + data.size());
+        std::copy((std::byte*)&record,
+                  ((std::byte*)&record) + sizeof(RecordHeader),
+                  m_message.data() + offset);
+        std::copy(data.begin(), data.end(),
+                  m_message.data() + offset + sizeof(RecordHeader));
+        ++m_records;
+        return true;
+    }
+
+    // the frame holding every record appended since the last clear()
+    std::span<const std::byte> finish() {
+        MessageConstructor::rewrite(m_message, Header::batch(m_records));
+        return m_message;
+    }
+
+    void clear() {
+        m_message.resize(sizeof(Header));
+        m_records = 0;
+    }
+};
+
+// Lays out whole publish messages back to back for Socket::send_segments,
+// which sends each as its own datagram. Every message must be the size of
+// the first except the last, which may be shorter.
+class SegmentConstructor {
+  private:
+    std::vector<std::byte> m_message;
+    std::size_t m_max_segment;
+    std::size_t m_max_size;
+    std::size_t m_max_segments;
+    std::size_t m_segment_size = 0;
+    std::size_t m_segments = 0;
+    // a shorter message ended the run
+    bool m_closed = false;
+
+  public:
+    // max_segment bounds one message, max_size and max_segments the run
+    SegmentConstructor(std::size_t max_segment, std::size_t max_size,
+                       std::size_t max_segments)
+        : m_max_segment(std::min(max_segment, max_size)),
+          m_max_size(max_size), m_max_segments(max_segments) {
+        if (m_max_segment <= sizeof(Header) || max_segments == 0) {
+            throw std::runtime_error("segment size too small");
+        }
+        m_message.reserve(max_size);
+    }
+
+    std::size_t segment_size() const noexcept { return m_segment_size; }
+    std::size_t segments() const noexcept { return m_segments; }
+    bool empty() const noexcept { return m_segments == 0; }
+
+    // largest payload a message in the run can carry
+    std::size_t max_payload() const noexcept {
+        return m_max_segment - sizeof(Header);
+    }
+
+    // appends a message, or returns false if it can't join the run
+    bool append(Header header, std::span<const std::byte> data) {
+        const auto size = sizeof(Header) + data.size();
+        if (m_segments == 0) {
+            if (size > m_max_segment)
+                return false;
+            m_segment_size = size;
+        } else if (m_closed || size > m_segment_size ||
+                   m_segments == m_max_segments ||
+                   m_message.size() + size > m_max_size) {
+            return false;
+        }
+        m_closed = size < m_segment_size;
+
+        const auto offset = m_message.size();
+        m_message.resize(offset + size);
+        std::copy((std::byte*)&header, ((std::byte*)&header) + sizeof(Header),
+                  m_message.data() + offset);
+        std::copy(data.begin(), data.end(),
+                  m_message.data() + offset + sizeof(Header));
+        ++m_segments;
+        return true;
+    }
+
+    // every message appended since the last clear()
+    std::span<const std::byte> data() const noexcept { return m_message; }
+
+    void clear() {
+        m_message.clear();
+        m_segment_size = 0;
+        m_segments = 0;
+        m_closed = false;
+    }
+};
+
+// thrown for a datagram that doesn't hold the message it claims to
+class ParseError : public std::runtime_error {
+  public:
+    using std::runtime_error::runtime_error;
+};
+
 class MessageParser {
   public:
     static Header header(std::span<const std::byte> data) {
         if (data.size() < sizeof(Header)) {
-            throw std::runtime_error("invalid header");
+            throw ParseError("invalid header");
         }
         return *((Header*)data.data());
     }
@@ -61,7 +235,7 @@ class MessageParser {
                       std::is_same_v<OutType, std::span<const std::byte>>);
 
         if (data.size() < sizeof(Header)) {
-            throw std::runtime_error("invalid header");
+            throw ParseError("invalid header");
         }
         const auto* message_start = data.data() + sizeof(Header);
         size_t data_size = data.size() - sizeof(Header);
@@ -72,6 +246,44 @@ class MessageParser {
             return std::span<const std::byte>(message_start, data_size);
         }
     }
+
+    // reads the T at the start of the payload, e.g. a Sequence or Nak
+    template <typename T> static T prefix(std::span<const std::byte> data) {
+        static_assert(std::is_trivially_copyable_v<T>);
+        if (data.size() < sizeof(Header) + sizeof(T)) {
+            throw ParseError("invalid payload");
+        }
+        T out;
+        std::memcpy(&out, data.data() + sizeof(Header), sizeof(T));
+        return out;
+    }
+
+    // Calls f(topic, record) for each record of a batch frame, where record
+    // spans the RecordHeader and its payload. Throws if the frame is
+    // malformed, possibly after some records were already visited.
+    template <typename Byte, typename F>
+    static void for_each_record(std::span<Byte> frame, F&& f) {
+        static_assert(std::is_same_v<std::remove_const_t<Byte>, std::byte>);
+
+        auto count = header(frame).timestamp();
+        std::size_t offset = sizeof(Header);
+        for (; count > 0; count--) {
+            if (frame.size() - offset < sizeof(RecordHeader)) {
+                throw ParseError("invalid batch");
+            }
+            const auto record =
+                *((const RecordHeader*)(frame.data() + offset));
+            const auto size = sizeof(RecordHeader) + record.size;
+            if (frame.size() - offset < size) {
+                throw ParseError("invalid batch");
+            }
+            f(record.topic, frame.subspan(offset, size));
+            offset += size;
+        }
+        if (offset != frame.size()) {
+            throw ParseError("invalid batch");
+        }
+    }
 };
 
 } // namespace ufan::protocol
@@ -0,0 +1,129 @@
+#pragma once
+
+#include "header.hpp"
+#include "message.hpp"
+
+#include <array>
+#include <concepts>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <span>
+#include <type_traits>
+
+// Typed payloads that are written and read in place.
+//
+// A message type is a packed, trivially copyable struct with a Schema
+// specialization giving its id and version:
+//
+//   struct [[gnu::packed]] Quote {
+//       int64_t sent_ns;
+//       double bid;
+//   };
+//   template <> struct ufan::protocol::Schema<Quote> {
+//       static constexpr uint32_t id = 7;
+//       static constexpr uint16_t version = 1;
+//   };
+//   UFAN_SCHEMA_FIELD(Quote, bid, 8);
+//
+// On the wire the payload is a SchemaTag followed by the struct's bytes.
+// TypedMessage<T> builds one behind room for the header, so fields are
+// set straight in the send buffer; TypedView<T> checks the tag of a
+// received payload with one compare and reads the fields where they lie.
+// Packing keeps the struct free of padding and lets it sit at any offset
+// in a datagram; change a field and bump the version, and readers of the
+// old layout reject the new one instead of misreading it.
+
+// fails to compile if field is not at offset, e.g. after a reorder
+#define UFAN_SCHEMA_FIELD(type, field, offset)                                \
+    static_assert(offsetof(type, field) == (offset),                          \
+                  #type "::" #field " moved; bump the schema version")
+
+namespace ufan::protocol {
+
+// specialized for each message type with id and version
+template <typename T> struct Schema;
+
+template <typename T>
+concept Schematic = requires {
+    { Schema<T>::id } -> std::convertible_to<uint32_t>;
+    { Schema<T>::version } -> std::convertible_to<uint16_t>;
+} && std::is_trivially_copyable_v<T> && std::is_standard_layout_v<T> &&
+                    alignof(T) == 1 && sizeof(T) <= UINT16_MAX;
+
+// Prefix of a typed payload; size is the struct's, so a reader also
+// rejects a layout that changed without a version bump.
+struct [[gnu::packed]] SchemaTag {
+    uint32_t id;
+    uint16_t version;
+    uint16_t size;
+
+    template <Schematic T> static constexpr SchemaTag of() {
+        return {Schema<T>::id, Schema<T>::version,
+                static_cast<uint16_t>(sizeof(T))};
+    }
+};
+
+static_assert(sizeof(SchemaTag) == sizeof(uint64_t));
+
+// A T under construction in its own send buffer, with room in front for
+// the header; publish it with Publisher::publish and reuse it for the
+// next message. Fields keep their values between publishes.
+template <Schematic T> class TypedMessage {
+  private:
+    static constexpr std::size_t fields_offset =
+        HeaderRoom::size + sizeof(SchemaTag);
+
+    std::array<std::byte, fields_offset + sizeof(T)> m_buffer{};
+
+  public:
+    TypedMessage() {
+        const auto tag = SchemaTag::of<T>();
+        std::memcpy(m_buffer.data() + HeaderRoom::size, &tag, sizeof(tag));
+    }
+
+    T& fields() noexcept {
+        return *reinterpret_cast<T*>(m_buffer.data() + fields_offset);
+    }
+    const T& fields() const noexcept {
+        return *reinterpret_cast<const T*>(m_buffer.data() + fields_offset);
+    }
+    T* operator->() noexcept { return &fields(); }
+    const T* operator->() const noexcept { return &fields(); }
+
+    // for Publisher::publish_in_place
+    std::span<std::byte> buffer() noexcept { return m_buffer; }
+    static constexpr std::size_t payload_size() noexcept {
+        return sizeof(SchemaTag) + sizeof(T);
+    }
+};
+
+// A received T read in place; valid as long as the payload it views.
+template <Schematic T> class TypedView {
+  private:
+    const T* m_fields = nullptr;
+
+    explicit TypedView(const T* fields) : m_fields(fields) {}
+
+  public:
+    // empty unless payload holds a T of this schema and version
+    static TypedView read(std::span<const std::byte> payload) {
+        static constexpr auto expected = SchemaTag::of<T>();
+        if (payload.size() != sizeof(SchemaTag) + sizeof(T))
+            return TypedView(nullptr);
+        uint64_t tag;
+        uint64_t want;
+        std::memcpy(&tag, payload.data(), sizeof(tag));
+        std::memcpy(&want, &expected, sizeof(want));
+        if (tag != want)
+            return TypedView(nullptr);
+        return TypedView(
+            reinterpret_cast<const T*>(payload.data() + sizeof(SchemaTag)));
+    }
+
+    explicit operator bool() const noexcept { return m_fields != nullptr; }
+    const T& operator*() const noexcept { return *m_fields; }
+    const T* operator->() const noexcept { return m_fields; }
+};
+
+} // namespace ufan::protocol
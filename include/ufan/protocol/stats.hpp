@@ -0,0 +1,67 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <type_traits>
+
+namespace ufan::protocol {
+
+// One server worker's counters as carried in a stats reply. A reply is a
+// stats Header whose timestamp is the server time, followed by one Stats
+// per worker. Fields are in host byte order, like the header timestamp.
+struct Stats {
+    // bucket i counts values v with bit_width(v) == i, the last bucket
+    // everything larger
+    static constexpr std::size_t fanout_buckets = 18;
+    static constexpr std::size_t loop_buckets = 32;
+
+    uint64_t datagrams_in;
+    uint64_t bytes_in;
+    uint64_t datagrams_out;
+    uint64_t bytes_out;
+    uint64_t recv_calls;
+    uint64_t send_calls;
+    // datagrams the kernel refused with EAGAIN/ENOBUFS
+    uint64_t send_dropped;
+    // sends that failed with any other error
+    uint64_t send_errors;
+    uint64_t parse_failures;
+    uint64_t connects;
+    uint64_t timeouts;
+    uint64_t publishes;
+    // naks received, messages resent for them, and messages they asked
+    // for that the retransmit ring no longer held
+    uint64_t naks;
+    uint64_t retransmits;
+    uint64_t retransmit_misses;
+    // datagrams held back in egress queues while the socket buffer was
+    // full, discarded from full queues, and replaced by a newer message of
+    // the same topic; clients disconnected as slow consumers; and
+    // datagrams queued at the time of the snapshot
+    uint64_t egress_queued;
+    uint64_t egress_dropped;
+    uint64_t egress_conflated;
+    uint64_t evictions;
+    uint64_t egress_depth;
+    // last-value cache: topics and bytes held in this worker's shard,
+    // cached values dropped for room or for a refused newer value, and
+    // values replayed to new subscriptions
+    uint64_t cache_values;
+    uint64_t cache_bytes;
+    uint64_t cache_evictions;
+    uint64_t cache_replays;
+    // publishes queued for the journal, and those dropped because the
+    // journal thread had fallen a whole queue behind
+    uint64_t journaled;
+    uint64_t journal_dropped;
+    // publishes by first topic level, its key hashed into 8 buckets
+    uint64_t publishes_by_root[8];
+    // subscribers reached per publish
+    uint64_t fanout_sizes[fanout_buckets];
+    // nanoseconds per loop iteration that handled at least one datagram
+    uint64_t loop_ns[loop_buckets];
+};
+
+static_assert(std::is_trivially_copyable_v<Stats>);
+
+} // namespace ufan::protocol
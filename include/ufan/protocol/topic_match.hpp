@@ -0,0 +1,82 @@
+#pragma once
+
+#include "header.hpp"
+
+#include <cstddef>
+#include <cstdint>
+#include <span>
+
+#if defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+// Testing one published topic against many patterns, one pattern per
+// 256-bit compare with AVX2, two 128-bit halves with SSE2, else a level at
+// a time. The instruction set is chosen when compiling (-mavx2 or
+// -march=native for the wide path); all three agree with Topic::matches.
+
+namespace ufan::protocol {
+
+namespace topic_match_impl {
+
+#if defined(__AVX2__)
+inline bool matches(__m256i published, __m256i zero_levels,
+                    const Topic& pattern) noexcept {
+    const __m256i s = _mm256_loadu_si256((const __m256i*)&pattern);
+    // published bits the pattern lacks, per level
+    const __m256i missing = _mm256_andnot_si256(s, published);
+    // pattern levels that are present where the topic's are absent
+    const __m256i extra = _mm256_andnot_si256(
+        _mm256_cmpeq_epi32(s, _mm256_setzero_si256()), zero_levels);
+    const __m256i bad = _mm256_or_si256(missing, extra);
+    return _mm256_testz_si256(bad, bad);
+}
+#elif defined(__SSE2__)
+inline bool matches_half(__m128i published, __m128i zero_levels,
+                         const void* pattern) noexcept {
+    const __m128i s = _mm_loadu_si128((const __m128i*)pattern);
+    const __m128i missing = _mm_andnot_si128(s, published);
+    const __m128i extra = _mm_andnot_si128(
+        _mm_cmpeq_epi32(s, _mm_setzero_si128()), zero_levels);
+    const __m128i bad =
+        _mm_cmpeq_epi32(_mm_or_si128(missing, extra), _mm_setzero_si128());
+    return _mm_movemask_epi8(bad) == 0xFFFF;
+}
+#endif
+
+} // namespace topic_match_impl
+
+// index of the first pattern at or after from that published matches, or
+// patterns.size() if none does
+inline std::size_t find_match(const Topic& published,
+                              std::span<const Topic> patterns,
+                              std::size_t from = 0) noexcept {
+#if defined(__AVX2__)
+    const __m256i p = _mm256_loadu_si256((const __m256i*)&published);
+    const __m256i zero = _mm256_cmpeq_epi32(p, _mm256_setzero_si256());
+    for (std::size_t i = from; i < patterns.size(); i++) {
+        if (topic_match_impl::matches(p, zero, patterns[i]))
+            return i;
+    }
+#elif defined(__SSE2__)
+    const auto* words = (const std::byte*)&published;
+    const __m128i lo = _mm_loadu_si128((const __m128i*)words);
+    const __m128i hi = _mm_loadu_si128((const __m128i*)(words + 16));
+    const __m128i lo_zero = _mm_cmpeq_epi32(lo, _mm_setzero_si128());
+    const __m128i hi_zero = _mm_cmpeq_epi32(hi, _mm_setzero_si128());
+    for (std::size_t i = from; i < patterns.size(); i++) {
+        const auto* s = (const std::byte*)&patterns[i];
+        if (topic_match_impl::matches_half(lo, lo_zero, s) &&
+            topic_match_impl::matches_half(hi, hi_zero, s + 16))
+            return i;
+    }
+#else
+    for (std::size_t i = from; i < patterns.size(); i++) {
+        if (published.matches(patterns[i]))
+            return i;
+    }
+#endif
+    return patterns.size();
+}
+
+} // namespace ufan::protocol
@@ -0,0 +1,193 @@
+#pragma once
+
+#include <ufan/common/socket.hpp>
+#include <ufan/protocol/header.hpp>
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <utility>
+#include <vector>
+
+namespace ufan::server {
+
+// Per-worker client table: linear-probing hash from Endpoint::id() to a
+// dense index, with client fields stored column-wise so scans over one
+// field stay contiguous.
+//
+// Erase swaps the last client into the freed index and repairs the probe
+// chain by backward shifting, so there are no tombstones and lookups never
+// degrade under churn. Indices are therefore only stable until the next
+// erase.
+class ClientTable {
+  public:
+    using Index = uint32_t;
+    static constexpr Index npos = ~Index(0);
+
+    // a client's topic patterns alongside their SubscriptionTable slots
+    struct Subscriptions {
+        std::vector<protocol::Topic> topics;
+        std::vector<uint32_t> slots;
+        // 1 once the client has joined the topic's multicast group
+        std::vector<uint8_t> joined;
+
+        std::size_t size() const noexcept { return topics.size(); }
+
+        std::size_t find(const protocol::Topic& topic) const noexcept {
+            for (std::size_t i = 0; i < topics.size(); i++)
+                if (std::memcmp(topics[i].keys, topic.keys,
+                                sizeof(topic.keys)) == 0)
+                    return i;
+            return topics.size();
+        }
+
+        void add(const protocol::Topic& topic, uint32_t slot) {
+            topics.push_back(topic);
+            slots.push_back(slot);
+            joined.push_back(0);
+        }
+
+        void erase(std::size_t i) {
+            topics[i] = topics.back();
+            topics.pop_back();
+            slots[i] = slots.back();
+            slots.pop_back();
+            joined[i] = joined.back();
+            joined.pop_back();
+        }
+    };
+
+  private:
+    struct Bucket {
+        uint64_t key;
+        Index index; // npos when empty
+    };
+
+    static constexpr std::size_t no_bucket = ~std::size_t(0);
+
+    std::vector<Bucket> m_buckets;
+    std::size_t m_mask = 0;
+
+    std::vector<uint64_t> m_keys;
+    std::vector<common::Endpoint> m_endpoints;
+    std::vector<Subscriptions> m_subscriptions;
+    std::vector<int64_t> m_last_heartbeats;
+    std::vector<uint32_t> m_client_ids;
+    std::vector<uint64_t> m_leases;
+
+    std::size_t home(uint64_t key) const noexcept {
+        // fibonacci hashing spreads the ip:port bits over the whole word
+        return static_cast<std::size_t>((key * 0x9E3779B97F4A7C15ULL) >> 32) &
+               m_mask;
+    }
+
+    std::size_t find_bucket(uint64_t key) const noexcept {
+        if (m_buckets.empty())
+            return no_bucket;
+        for (std::size_t b = home(key);; b = (b + 1) & m_mask) {
+            const auto& bucket = m_buckets[b];
+            if (bucket.index == npos)
+                return no_bucket;
+            if (bucket.key == key)
+                return b;
+        }
+    }
+
+    void place(uint64_t key, Index index) {
+        std::size_t b = home(key);
+        while (m_buckets[b].index != npos)
+            b = (b + 1) & m_mask;
+        m_buckets[b] = {key, index};
+    }
+
+    void rehash(std::size_t n_buckets) {
+        m_buckets.assign(n_buckets, Bucket{0, npos});
+        m_mask = n_buckets - 1;
+        for (Index i = 0; i < m_keys.size(); i++)
+            place(m_keys[i], i);
+    }
+
+    void erase_bucket(std::size_t hole) {
+        for (std::size_t b = (hole + 1) & m_mask;; b = (b + 1) & m_mask) {
+            const auto& bucket = m_buckets[b];
+            if (bucket.index == npos)
+                break;
+            // shift back unless the entry's home lies cyclically in (hole, b]
+            const std::size_t h = home(bucket.key);
+            const bool stays = (hole < b) ? (hole < h && h <= b)
+                                          : (hole < h || h <= b);
+            if (!stays) {
+                m_buckets[hole] = bucket;
+                hole = b;
+            }
+        }
+        m_buckets[hole].index = npos;
+    }
+
+  public:
+    std::size_t size() const noexcept { return m_keys.size(); }
+    bool empty() const noexcept { return m_keys.empty(); }
+
+    Index find(const common::Endpoint& endpoint) const noexcept {
+        auto b = find_bucket(endpoint.id());
+        return b == no_bucket ? npos : m_buckets[b].index;
+    }
+
+    // returns the client's index and whether it was newly inserted; new
+    // clients start with no subscriptions
+    std::pair<Index, bool> insert(const common::Endpoint& endpoint) {
+        const uint64_t key = endpoint.id();
+        if (auto b = find_bucket(key); b != no_bucket)
+            return {m_buckets[b].index, false};
+
+        if ((m_keys.size() + 1) * 2 > m_buckets.size())
+            rehash(m_buckets.empty() ? 64 : m_buckets.size() * 2);
+
+        const Index index = static_cast<Index>(m_keys.size());
+
+        m_keys.push_back(key);
+        m_endpoints.push_back(endpoint);
+        m_subscriptions.emplace_back();
+        m_last_heartbeats.push_back(0);
+        m_client_ids.push_back(0);
+        m_leases.push_back(0);
+        place(key, index);
+        return {index, true};
+    }
+
+    void erase(Index index) {
+        erase_bucket(find_bucket(m_keys[index]));
+
+        const Index last = static_cast<Index>(m_keys.size() - 1);
+        if (index != last) {
+            m_buckets[find_bucket(m_keys[last])].index = index;
+            m_keys[index] = m_keys[last];
+            m_endpoints[index] = m_endpoints[last];
+            m_subscriptions[index] = std::move(m_subscriptions[last]);
+            m_last_heartbeats[index] = m_last_heartbeats[last];
+            m_client_ids[index] = m_client_ids[last];
+            m_leases[index] = m_leases[last];
+        }
+
+        m_keys.pop_back();
+        m_endpoints.pop_back();
+        m_subscriptions.pop_back();
+        m_last_heartbeats.pop_back();
+        m_client_ids.pop_back();
+        m_leases.pop_back();
+    }
+
+    const common::Endpoint& endpoint(Index i) const noexcept {
+        return m_endpoints[i];
+    }
+    Subscriptions& subscriptions(Index i) noexcept {
+        return m_subscriptions[i];
+    }
+    int64_t& last_heartbeat(Index i) noexcept { return m_last_heartbeats[i]; }
+    // the client's SubscriptionTable client id
+    uint32_t& client_id(Index i) noexcept { return m_client_ids[i]; }
+    // the connection's lease in the worker's timer wheel
+    uint64_t& lease(Index i) noexcept { return m_leases[i]; }
+};
+
+} // namespace ufan::server
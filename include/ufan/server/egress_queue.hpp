@@ -0,0 +1,100 @@
+#pragma once
+
+#include <ufan/common/socket.hpp>
+#include <ufan/protocol/header.hpp>
+
+#include <cstddef>
+#include <cstdint>
+#include <span>
+#include <vector>
+
+namespace ufan::server {
+
+// Datagrams a worker could not send to one client because its socket
+// buffer was full, kept in order until the buffer drains. The ring is
+// allocated at the first push and entries keep their buffers when popped,
+// so a queue that has filled once stops allocating.
+class EgressQueue {
+  public:
+    enum class Push {
+        queued,
+        // queued after discarding the oldest entry
+        dropped_oldest,
+        // replaced the queued message of the same topic
+        conflated,
+        // full under the disconnect policy; nothing was queued
+        overflow,
+    };
+
+  private:
+    struct Entry {
+        protocol::Topic topic;
+        std::vector<std::byte> data;
+    };
+
+    std::vector<Entry> m_entries;
+    std::size_t m_head = 0;
+    std::size_t m_size = 0;
+    common::Endpoint m_endpoint;
+
+    Entry& at(std::size_t i) {
+        return m_entries[(m_head + i) % m_entries.size()];
+    }
+
+  public:
+    bool empty() const noexcept { return m_size == 0; }
+    std::size_t size() const noexcept { return m_size; }
+    const common::Endpoint& endpoint() const noexcept { return m_endpoint; }
+
+    std::span<const std::byte> front() const {
+        return m_entries[m_head].data;
+    }
+
+    void pop() {
+        m_head = (m_head + 1) % m_entries.size();
+        m_size--;
+    }
+
+    void clear() noexcept {
+        m_head = 0;
+        m_size = 0;
+    }
+
+    // Queues a copy of data for endpoint, applying policy if depth
+    // messages are already queued. A different endpoint means the client
+    // id was reused, so whatever was queued for the old one is dropped.
+    Push push(const common::Endpoint& endpoint, protocol::Topic topic,
+              std::span<const std::byte> data, std::size_t depth,
+              protocol::SlowConsumerPolicy policy) {
+        if (m_entries.empty())
+            m_entries.resize(depth);
+        if (!(m_endpoint == endpoint)) {
+            clear();
+            m_endpoint = endpoint;
+        }
+
+        if (policy == protocol::SlowConsumerPolicy::conflate) {
+            for (std::size_t i = 0; i < m_size; i++) {
+                if (at(i).topic == topic) {
+                    at(i).data.assign(data.begin(), data.end());
+                    return Push::conflated;
+                }
+            }
+        }
+
+        auto outcome = Push::queued;
+        if (m_size == m_entries.size()) {
+            if (policy == protocol::SlowConsumerPolicy::disconnect)
+                return Push::overflow;
+            pop();
+            outcome = Push::dropped_oldest;
+        }
+        auto& entry = at(m_size);
+        entry.topic = topic;
+        entry.data.assign(data.begin(), data.end());
+        m_size++;
+        return outcome;
+    }
+};
+
+} // namespace ufan::server
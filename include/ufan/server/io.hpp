@@ -0,0 +1,124 @@
+#pragma once
+
+#include <ufan/common/socket.hpp>
+#include <ufan/common/uring_socket.hpp>
+
+#include <cstddef>
+#include <span>
+#include <vector>
+
+namespace ufan::server {
+
+// Receive/send backends a server worker can run on. Both take ownership of
+// a bound socket and expose the same surface:
+//   fd()                           fd to wait on for received datagrams
+//   send_fd()                      socket to wait on for writability
+//   recv() -> n, from(i), data(i)  one batch, valid until the next recv()
+//   send_to(endpoint, data)        immediate single datagram
+//   send_to(endpoint, head, data)  the same, gathered from two buffers
+//   send_batch(batch)              flush a fanout, returns datagrams sent;
+//                                  batch.result(i) has each outcome
+//   supports_gro                   whether recv() splits UDP_GRO reads, so
+//                                  the worker may enable GRO on the socket
+
+class SocketIO {
+  private:
+    common::Socket m_socket;
+    common::RecvBatch m_batch;
+    // with GRO on, the datagrams of the last recv() by slot, so that an
+    // index still names one datagram when a slot holds several
+    struct Segment {
+        std::size_t slot;
+        std::span<std::byte> data;
+    };
+    std::vector<Segment> m_segments;
+
+  public:
+    static constexpr const char* name = "recvmmsg";
+    static constexpr bool supports_gro = true;
+
+    SocketIO(common::Socket socket, std::size_t batch_size)
+        : m_socket(std::move(socket)), m_batch(batch_size, 65535) {}
+
+    int fd() const noexcept { return m_socket.fd(); }
+    int send_fd() const noexcept { return m_socket.fd(); }
+
+    std::size_t recv() {
+        const auto n = m_socket.recv_batch(m_batch);
+        if (!m_socket.gro())
+            return n;
+        m_segments.clear();
+        for (std::size_t i = 0; i < n; i++) {
+            common::for_each_segment(
+                m_batch.data(i), m_batch.segment_size(i),
+                [&](auto datagram) { m_segments.push_back({i, datagram}); });
+        }
+        return m_segments.size();
+    }
+    std::size_t capacity() const noexcept { return m_batch.capacity(); }
+
+    const common::Endpoint& from(std::size_t i) const noexcept {
+        return m_socket.gro() ? m_batch.from(m_segments[i].slot)
+                              : m_batch.from(i);
+    }
+    std::span<std::byte> data(std::size_t i) noexcept {
+        return m_socket.gro() ? m_segments[i].data : m_batch.data(i);
+    }
+
+    std::size_t send_to(const common::Endpoint& to,
+                        std::span<const std::byte> data) {
+        return m_socket.send_to(to, data);
+    }
+    std::size_t send_to(const common::Endpoint& to,
+                        std::span<const std::byte> head,
+                        std::span<const std::byte> data) {
+        return m_socket.send_to(to, head, data);
+    }
+    std::size_t send_batch(common::SendBatch& batch) {
+        return m_socket.send_batch(batch);
+    }
+};
+
+class UringIO {
+  private:
+    common::UringSocket m_socket;
+    std::size_t m_batch_size;
+
+  public:
+    static constexpr const char* name = "io_uring";
+    // its multishot receives aren't split into segments, so GRO stays off
+    static constexpr bool supports_gro = false;
+
+    UringIO(common::Socket socket, std::size_t batch_size)
+        : m_socket(std::move(socket)), m_batch_size(batch_size) {}
+
+    // datagrams the multishot receive has taken off the socket wait in the
+    // CQ, where the socket's readability no longer shows them
+    int fd() const noexcept { return m_socket.ring_fd(); }
+    int send_fd() const noexcept { return m_socket.fd(); }
+
+    std::size_t recv() { return m_socket.recv_batch(m_batch_size); }
+    std::size_t capacity() const noexcept { return m_batch_size; }
+
+    const common::Endpoint& from(std::size_t i) const noexcept {
+        return m_socket.from(i);
+    }
+    std::span<std::byte> data(std::size_t i) noexcept {
+        return m_socket.data(i);
+    }
+
+    std::size_t send_to(const common::Endpoint& to,
+                        std::span<const std::byte> data) {
+        return m_socket.send_to(to, data);
+    }
+    std::size_t send_to(const common::Endpoint& to,
+                        std::span<const std::byte> head,
+                        std::span<const std::byte> data) {
+        return m_socket.send_to(to, head, data);
+    }
+    std::size_t send_batch(common::SendBatch& batch) {
+        return m_socket.send_batch(batch);
+    }
+};
+
+} // namespace ufan::server
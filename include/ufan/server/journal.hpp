@@ -0,0 +1,150 @@
+#pragma once
+
+#include <ufan/common/journal.hpp>
+#include <ufan/common/socket.hpp>
+#include <ufan/protocol/header.hpp>
+
+#include <algorithm>
+#include <atomic>
+#include <bit>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
+#include <memory>
+#include <span>
+#include <thread>
+#include <vector>
+
+namespace ufan::server {
+
+// Records from one worker to the journal thread: a single-producer,
+// single-consumer byte ring holding each record as it will lie in the
+// segment. The worker never waits; push() fails when the ring is full.
+class JournalQueue {
+  private:
+    // in place of a record's length: the rest of the ring is unused
+    static constexpr uint32_t wrap = ~uint32_t(0);
+
+    std::unique_ptr<std::byte[]> m_buffer;
+    std::size_t m_capacity;
+    // consumer position; the producer caches it to touch the line rarely
+    alignas(64) std::atomic<uint64_t> m_head{0};
+    alignas(64) std::atomic<uint64_t> m_tail{0};
+    uint64_t m_head_seen = 0;
+
+  public:
+    // capacity is rounded up to a power of two that holds the largest
+    // record at least twice
+    explicit JournalQueue(std::size_t capacity)
+        : m_capacity(std::bit_ceil(std::max<std::size_t>(
+              capacity, 2 * common::JournalRecord::length_for(UINT16_MAX)))) {
+        m_buffer = std::make_unique<std::byte[]>(m_capacity);
+    }
+
+    // head.length must be JournalRecord::length_for(payload.size());
+    // producer only
+    bool push(const common::JournalRecord& head,
+              std::span<const std::byte> payload) {
+        const auto tail = m_tail.load(std::memory_order_relaxed);
+        const auto at = tail & (m_capacity - 1);
+        const auto contiguous = m_capacity - at;
+        const auto skip = contiguous < head.length ? contiguous : 0;
+        if (tail + skip + head.length - m_head_seen > m_capacity) {
+            m_head_seen = m_head.load(std::memory_order_acquire);
+            if (tail + skip + head.length - m_head_seen > m_capacity)
+                return false;
+        }
+
+        auto* out = m_buffer.get() + at;
+        if (skip) {
+            std::memcpy(out, &wrap, sizeof(wrap));
+            out = m_buffer.get();
+        }
+        std::memcpy(out, &head, sizeof(head));
+        std::memcpy(out + sizeof(head), payload.data(), payload.size());
+        m_tail.store(tail + skip + head.length, std::memory_order_release);
+        return true;
+    }
+
+    // calls f(head, payload) for every queued record; consumer only
+    template <typename F> std::size_t drain(F&& f) {
+        const auto tail = m_tail.load(std::memory_order_acquire);
+        auto head = m_head.load(std::memory_order_relaxed);
+        std::size_t n = 0;
+        while (head != tail) {
+            const auto at = head & (m_capacity - 1);
+            uint32_t length;
+            std::memcpy(&length, m_buffer.get() + at, sizeof(length));
+            if (length == wrap) {
+                head += m_capacity - at;
+                continue;
+            }
+            common::JournalRecord record;
+            std::memcpy(&record, m_buffer.get() + at, sizeof(record));
+            f(record, std::span<const std::byte>(
+                          m_buffer.get() + at + sizeof(record),
+                          record.payload_size));
+            head += length;
+            n++;
+        }
+        m_head.store(head, std::memory_order_release);
+        return n;
+    }
+};
+
+// The server's journal: a queue per worker and one thread draining them
+// all into a JournalWriter, so a publish costs its worker a copy into the
+// queue and never a page fault or disk write. A record that finds its
+// queue full is dropped, and the worker counts it.
+class Journal {
+  private:
+    common::JournalWriter m_writer;
+    std::vector<std::unique_ptr<JournalQueue>> m_queues;
+    std::atomic<bool> m_running{true};
+    std::thread m_thread;
+
+    std::size_t drain() {
+        std::size_t n = 0;
+        for (auto& queue : m_queues) {
+            n += queue->drain([&](const common::JournalRecord& head,
+                                  std::span<const std::byte> payload) {
+                m_writer.append(head, payload);
+            });
+        }
+        return n;
+    }
+
+    void run() {
+        while (m_running.load(std::memory_order_relaxed)) {
+            // nobody waits on the journal, so an idle thread yields its
+            // core to the workers
+            if (drain() == 0)
+                std::this_thread::sleep_for(std::chrono::microseconds(100));
+        }
+        drain();
+    }
+
+  public:
+    Journal(std::filesystem::path dir, std::size_t segment_size,
+            std::size_t workers, std::size_t queue_bytes)
+        : m_writer(std::move(dir), segment_size) {
+        for (std::size_t i = 0; i < workers; i++)
+            m_queues.push_back(std::make_unique<JournalQueue>(queue_bytes));
+        m_thread = std::thread([this]() { run(); });
+    }
+
+    // workers must have stopped pushing
+    ~Journal() {
+        m_running.store(false, std::memory_order_relaxed);
+        m_thread.join();
+    }
+
+    Journal(const Journal&) = delete;
+    Journal& operator=(const Journal&) = delete;
+
+    JournalQueue& queue(std::size_t worker) { return *m_queues.at(worker); }
+};
+
+} // namespace ufan::server
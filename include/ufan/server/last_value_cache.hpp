@@ -0,0 +1,338 @@
+#pragma once
+
+#include <ufan/protocol/header.hpp>
+
+#include <bit>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <span>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+namespace ufan::server {
+
+// What the last-value cache does with a value that doesn't fit its budget.
+enum class CacheEviction {
+    // drop the least recently published topics until it fits
+    lru,
+    // keep what is cached and refuse the value; a cached topic whose new
+    // value is refused is dropped rather than replayed stale
+    reject,
+};
+
+inline std::optional<CacheEviction>
+cache_eviction_from_string(std::string_view name) {
+    if (name == "lru")
+        return CacheEviction::lru;
+    if (name == "reject")
+        return CacheEviction::reject;
+    return std::nullopt;
+}
+
+// The newest publish of every concrete topic, replayed to new subscribers so
+// they start from current state instead of waiting for the next publish.
+//
+// Each worker stores what it fans out in its own shard, so the shard lock is
+// uncontended on the publish path; only a subscribe, which reads every
+// shard, takes the others. A topic published through two workers may sit in
+// both, and reads keep the newer value. Shards split the byte budget evenly
+// and charge each value its size plus entry_overhead.
+//
+// Each shard also chains its entries by (level, key), so a subscribe visits
+// only the topics whose key at one of the pattern's single-token levels is
+// covered by the pattern's: at most 2^key_bits - 1 chains. Only patterns
+// without such a level, e.g. "*.>", scan the whole shard under its lock.
+class LastValueCache {
+  public:
+    // rough bookkeeping per value: its entry, hash node and chain links
+    static constexpr std::size_t entry_overhead = 192;
+
+    struct Stored {
+        bool stored;
+        // cached values removed: those dropped to make room, and the
+        // topic's own old value if this one was refused
+        std::size_t evicted;
+        // the shard's contents afterwards
+        std::size_t values;
+        std::size_t bytes;
+    };
+
+    // Matching values copied out by collect(); reused between calls so a
+    // worker that has replayed once stops allocating.
+    class Replay {
+      private:
+        friend class LastValueCache;
+
+        struct Value {
+            protocol::Topic topic;
+            int64_t time;
+            std::size_t offset;
+            std::size_t size;
+        };
+        std::vector<Value> m_values;
+        std::vector<std::byte> m_bytes;
+        std::unordered_map<protocol::Topic, std::size_t> m_seen;
+
+        void add(const protocol::Topic& topic, int64_t time,
+                 std::span<const std::byte> data) {
+            auto [it, inserted] = m_seen.try_emplace(topic, m_values.size());
+            if (!inserted && m_values[it->second].time >= time)
+                return;
+            // a newer value from another shard is appended; the older one
+            // stays in m_bytes but is no longer referenced
+            const Value value{topic, time, m_bytes.size(), data.size()};
+            m_bytes.insert(m_bytes.end(), data.begin(), data.end());
+            if (inserted)
+                m_values.push_back(value);
+            else
+                m_values[it->second] = value;
+        }
+
+      public:
+        std::size_t size() const noexcept { return m_values.size(); }
+        bool empty() const noexcept { return m_values.empty(); }
+
+        const protocol::Topic& topic(std::size_t i) const noexcept {
+            return m_values[i].topic;
+        }
+        std::span<const std::byte> data(std::size_t i) const noexcept {
+            return std::span(m_bytes).subspan(m_values[i].offset,
+                                              m_values[i].size);
+        }
+
+        void clear() noexcept {
+            m_values.clear();
+            m_bytes.clear();
+            m_seen.clear();
+        }
+    };
+
+  private:
+    static constexpr uint32_t none = ~uint32_t(0);
+    static constexpr std::size_t levels = protocol::Topic::levels;
+
+    struct Entry {
+        protocol::Topic topic;
+        int64_t time;
+        std::vector<std::byte> data;
+        // neighbours in publish order, none at either end
+        uint32_t older;
+        uint32_t newer;
+        // neighbours in the chain of each present level's key
+        uint32_t prev[levels];
+        uint32_t next[levels];
+    };
+
+    static constexpr uint64_t chain_of(std::size_t level,
+                                       uint32_t key) noexcept {
+        return (uint64_t(level) << 32) | key;
+    }
+
+    struct alignas(64) Shard {
+        std::mutex mutex;
+        std::unordered_map<protocol::Topic, uint32_t> index;
+        // (level, key) -> first entry with that key at that level
+        std::unordered_map<uint64_t, uint32_t> chains;
+        std::vector<Entry> entries;
+        std::vector<uint32_t> free;
+        uint32_t oldest = none;
+        uint32_t newest = none;
+        std::size_t bytes = 0;
+
+        void unlink(uint32_t i) noexcept {
+            auto& entry = entries[i];
+            if (entry.older != none)
+                entries[entry.older].newer = entry.newer;
+            else
+                oldest = entry.newer;
+            if (entry.newer != none)
+                entries[entry.newer].older = entry.older;
+            else
+                newest = entry.older;
+        }
+
+        void link_newest(uint32_t i) noexcept {
+            auto& entry = entries[i];
+            entry.older = newest;
+            entry.newer = none;
+            if (newest != none)
+                entries[newest].newer = i;
+            else
+                oldest = i;
+            newest = i;
+        }
+
+        void chain(uint32_t i) {
+            auto& entry = entries[i];
+            for (std::size_t l = 0; l < levels; l++) {
+                const auto key = entry.topic.keys[l];
+                if (key == 0)
+                    continue;
+                auto [head, inserted] = chains.try_emplace(chain_of(l, key), i);
+                entry.prev[l] = none;
+                entry.next[l] = inserted ? none : head->second;
+                if (!inserted) {
+                    entries[head->second].prev[l] = i;
+                    head->second = i;
+                }
+            }
+        }
+
+        void unchain(uint32_t i) {
+            auto& entry = entries[i];
+            for (std::size_t l = 0; l < levels; l++) {
+                const auto key = entry.topic.keys[l];
+                if (key == 0)
+                    continue;
+                if (entry.next[l] != none)
+                    entries[entry.next[l]].prev[l] = entry.prev[l];
+                if (entry.prev[l] != none)
+                    entries[entry.prev[l]].next[l] = entry.next[l];
+                else if (entry.next[l] != none)
+                    chains[chain_of(l, key)] = entry.next[l];
+                else
+                    chains.erase(chain_of(l, key));
+            }
+        }
+
+        // i must already be unlinked
+        void release(uint32_t i) {
+            auto& entry = entries[i];
+            bytes -= cost(entry.data.size());
+            unchain(i);
+            index.erase(entry.topic);
+            // give the memory back; the budget is what the cache may hold
+            std::vector<std::byte>().swap(entry.data);
+            free.push_back(i);
+        }
+    };
+
+    std::vector<std::unique_ptr<Shard>> m_shards;
+    std::size_t m_shard_budget = 0;
+    CacheEviction m_eviction;
+
+    static constexpr std::size_t cost(std::size_t size) noexcept {
+        return size + entry_overhead;
+    }
+
+  public:
+    // one shard per worker; max_bytes 0 leaves the cache off
+    LastValueCache(std::size_t shards, std::size_t max_bytes,
+                   CacheEviction eviction)
+        : m_eviction(eviction) {
+        if (max_bytes == 0 || shards == 0)
+            return;
+        m_shard_budget = max_bytes / shards;
+        for (std::size_t i = 0; i < shards; i++)
+            m_shards.push_back(std::make_unique<Shard>());
+    }
+
+    bool enabled() const noexcept { return !m_shards.empty(); }
+
+    // Keeps data, a publish message in wire form, as topic's latest value
+    // in shard. time orders values of one topic stored by different
+    // shards. Owning worker only.
+    Stored store(std::size_t shard, const protocol::Topic& topic,
+                 int64_t time, std::span<const std::byte> data) {
+        auto& s = *m_shards[shard];
+        std::lock_guard lock(s.mutex);
+
+        std::size_t evicted = 0;
+        auto found = s.index.find(topic);
+        std::size_t held = 0;
+        if (found != s.index.end()) {
+            // out of the eviction order while room is made
+            s.unlink(found->second);
+            held = cost(s.entries[found->second].data.size());
+        }
+
+        const auto needed = cost(data.size());
+        // a value that could never fit is refused without emptying the
+        // shard for it
+        if (m_eviction == CacheEviction::lru && needed <= m_shard_budget) {
+            while (s.bytes - held + needed > m_shard_budget &&
+                   s.oldest != none) {
+                const auto victim = s.oldest;
+                s.unlink(victim);
+                s.release(victim);
+                evicted++;
+            }
+        }
+
+        if (s.bytes - held + needed > m_shard_budget) {
+            // refused, and any older value of the topic goes with it
+            if (found != s.index.end()) {
+                s.release(found->second);
+                evicted++;
+            }
+            return {false, evicted, s.index.size(), s.bytes};
+        }
+
+        uint32_t i;
+        if (found != s.index.end()) {
+            i = found->second;
+        } else {
+            if (!s.free.empty()) {
+                i = s.free.back();
+                s.free.pop_back();
+            } else {
+                i = static_cast<uint32_t>(s.entries.size());
+                s.entries.emplace_back();
+            }
+            s.index.emplace(topic, i);
+            s.entries[i].topic = topic;
+            s.chain(i);
+        }
+
+        auto& entry = s.entries[i];
+        s.bytes = s.bytes - held + needed;
+        entry.time = time;
+        entry.data.assign(data.begin(), data.end());
+        s.link_newest(i);
+        return {true, evicted, s.index.size(), s.bytes};
+    }
+
+    // copies the newest value of every cached topic that matches pattern
+    // into out, replacing what it held; any thread
+    void collect(const protocol::Topic& pattern, Replay& out) {
+        out.clear();
+        // a level naming one token: a topic matching there has a key made
+        // of some of that token's bits
+        std::size_t level = levels;
+        for (std::size_t l = 0; l < levels && level == levels; l++) {
+            const auto key = pattern.keys[l];
+            if (key != 0 && key != protocol::Topic::wildcard &&
+                std::popcount(key) <= int(protocol::Topic::key_bits))
+                level = l;
+        }
+
+        for (auto& shard : m_shards) {
+            std::lock_guard lock(shard->mutex);
+            const auto add = [&](uint32_t i) {
+                const auto& entry = shard->entries[i];
+                if (entry.topic.matches(pattern))
+                    out.add(entry.topic, entry.time, entry.data);
+            };
+            if (level == levels) {
+                for (const auto& [topic, i] : shard->index)
+                    add(i);
+                continue;
+            }
+            const auto key = pattern.keys[level];
+            for (uint32_t sub = key; sub != 0; sub = (sub - 1) & key) {
+                auto head = shard->chains.find(chain_of(level, sub));
+                if (head == shard->chains.end())
+                    continue;
+                for (auto i = head->second; i != none;
+                     i = shard->entries[i].next[level])
+                    add(i);
+            }
+        }
+    }
+};
+
+} // namespace ufan::server
@@ -0,0 +1,159 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <bit>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <new>
+#include <optional>
+#include <span>
+#include <stdexcept>
+#include <vector>
+
+namespace ufan::server {
+
+// Sequenced publishes one worker has sent, kept so that any worker can
+// resend them on a nak.
+//
+// The owning worker writes slots in order and fans out straight from them.
+// Other workers copy a slot out under its own sequence check, as
+// common::ShmReader does, so a nak never blocks the writer. A slot is
+// overwritten once the ring laps, after which naks for it are misses.
+class RetransmitRing {
+  public:
+    struct Stored {
+        std::size_t size;
+        // false if the message didn't fit and only its head was kept
+        bool complete;
+    };
+
+  private:
+    struct SlotHeader {
+        // 2p + 1 while position p is written, 2p + 2 once it is complete
+        std::atomic<uint64_t> version;
+        uint32_t size;
+        bool complete;
+    };
+
+    std::unique_ptr<std::byte[]> m_storage;
+    uint64_t m_slot_count;
+    std::size_t m_slot_size;
+    uint64_t m_next = 0;
+
+    SlotHeader* slot(uint64_t position) const noexcept {
+        return reinterpret_cast<SlotHeader*>(
+            m_storage.get() + (position & (m_slot_count - 1)) * m_slot_size);
+    }
+
+    static std::byte* bytes(SlotHeader* s) noexcept {
+        return reinterpret_cast<std::byte*>(s + 1);
+    }
+
+  public:
+    // slot_count must be a power of two; max_message is the largest
+    // message kept whole
+    RetransmitRing(uint64_t slot_count, std::size_t max_message)
+        : m_slot_count(slot_count),
+          m_slot_size((sizeof(SlotHeader) + max_message + 63) &
+                      ~std::size_t(63)) {
+        if (!std::has_single_bit(slot_count))
+            throw std::runtime_error("retransmit ring slot count must be a "
+                                     "power of 2");
+        m_storage = std::make_unique<std::byte[]>(slot_count * m_slot_size);
+        for (uint64_t i = 0; i < slot_count; i++)
+            new (slot(i)) SlotHeader{};
+    }
+
+    RetransmitRing(const RetransmitRing&) = delete;
+    RetransmitRing& operator=(const RetransmitRing&) = delete;
+
+    uint64_t slot_count() const noexcept { return m_slot_count; }
+    std::size_t max_message() const noexcept {
+        return m_slot_size - sizeof(SlotHeader);
+    }
+
+    // where the next write() lands
+    uint64_t next_position() const noexcept { return m_next; }
+
+    // Stores head followed by payload at next_position() and returns the
+    // stored message, valid until the ring laps. If it is too large, only
+    // head is kept and the returned span is empty. Owning worker only.
+    std::span<const std::byte> write(std::span<const std::byte> head,
+                                     std::span<const std::byte> payload) {
+        auto* s = slot(m_next);
+        const bool complete = head.size() + payload.size() <= max_message();
+        if (head.size() > max_message())
+            throw std::runtime_error("retransmit ring slot too small");
+
+        s->version.store(2 * m_next + 1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+        s->complete = complete;
+        s->size = static_cast<uint32_t>(
+            complete ? head.size() + payload.size() : head.size());
+        std::memcpy(bytes(s), head.data(), head.size());
+        if (complete)
+            std::memcpy(bytes(s) + head.size(), payload.data(),
+                        payload.size());
+        s->version.store(2 * m_next + 2, std::memory_order_release);
+
+        m_next++;
+        if (!complete)
+            return {};
+        return std::span<const std::byte>(bytes(s), s->size);
+    }
+
+    // Copies the message at position into out, which must hold
+    // max_message() bytes. Returns nullopt if it was overwritten, is being
+    // written, or was never written. Any thread.
+    std::optional<Stored> read(uint64_t position,
+                               std::span<std::byte> out) const {
+        auto* s = slot(position);
+        const auto ready = 2 * position + 2;
+        if (s->version.load(std::memory_order_acquire) != ready)
+            return std::nullopt;
+
+        const Stored stored{std::min<std::size_t>(s->size, max_message()),
+                            s->complete};
+        std::memcpy(out.data(), bytes(s), stored.size);
+        // the copy must be from position, not a later lap
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if (s->version.load(std::memory_order_relaxed) != ready)
+            return std::nullopt;
+        return stored;
+    }
+};
+
+// Every worker's ring, owned by the server and shared by reference like
+// the StatsBoard. Empty when retransmission is off. The epoch tells
+// subscribers that sequence numbers restarted with the server.
+class RetransmitRings {
+  private:
+    std::vector<std::unique_ptr<RetransmitRing>> m_rings;
+    uint32_t m_epoch;
+
+  public:
+    RetransmitRings(std::size_t workers, uint64_t slot_count,
+                    std::size_t max_message, uint32_t epoch)
+        : m_epoch(epoch) {
+        if (slot_count == 0)
+            return;
+        for (std::size_t i = 0; i < workers; i++)
+            m_rings.push_back(
+                std::make_unique<RetransmitRing>(slot_count, max_message));
+    }
+
+    bool enabled() const noexcept { return !m_rings.empty(); }
+    std::size_t size() const noexcept { return m_rings.size(); }
+    uint32_t epoch() const noexcept { return m_epoch; }
+
+    RetransmitRing& at(std::size_t worker) {
+        if (worker >= m_rings.size())
+            throw std::runtime_error("invalid retransmit stream");
+        return *m_rings[worker];
+    }
+};
+
+} // namespace ufan::server
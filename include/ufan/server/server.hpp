@@ -0,0 +1,1097 @@
+#pragma once
+
+#include <ufan/common/interrupts.hpp>
+#include <ufan/common/socket.hpp>
+#include <ufan/common/wait.hpp>
+#include <ufan/protocol/message.hpp>
+#include <ufan/server/client_table.hpp>
+#include <ufan/server/egress_queue.hpp>
+#include <ufan/server/io.hpp>
+#include <ufan/server/journal.hpp>
+#include <ufan/server/last_value_cache.hpp>
+#include <ufan/server/retransmit_ring.hpp>
+#include <ufan/server/stats.hpp>
+#include <ufan/server/subscription_table.hpp>
+#include <ufan/server/timer_wheel.hpp>
+
+#include <quill/Frontend.h>
+#include <quill/LogMacros.h>
+#include <quill/Logger.h>
+#include <quill/sinks/ConsoleSink.h>
+
+#include <pthread.h>
+#include <sched.h>
+#include <sys/epoll.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <ctime>
+#include <memory>
+#include <optional>
+#include <span>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+namespace ufan::server {
+
+struct ServerConfig {
+    // max datagrams per recvmmsg/sendmmsg call
+    std::size_t batch_size = 32;
+    // receive threads, each with its own SO_REUSEPORT socket
+    std::size_t workers = 1;
+    // pin worker i to core first_core + i; negative leaves threads unpinned
+    int first_core = -1;
+    // use the io_uring backend, falling back to recvmmsg if unavailable
+    bool io_uring = false;
+    // how each worker idles when its socket is empty
+    common::WaitConfig wait;
+    // SO_BUSY_POLL budget in microseconds; 0 leaves it off
+    int busy_poll_us = 0;
+    // let the kernel coalesce datagrams from one sender into one read
+    // (UDP_GRO), e.g. a publisher's GSO runs; used where both the kernel
+    // and the IO backend support it
+    bool gro = true;
+    // topic patterns fanned out by IP multicast; overlapping patterns send
+    // a member one copy per matching group
+    std::vector<MulticastRoute> multicast;
+    // address of the interface multicast leaves by; empty lets routing pick
+    std::string multicast_interface;
+    int multicast_ttl = 1;
+    // Publishes kept per worker for naks, a power of two; 0 turns off
+    // sequencing and subscribers get publishes without sequence numbers.
+    // Must exceed batch_size: queued sends point into the ring, and the
+    // worker sends them early rather than let a write reuse their slots.
+    uint64_t retransmit_slots = 0;
+    // largest message kept whole; larger ones are sequenced but a nak for
+    // them is a miss
+    std::size_t retransmit_max_message = 2048;
+    // datagrams held per client while the socket buffer is full
+    std::size_t egress_queue_depth = 1024;
+    // for clients that haven't picked one with a configure message
+    protocol::SlowConsumerPolicy slow_consumer_policy =
+        protocol::SlowConsumerPolicy::drop_oldest;
+    // Bytes of last values kept across all workers, replayed to each new
+    // subscription; 0 turns the cache off.
+    std::size_t last_value_cache_bytes = 0;
+    CacheEviction last_value_eviction = CacheEviction::lru;
+    // Directory every publish is journaled to; empty turns journaling off.
+    // A server appends new segments after any already there.
+    std::string journal_dir;
+    std::size_t journal_segment_bytes = 64 << 20;
+    // per worker, between it and the journal thread
+    std::size_t journal_queue_bytes = 4 << 20;
+};
+
+// One receive loop with its own socket. A worker owns the clients whose
+// datagrams the kernel steers to its socket, but fans publishes out to
+// every subscriber through the shared SubscriptionTable. IO is one of the
+// backends in server/io.hpp.
+template <typename IO> class Worker {
+  private:
+    quill::Logger* m_logger;
+
+    quill::Logger* logger() { return m_logger; }
+    const quill::Logger* logger() const { return m_logger; }
+
+    std::size_t m_id;
+    ServerConfig m_config;
+
+    common::Endpoint m_endpoint;
+    IO m_io;
+
+    common::SendBatch m_send_batch;
+
+    // Egress queues, by SubscriptionTable client id. Fanout datagrams the
+    // kernel would not take are copied into their client's queue, and a
+    // client with a backlog has later fanouts queued behind it, so one
+    // client falling behind never holds up the others.
+    static constexpr SubscriptionTable::ClientId no_client = ~0u;
+    struct Destination {
+        SubscriptionTable::ClientId owner;
+        protocol::Topic topic;
+    };
+    // per m_send_batch entry; no_client for anything not to be queued
+    std::vector<Destination> m_destinations;
+    struct Egress {
+        EgressQueue queue;
+        bool backlogged = false;
+    };
+    std::vector<Egress> m_egress;
+    std::vector<SubscriptionTable::ClientId> m_backlog;
+    uint64_t m_egress_depth = 0;
+    // the last send found the socket buffer full; queues fill then through
+    // no fault of their clients
+    bool m_send_blocked = false;
+    common::WaitStrategy m_wait;
+    // the wait also wakes once the socket is writable, while backlogged
+    bool m_wait_writable = false;
+    const StatsBoard& m_board;
+    WorkerStats& m_stats;
+    std::vector<protocol::Stats> m_stats_reply;
+    ClientTable m_clients;
+    SubscriptionTable& m_table;
+    SubscriptionTable::Reader m_reader;
+
+    // sequencing, when m_ring is set: the last seq and ring position of
+    // each topic this worker has fanned out
+    struct TopicSequence {
+        uint64_t seq = 0;
+        uint64_t position = protocol::no_position;
+    };
+    RetransmitRings& m_rings;
+    RetransmitRing* m_ring = nullptr;
+    // ring position at the last flush; sends queued since point into
+    // slots from here on
+    uint64_t m_ring_flushed = 0;
+    std::unordered_map<protocol::Topic, TopicSequence> m_sequences;
+    // a ring slot copied out to answer a nak
+    std::vector<std::byte> m_retransmit_buf;
+    // a sequenced message too large for the ring
+    std::vector<std::byte> m_oversize;
+
+    LastValueCache& m_cache;
+    // this worker's queue into the journal, when there is one
+    JournalQueue* m_journal = nullptr;
+    // values collected for a new subscription, sent before the next recv
+    LastValueCache::Replay m_replay;
+
+    // fanout dedupe: m_seen[client] == m_publish_seq once a publish has
+    // been queued to that client
+    uint64_t m_publish_seq = 0;
+    std::vector<uint64_t> m_seen;
+
+    int64_t m_time_now;
+    // steady clock at the start of the current batch
+    int64_t m_batch_start = 0;
+    int64_t m_next_stats_log = 0;
+    uint32_t m_idle_polls = 0;
+    static constexpr int64_t m_heartbeat_timeout = 10000;
+    static constexpr int64_t m_stats_interval = 10000;
+    // empty polls between expiry ticks while busy polling
+    static constexpr uint32_t m_idle_tick_polls = 4096;
+
+    // A connection's lease is tagged with a number of its own, so one left
+    // in the wheel by a dropped connection expires unrenewed instead of
+    // being taken over by a reconnect from the same endpoint.
+    struct Lease {
+        common::Endpoint endpoint;
+        uint64_t id;
+    };
+    uint64_t m_next_lease = 0;
+    // 128 x 100ms slots, enough to hold a full heartbeat timeout
+    TimerWheel<Lease> m_leases;
+
+    static int64_t clock_now_ns() {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(
+                   std::chrono::steady_clock::now().time_since_epoch())
+            .count();
+    }
+
+    static int64_t clock_now() {
+        return std::chrono::duration_cast<std::chrono::milliseconds>(
+                   std::chrono::system_clock::now().time_since_epoch())
+            .count();
+    }
+
+    void cache_time_now() { m_time_now = clock_now(); }
+
+    int64_t time_now() const { return m_time_now; }
+
+    // sends head followed by payload as one datagram, gathered from both
+    // rather than copied together
+    void send(const common::Endpoint& endpoint,
+              std::span<const std::byte> head,
+              std::span<const std::byte> payload = {}) {
+        const auto size = head.size() + payload.size();
+        LOG_DEBUG(this->logger(), "[{}] < ({}) {} bytes", endpoint.id(),
+                  (char)protocol::MessageParser::header(head).type(), size);
+        try {
+            if (payload.empty())
+                m_io.send_to(endpoint, head);
+            else
+                m_io.send_to(endpoint, head, payload);
+        } catch (const std::exception& e) {
+            m_stats.send_errors.add();
+            LOG_ERROR(this->logger(), "send failed with {}", e.what());
+            return;
+        }
+        m_stats.send_calls.add();
+        m_stats.datagrams_out.add();
+        m_stats.bytes_out.add(size);
+    }
+
+    void send(const common::Endpoint& endpoint, protocol::Header header,
+              std::span<const std::byte> payload = {}) {
+        send(endpoint, header.bytes(), payload);
+    }
+
+    // queues data for the next flush(); data must outlive the flush, which
+    // holds for anything received by m_io until the next recv. If owner is
+    // a client, a datagram that would block goes to its egress queue.
+    void queue(const common::Endpoint& endpoint,
+               std::span<const std::byte> data,
+               SubscriptionTable::ClientId owner = no_client,
+               protocol::Topic topic = {}) {
+        LOG_DEBUG(this->logger(), "[{}] < ({}) {} bytes", endpoint.id(),
+                  (char)protocol::MessageParser::header(data).type(),
+                  data.size());
+        if (m_send_batch.full())
+            flush();
+        m_destinations[m_send_batch.size()] = {owner, topic};
+        m_send_batch.push(endpoint, data);
+    }
+
+    // sends m_send_batch, counting the outcome, and calls
+    // on_result(i, result) for each datagram before clearing the batch
+    template <typename F> void send_batch(F&& on_result) {
+        const auto queued = m_send_batch.size();
+        std::size_t sent = 0;
+        try {
+            sent = m_io.send_batch(m_send_batch);
+        } catch (const std::exception& e) {
+            m_stats.send_errors.add();
+            LOG_ERROR(this->logger(), "send failed with {}", e.what());
+        }
+
+        uint64_t bytes = 0;
+        std::size_t failed = 0;
+        m_send_blocked = false;
+        for (std::size_t i = 0; i < queued; i++) {
+            const auto result = m_send_batch.result(i);
+            if (result == common::SendResult::sent)
+                bytes += m_send_batch.data(i).size();
+            else if (result == common::SendResult::failed)
+                failed++;
+            if (result == common::SendResult::would_block)
+                m_send_blocked = true;
+            on_result(i, result);
+        }
+        m_send_batch.clear();
+
+        m_stats.send_calls.add();
+        m_stats.datagrams_out.add(sent);
+        m_stats.bytes_out.add(bytes);
+        if (failed) {
+            m_stats.send_errors.add(failed);
+            LOG_WARNING(this->logger(), "{} of {} datagrams refused", failed,
+                        queued);
+        }
+    }
+
+    void flush() {
+        if (m_ring)
+            m_ring_flushed = m_ring->next_position();
+        if (m_send_batch.empty())
+            return;
+        send_batch([&](std::size_t i, common::SendResult result) {
+            if (result != common::SendResult::would_block)
+                return;
+            const auto& destination = m_destinations[i];
+            if (destination.owner == no_client) {
+                m_stats.send_dropped.add();
+                return;
+            }
+            enqueue(destination.owner, m_send_batch.to(i), destination.topic,
+                    m_send_batch.data(i));
+        });
+    }
+
+    protocol::SlowConsumerPolicy policy_for(SubscriptionTable::ClientId owner) {
+        const auto& policies = m_reader.get().policies;
+        if (owner < policies.size() &&
+            policies[owner] != protocol::SlowConsumerPolicy::server_default)
+            return policies[owner];
+        return m_config.slow_consumer_policy;
+    }
+
+    void enqueue(SubscriptionTable::ClientId owner,
+                 const common::Endpoint& endpoint, protocol::Topic topic,
+                 std::span<const std::byte> data) {
+        if (m_egress.size() <= owner)
+            m_egress.resize(owner + 1);
+        auto& egress = m_egress[owner];
+        const auto before = egress.queue.size();
+
+        switch (egress.queue.push(endpoint, topic, data,
+                                  m_config.egress_queue_depth,
+                                  policy_for(owner))) {
+        case EgressQueue::Push::queued:
+            m_stats.egress_queued.add();
+            break;
+        case EgressQueue::Push::dropped_oldest:
+            m_stats.egress_queued.add();
+            m_stats.egress_dropped.add();
+            break;
+        case EgressQueue::Push::conflated:
+            m_stats.egress_conflated.add();
+            break;
+        case EgressQueue::Push::overflow:
+            // a full socket buffer backs up every client that was sent to
+            // after it filled; only a queue that overflows while the
+            // socket drains marks its client as the slow one
+            if (m_send_blocked) {
+                egress.queue.push(endpoint, topic, data,
+                                  m_config.egress_queue_depth,
+                                  protocol::SlowConsumerPolicy::drop_oldest);
+                m_stats.egress_queued.add();
+                m_stats.egress_dropped.add();
+                break;
+            }
+            LOG_WARNING(this->logger(),
+                        "[{}] disconnecting slow consumer with {} queued",
+                        endpoint.id(), egress.queue.size());
+            m_stats.egress_dropped.add(egress.queue.size() + 1);
+            m_stats.evictions.add();
+            egress.queue.clear();
+            m_table.evict(owner);
+            break;
+        }
+
+        m_egress_depth = m_egress_depth + egress.queue.size() - before;
+        m_stats.egress_depth.set(m_egress_depth);
+        if (!egress.queue.empty() && !egress.backlogged) {
+            egress.backlogged = true;
+            m_backlog.push_back(owner);
+        }
+    }
+
+    // Retries backlogged clients one datagram each per round, so a long
+    // backlog doesn't starve short ones, until the queues are empty or the
+    // socket buffer fills again.
+    void drain_egress() {
+        while (true) {
+            // evicted clients' queues were emptied in place
+            std::erase_if(m_backlog, [&](auto owner) {
+                auto& egress = m_egress[owner];
+                if (!egress.queue.empty())
+                    return false;
+                egress.backlogged = false;
+                return true;
+            });
+            if (m_backlog.empty())
+                break;
+
+            const auto n = std::min(m_backlog.size(), m_send_batch.capacity());
+            for (std::size_t i = 0; i < n; i++) {
+                const auto& queue = m_egress[m_backlog[i]].queue;
+                m_send_batch.push(queue.endpoint(), queue.front());
+            }
+
+            // a popped entry keeps its buffer until a later push, so the
+            // batch stays valid while results are read
+            bool blocked = false;
+            std::size_t popped = 0;
+            send_batch([&](std::size_t i, common::SendResult result) {
+                if (result == common::SendResult::would_block) {
+                    blocked = true;
+                    return;
+                }
+                m_egress[m_backlog[i]].queue.pop();
+                popped++;
+            });
+            m_egress_depth -= popped;
+            m_stats.egress_depth.set(m_egress_depth);
+
+            std::rotate(m_backlog.begin(), m_backlog.begin() + n,
+                        m_backlog.end());
+            if (blocked)
+                break;
+        }
+    }
+
+    // Has the wait wake on writability too while clients are backlogged,
+    // rather than spinning until the socket buffer drains.
+    void wait_writable(bool on) {
+        if (on == m_wait_writable)
+            return;
+        m_wait_writable = on;
+        uint32_t events = on ? uint32_t(EPOLLOUT) : 0;
+        if (m_io.send_fd() == m_io.fd())
+            events |= EPOLLIN;
+        m_wait.rewatch(m_io.send_fd(), events);
+    }
+
+    ClientTable::Index find_or_connect(
+        const common::Endpoint& endpoint) {
+        auto [client, inserted] = m_clients.insert(endpoint);
+        if (!inserted)
+            return client;
+
+        LOG_INFO(this->logger(), "[{}] connected", endpoint.id());
+        m_stats.connects.add();
+
+        m_clients.last_heartbeat(client) = time_now();
+        m_clients.client_id(client) = m_table.add_client(endpoint);
+        m_clients.lease(client) = ++m_next_lease;
+        m_leases.schedule({endpoint, m_next_lease},
+                          time_now() + m_heartbeat_timeout);
+        return client;
+    }
+
+    // Heartbeats only bump last_heartbeat; the lease is checked when its
+    // wheel slot comes due and rescheduled if it was renewed meanwhile.
+    void expire_clients() {
+        m_leases.advance(time_now(), [&](const Lease& lease) {
+            const auto& endpoint = lease.endpoint;
+            auto client = m_clients.find(endpoint);
+            if (client == ClientTable::npos ||
+                m_clients.lease(client) != lease.id)
+                return;
+
+            const auto deadline =
+                m_clients.last_heartbeat(client) + m_heartbeat_timeout;
+            if (deadline >= time_now()) {
+                m_leases.schedule(lease, deadline);
+                return;
+            }
+
+            LOG_INFO(this->logger(), "[{}] timed out", endpoint.id());
+            m_stats.timeouts.add();
+            m_table.remove_client(m_clients.client_id(client),
+                                  m_clients.subscriptions(client).slots);
+            m_clients.erase(client);
+        });
+    }
+
+    // heartbeat replies carry every topic the client is subscribed to
+    void send_subscriptions(const common::Endpoint& endpoint,
+                            ClientTable::Index client,
+                            int64_t timestamp) {
+        const auto& topics = m_clients.subscriptions(client).topics;
+        send(endpoint, protocol::Header::heartbeat(timestamp),
+             std::span<const std::byte>(
+                 (const std::byte*)topics.data(),
+                 topics.size() * sizeof(protocol::Topic)));
+    }
+
+    // tells the client the group of each subscription it has not joined;
+    // repeated with every heartbeat, so a lost advert or join is retried
+    // and a client that can't join simply stays on unicast
+    void send_groups(const common::Endpoint& endpoint,
+                     ClientTable::Index client) {
+        if (m_config.multicast.empty())
+            return;
+        const auto& subscriptions = m_clients.subscriptions(client);
+        for (std::size_t i = 0; i < subscriptions.size(); i++) {
+            if (subscriptions.joined[i])
+                continue;
+            auto group = m_table.group_for(subscriptions.topics[i]);
+            if (!group)
+                continue;
+            const auto& route = m_config.multicast[*group];
+            protocol::MulticastGroup payload{route.group.addr.sin_addr.s_addr,
+                                             route.group.addr.sin_port};
+            send(endpoint,
+                 protocol::Header::multicast(subscriptions.topics[i]),
+                 std::span<const std::byte>((const std::byte*)&payload,
+                                            sizeof(payload)));
+        }
+    }
+
+    // true if a worker evicted the client as a slow consumer, in which
+    // case it is dropped here and told so; its next heartbeat reconnects it
+    bool disconnect_if_evicted(const common::Endpoint& endpoint,
+                               ClientTable::Index client) {
+        const auto& evicted = m_reader.get().evicted;
+        const auto id = m_clients.client_id(client);
+        if (id >= evicted.size() || !evicted[id])
+            return false;
+
+        LOG_INFO(this->logger(), "[{}] disconnected as a slow consumer",
+                 endpoint.id());
+        m_table.remove_client(id, m_clients.subscriptions(client).slots);
+        m_clients.erase(client);
+        send(endpoint, protocol::Header::error());
+        return true;
+    }
+
+    void handle_heartbeat(const common::Endpoint& endpoint,
+                          std::span<const std::byte> data) {
+        auto client = find_or_connect(endpoint);
+        if (disconnect_if_evicted(endpoint, client))
+            return;
+        auto& last_heartbeat = m_clients.last_heartbeat(client);
+        last_heartbeat = protocol::MessageParser::header(data).timestamp();
+
+        if (last_heartbeat > time_now()) {
+            last_heartbeat = time_now();
+        }
+
+        send_subscriptions(endpoint, client, last_heartbeat);
+        send_groups(endpoint, client);
+    }
+
+    void handle_subscribe(const common::Endpoint& endpoint,
+                          std::span<const std::byte> data) {
+        auto topic = protocol::MessageParser::header(data).topic();
+        auto client = find_or_connect(endpoint);
+        auto& subscriptions = m_clients.subscriptions(client);
+
+        if (subscriptions.find(topic) == subscriptions.size()) {
+            if (subscriptions.size() >= protocol::max_subscriptions) {
+                LOG_WARNING(this->logger(),
+                            "[{}] subscription limit of {} reached",
+                            endpoint.id(), protocol::max_subscriptions);
+            } else {
+                LOG_INFO(this->logger(), "[{}] subscribed to {}",
+                         endpoint.id(), topic.to_string());
+                subscriptions.add(
+                    topic,
+                    m_table.subscribe(m_clients.client_id(client), topic));
+                if (m_cache.enabled())
+                    replay(endpoint, m_clients.client_id(client), topic);
+            }
+        }
+
+        send_subscriptions(endpoint, client, time_now());
+        send_groups(endpoint, client);
+    }
+
+    void handle_unsubscribe(const common::Endpoint& endpoint,
+                            std::span<const std::byte> data) {
+        auto topic = protocol::MessageParser::header(data).topic();
+        auto client = find_or_connect(endpoint);
+        auto& subscriptions = m_clients.subscriptions(client);
+
+        if (auto i = subscriptions.find(topic); i != subscriptions.size()) {
+            LOG_INFO(this->logger(), "[{}] unsubscribed from {}",
+                     endpoint.id(), topic.to_string());
+            m_table.unsubscribe(subscriptions.slots[i]);
+            subscriptions.erase(i);
+        }
+
+        send_subscriptions(endpoint, client, time_now());
+    }
+
+    void handle_join(const common::Endpoint& endpoint,
+                     std::span<const std::byte> data) {
+        auto topic = protocol::MessageParser::header(data).topic();
+        auto client = find_or_connect(endpoint);
+        auto& subscriptions = m_clients.subscriptions(client);
+
+        auto i = subscriptions.find(topic);
+        if (i == subscriptions.size() || subscriptions.joined[i])
+            return;
+        auto group = m_table.group_for(topic);
+        if (!group)
+            return;
+
+        LOG_INFO(this->logger(), "[{}] joined multicast for {}",
+                 endpoint.id(), topic.to_string());
+        m_table.join(subscriptions.slots[i], *group);
+        subscriptions.joined[i] = 1;
+    }
+
+    // Stamps the next seq of topic on a publish message and stores the
+    // result in this worker's ring; returns the sequenced copy to fan out.
+    std::span<const std::byte> sequence(protocol::Topic topic,
+                                        std::span<const std::byte> message) {
+        auto& last = m_sequences[topic];
+        const auto position = m_ring->next_position();
+        const struct [[gnu::packed]] {
+            protocol::Header header;
+            protocol::Sequence sequence;
+        } head{protocol::Header::sequenced(topic),
+               {m_rings.epoch(), static_cast<uint16_t>(m_id), ++last.seq,
+                position, last.position}};
+        last.position = position;
+
+        std::span<const std::byte> head_bytes((const std::byte*)&head,
+                                              sizeof(head));
+        // A lap since the last flush would overwrite the slot of the
+        // oldest queued send, however few of the writes had subscribers,
+        // so those sends go out first.
+        if (position - m_ring_flushed >= m_ring->slot_count())
+            flush();
+        auto payload = message.subspan(sizeof(protocol::Header));
+        if (auto stored = m_ring->write(head_bytes, payload); !stored.empty())
+            return stored;
+
+        // sends queued from the previous oversized message go out first
+        flush();
+        m_oversize.assign(head_bytes.begin(), head_bytes.end());
+        m_oversize.insert(m_oversize.end(), payload.begin(), payload.end());
+        return m_oversize;
+    }
+
+    // Resends what a subscriber missed, walking back through the topic's
+    // messages from the one that revealed the gap, and tells it which
+    // seqs are gone. Any worker can answer for any stream. Only connected
+    // clients are answered, and for at most max_nak seqs, so a spoofed
+    // nak can't turn the server into an amplifier.
+    void handle_nak(const common::Endpoint& endpoint,
+                    std::span<const std::byte> data) {
+        auto topic = protocol::MessageParser::header(data).topic();
+        auto nak = protocol::MessageParser::prefix<protocol::Nak>(data);
+        if (nak.first == 0 || nak.first > nak.last ||
+            nak.last - nak.first >= protocol::max_nak)
+            return;
+        if (m_clients.find(endpoint) == ClientTable::npos)
+            return;
+        m_stats.naks.add();
+
+        // the lowest seq not yet resent; everything from nak.first to
+        // below it is reported lost once the walk stops
+        auto next_missing = nak.last + 1;
+        if (m_rings.enabled() && nak.epoch == m_rings.epoch() &&
+            nak.stream < m_rings.size()) {
+            auto& ring = m_rings.at(nak.stream);
+            auto position = nak.position;
+            for (uint64_t steps = 0; steps < ring.slot_count() &&
+                                     next_missing > nak.first &&
+                                     position != protocol::no_position;
+                 steps++) {
+                auto stored = ring.read(position, m_retransmit_buf);
+                if (!stored)
+                    break;
+                std::span<const std::byte> message(m_retransmit_buf.data(),
+                                                   stored->size);
+                if (protocol::MessageParser::header(message).topic() != topic)
+                    break;
+                auto sequence =
+                    protocol::MessageParser::prefix<protocol::Sequence>(
+                        message);
+                if (sequence.seq >= next_missing) {
+                    position = sequence.prev;
+                    continue;
+                }
+                if (sequence.seq + 1 != next_missing)
+                    break;
+
+                if (stored->complete) {
+                    send(endpoint, message);
+                    m_stats.retransmits.add();
+                } else {
+                    send_lost(endpoint, topic, nak, sequence.seq,
+                              sequence.seq);
+                }
+                next_missing = sequence.seq;
+                position = sequence.prev;
+            }
+        }
+        if (next_missing > nak.first)
+            send_lost(endpoint, topic, nak, nak.first, next_missing - 1);
+    }
+
+    void send_lost(const common::Endpoint& endpoint, protocol::Topic topic,
+                   const protocol::Nak& nak, uint64_t first, uint64_t last) {
+        m_stats.retransmit_misses.add(last - first + 1);
+        protocol::Nak lost{nak.epoch, nak.stream, first, last,
+                           protocol::no_position};
+        send(endpoint, protocol::Header::nak(topic),
+             std::span<const std::byte>((const std::byte*)&lost,
+                                        sizeof(lost)));
+    }
+
+    void handle_configure(const common::Endpoint& endpoint,
+                          std::span<const std::byte> data) {
+        const auto value = protocol::MessageParser::header(data).timestamp();
+        constexpr auto last =
+            static_cast<int64_t>(protocol::SlowConsumerPolicy::disconnect);
+        if (value < 0 || value > last)
+            throw std::runtime_error("invalid slow consumer policy");
+        const auto policy = static_cast<protocol::SlowConsumerPolicy>(value);
+
+        auto client = find_or_connect(endpoint);
+        const auto id = m_clients.client_id(client);
+        // subscribers repeat it with every heartbeat
+        const auto& policies = m_reader.get().policies;
+        if (id < policies.size() && policies[id] == policy)
+            return;
+        LOG_INFO(this->logger(), "[{}] slow consumer policy {}", endpoint.id(),
+                 value);
+        m_table.set_policy(id, policy);
+    }
+
+    // Sends a new subscription the cached value of every topic its pattern
+    // matches. A publish that another worker fans out before it sees the
+    // subscription is neither cached in time nor delivered, so it is missed
+    // until the topic's next publish.
+    void replay(const common::Endpoint& endpoint,
+                SubscriptionTable::ClientId owner, protocol::Topic pattern) {
+        m_cache.collect(pattern, m_replay);
+        if (m_replay.empty())
+            return;
+        LOG_DEBUG(this->logger(), "[{}] replaying {} cached values",
+                  endpoint.id(), m_replay.size());
+        for (std::size_t i = 0; i < m_replay.size(); i++) {
+            if (owner < m_egress.size() && m_egress[owner].backlogged)
+                enqueue(owner, endpoint, m_replay.topic(i), m_replay.data(i));
+            else
+                queue(endpoint, m_replay.data(i), owner, m_replay.topic(i));
+        }
+        // m_replay is reused by the next subscribe
+        flush();
+        m_stats.cache_replays.add(m_replay.size());
+    }
+
+    void cache(const protocol::Topic& topic, std::span<const std::byte> data) {
+        const auto stored = m_cache.store(m_id, topic, m_batch_start, data);
+        if (stored.evicted)
+            m_stats.cache_evictions.add(stored.evicted);
+        m_stats.cache_values.set(stored.values);
+        m_stats.cache_bytes.set(stored.bytes);
+    }
+
+    // queues a publish message, already in wire form, to every matching
+    // subscriber, sequencing it first when the worker keeps a ring; the
+    // unsequenced message is what the last-value cache keeps
+    void fanout(protocol::Topic topic, std::span<const std::byte> data) {
+        if (m_cache.enabled())
+            cache(topic, data);
+        if (m_ring)
+            data = sequence(topic, data);
+
+        const auto& subscriptions = m_reader.get();
+        if (m_seen.size() < subscriptions.endpoints.size())
+            m_seen.resize(subscriptions.endpoints.size(), 0);
+
+        // a client whose patterns overlap still gets one copy
+        const auto seq = ++m_publish_seq;
+        uint64_t reached = 0;
+        // group members first, so their unicast patterns are skipped below
+        for (const auto& group : subscriptions.groups) {
+            if (group.members.empty() || !topic.matches(group.pattern))
+                continue;
+            queue(group.endpoint, data);
+            for (auto member : group.members)
+                m_seen[member] = seq;
+            reached += group.members.size();
+        }
+        subscriptions.index.for_each_match(topic, [&](auto slot) {
+            const auto owner = subscriptions.owners[slot];
+            if (m_seen[owner] == seq || subscriptions.evicted[owner])
+                return;
+            m_seen[owner] = seq;
+            // behind its backlog, to keep its messages in order
+            if (owner < m_egress.size() && m_egress[owner].backlogged)
+                enqueue(owner, subscriptions.endpoints[owner], topic, data);
+            else
+                queue(subscriptions.endpoints[owner], data, owner, topic);
+            reached++;
+        });
+
+        m_stats.count_publish(topic.keys[0]);
+        m_stats.fanout_sizes.record(reached);
+    }
+
+    void journal(const common::Endpoint& source, const protocol::Topic& topic,
+                 std::span<const std::byte> message) {
+        const auto payload = message.subspan(sizeof(protocol::Header));
+        timespec now;
+        ::clock_gettime(CLOCK_REALTIME, &now);
+        const common::JournalRecord head{
+            common::JournalRecord::length_for(payload.size()),
+            static_cast<uint16_t>(payload.size()),
+            source.port_host_order(),
+            source.ip_host_order(),
+            0,
+            now.tv_sec * 1'000'000'000LL + now.tv_nsec,
+            topic};
+        if (m_journal->push(head, payload))
+            m_stats.journaled.add();
+        else
+            m_stats.journal_dropped.add();
+    }
+
+    void handle_publish(const common::Endpoint& endpoint,
+                        std::span<std::byte> data) {
+        auto topic = protocol::MessageParser::header(data).topic();
+        if (m_journal)
+            journal(endpoint, topic, data);
+
+        // subscribers get the received datagram as-is; the header is
+        // normalized once here rather than rebuilt per subscriber
+        protocol::MessageConstructor::rewrite(data,
+                                              protocol::Header::publish(topic));
+        fanout(topic, data);
+    }
+
+    // each record's prefix is rewritten into a publish header, turning the
+    // record into a standalone message that fans out from the receive buffer
+    void handle_batch(const common::Endpoint& endpoint,
+                      std::span<std::byte> data) {
+        protocol::MessageParser::for_each_record(
+            data, [&](protocol::Topic topic, std::span<std::byte> record) {
+                protocol::MessageConstructor::rewrite(
+                    record, protocol::Header::publish(topic));
+                if (m_journal)
+                    journal(endpoint, topic, record);
+                fanout(topic, record);
+            });
+    }
+
+    // replies with every worker's counters; reads are relaxed loads, so no
+    // worker is stalled to take the snapshot
+    void handle_stats(const common::Endpoint& endpoint) {
+        m_stats_reply.clear();
+        for (std::size_t i = 0; i < m_board.size(); i++)
+            m_stats_reply.push_back(m_board.at(i).snapshot());
+        send(endpoint, protocol::Header::stats(time_now()),
+             std::span<const std::byte>(
+                 (const std::byte*)m_stats_reply.data(),
+                 m_stats_reply.size() * sizeof(protocol::Stats)));
+    }
+
+    void handle_datagram(const common::Endpoint& from,
+                         std::span<std::byte> buf) {
+        m_stats.datagrams_in.add();
+        m_stats.bytes_in.add(buf.size());
+        try {
+            auto header = protocol::MessageParser::header(buf);
+            LOG_DEBUG(this->logger(), "[{}] > ({}) {} bytes", from.id(),
+                      (char)header.type(), buf.size());
+
+            switch (header.type()) {
+            case protocol::MessageType::heartbeat:
+                handle_heartbeat(from, buf);
+                break;
+            case protocol::MessageType::subscribe:
+                handle_subscribe(from, buf);
+                break;
+            case protocol::MessageType::unsubscribe:
+                handle_unsubscribe(from, buf);
+                break;
+            case protocol::MessageType::publish:
+                handle_publish(from, buf);
+                break;
+            case protocol::MessageType::batch:
+                handle_batch(from, buf);
+                break;
+            case protocol::MessageType::stats:
+                handle_stats(from);
+                break;
+            case protocol::MessageType::join:
+                handle_join(from, buf);
+                break;
+            case protocol::MessageType::nak:
+                handle_nak(from, buf);
+                break;
+            case protocol::MessageType::configure:
+                handle_configure(from, buf);
+                break;
+            default:
+                break;
+            }
+        } catch (const std::exception& e) {
+            m_stats.parse_failures.add();
+            LOG_ERROR(this->logger(), "parse failed with {}", e.what());
+        }
+    }
+
+    // runs before m_io exists, so uses nothing but its arguments and the
+    // logger
+    common::Socket open_socket(const common::Endpoint& endpoint,
+                               const ServerConfig& config) {
+        auto socket = common::Socket::open(/*non_blocking=*/true);
+        if (config.workers > 1)
+            socket.set_reuse_port(true);
+        if (config.busy_poll_us > 0)
+            socket.set_busy_poll(config.busy_poll_us);
+        if (config.gro && IO::supports_gro && !socket.enable_gro())
+            LOG_WARNING(this->logger(),
+                        "UDP_GRO unavailable, receiving datagrams one by one");
+        if (!config.multicast.empty()) {
+            if (!config.multicast_interface.empty())
+                socket.set_multicast_interface(config.multicast_interface);
+            socket.set_multicast_ttl(config.multicast_ttl);
+        }
+        socket.bind(endpoint);
+        return socket;
+    }
+
+  public:
+    void process() {
+        // subscription changes from any worker become visible here, between
+        // batches, so a fanout never sees a half-applied update
+        m_table.publish_if_dirty();
+        m_reader.refresh();
+
+        if (!m_backlog.empty())
+            drain_egress();
+
+        auto n = m_io.recv();
+        if (n == 0) {
+            // a worker that slept may owe an expiry tick; one that spins
+            // only checks every so often to keep clock reads off the loop.
+            // A backlog waits on the socket buffer rather than on traffic,
+            // so the worker keeps polling until it has drained.
+            wait_writable(!m_backlog.empty());
+            // a sleeping worker's snapshot would hold up the next republish
+            if (m_wait.will_block())
+                m_reader.release();
+            const bool slept = m_wait.idle();
+            m_reader.refresh();
+            if (slept || ++m_idle_polls % m_idle_tick_polls == 0) {
+                cache_time_now();
+                expire_clients();
+            }
+            return;
+        }
+
+        m_wait.reset();
+        m_batch_start = clock_now_ns();
+        cache_time_now();
+        m_stats.recv_calls.add();
+
+        for (std::size_t i = 0; i < n; i++) {
+            handle_datagram(m_io.from(i), m_io.data(i));
+        }
+        flush();
+
+        expire_clients();
+        m_stats.loop_ns.record(clock_now_ns() - m_batch_start);
+
+        if (time_now() > m_next_stats_log) {
+            m_next_stats_log = time_now() + m_stats_interval;
+            log_batch_stats();
+        }
+    }
+
+    // the worker's backend, e.g. to feed a fake IO in benchmarks
+    IO& io() noexcept { return m_io; }
+
+    void log_batch_stats() {
+        const auto stats = m_stats.snapshot();
+        const auto fill = [](uint64_t datagrams, uint64_t calls) {
+            return calls ? (double)datagrams / calls : 0.0;
+        };
+        LOG_INFO(this->logger(),
+                 "worker {}: recv batch fill {:.2f}/{} ({} calls), send batch "
+                 "fill {:.2f}/{} ({} calls)",
+                 m_id, fill(stats.datagrams_in, stats.recv_calls),
+                 m_io.capacity(), stats.recv_calls,
+                 fill(stats.datagrams_out, stats.send_calls),
+                 m_send_batch.capacity(), stats.send_calls);
+    }
+
+    Worker(std::size_t id, common::Endpoint endpoint, ServerConfig config,
+           SubscriptionTable& table, StatsBoard& board, RetransmitRings& rings,
+           LastValueCache& cache, Journal* journal, quill::Logger* logger)
+        : m_logger(logger), m_id(id), m_config(config), m_endpoint(endpoint),
+          m_io(open_socket(endpoint, config), m_config.batch_size),
+          m_send_batch(m_config.batch_size),
+          m_destinations(m_config.batch_size), m_wait(m_config.wait),
+          m_board(board), m_stats(board.at(id)), m_table(table),
+          m_reader(table), m_rings(rings), m_cache(cache),
+          m_leases(100, 128, clock_now()) {
+        m_wait.watch(m_io.fd());
+        // armed for writability by wait_writable() when backlogged
+        if (m_io.send_fd() != m_io.fd())
+            m_wait.watch(m_io.send_fd(), 0);
+        if (journal)
+            m_journal = &journal->queue(id);
+        if (m_config.egress_queue_depth == 0)
+            throw std::runtime_error("egress queue depth must be at least 1");
+        if (m_rings.enabled()) {
+            m_ring = &m_rings.at(id);
+            if (m_ring->slot_count() <= m_send_batch.capacity())
+                throw std::runtime_error("retransmit ring must be larger "
+                                         "than the send batch");
+            m_retransmit_buf.resize(m_ring->max_message());
+        }
+    }
+};
+
+template <typename IO> class Server {
+  private:
+    quill::Logger* m_logger;
+
+    quill::Logger* logger() { return m_logger; }
+    const quill::Logger* logger() const { return m_logger; }
+
+    ServerConfig m_config;
+    SubscriptionTable m_table;
+    StatsBoard m_stats;
+    RetransmitRings m_rings;
+    LastValueCache m_cache;
+    // outlives the workers, which push into it
+    std::optional<Journal> m_journal;
+    std::vector<std::unique_ptr<Worker<IO>>> m_workers;
+    std::atomic<bool> m_running{true};
+
+    static int64_t clock_seconds() {
+        return std::chrono::duration_cast<std::chrono::seconds>(
+                   std::chrono::system_clock::now().time_since_epoch())
+            .count();
+    }
+
+    void pin(std::size_t id) {
+        if (m_config.first_core < 0)
+            return;
+        const auto n_cores = std::max(1u, std::thread::hardware_concurrency());
+        const auto core = (m_config.first_core + id) % n_cores;
+
+        cpu_set_t cpus;
+        CPU_ZERO(&cpus);
+        CPU_SET(core, &cpus);
+        if (pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus) != 0) {
+            LOG_WARNING(this->logger(), "worker {}: failed to pin to core {}",
+                        id, core);
+            return;
+        }
+        LOG_INFO(this->logger(), "worker {}: pinned to core {}", id, core);
+    }
+
+  public:
+    Server(common::Endpoint endpoint, ServerConfig config = {})
+        : m_logger(quill::Frontend::create_or_get_logger(
+              "server", quill::Frontend::create_or_get_sink<quill::ConsoleSink>(
+                            "default"))),
+          m_config(config), m_table(m_config.multicast),
+          m_stats(config.workers),
+          m_rings(config.workers, config.retransmit_slots,
+                  config.retransmit_max_message,
+                  static_cast<uint32_t>(clock_seconds())),
+          m_cache(config.workers, config.last_value_cache_bytes,
+                  config.last_value_eviction) {
+        if (m_config.workers == 0)
+            throw std::runtime_error("server needs at least one worker");
+        if (!m_config.journal_dir.empty())
+            m_journal.emplace(m_config.journal_dir,
+                              m_config.journal_segment_bytes,
+                              m_config.workers, m_config.journal_queue_bytes);
+        for (std::size_t i = 0; i < m_config.workers; i++) {
+            m_workers.push_back(std::make_unique<Worker<IO>>(
+                i, endpoint, m_config, m_table, m_stats, m_rings, m_cache,
+                m_journal ? &*m_journal : nullptr, m_logger));
+        }
+    }
+
+    void run() {
+        LOG_INFO(this->logger(),
+                 "starting server ({} workers, {}, batch size {})",
+                 m_config.workers, IO::name, m_config.batch_size);
+
+        std::vector<std::thread> threads;
+        for (std::size_t i = 1; i < m_workers.size(); i++) {
+            threads.emplace_back([this, i]() {
+                pin(i);
+                while (m_running.load(std::memory_order_relaxed)) {
+                    m_workers[i]->process();
+                }
+            });
+        }
+
+        pin(0);
+        common::run_forever([&]() { m_workers[0]->process(); });
+
+        m_running.store(false, std::memory_order_relaxed);
+        for (auto& thread : threads) {
+            thread.join();
+        }
+
+        for (auto& worker : m_workers) {
+            worker->log_batch_stats();
+        }
+        LOG_INFO(this->logger(), "stopping server");
+    }
+};
+
+} // namespace ufan::server
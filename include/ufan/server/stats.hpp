@@ -0,0 +1,161 @@
+#pragma once
+
+#include <ufan/protocol/stats.hpp>
+
+#include <algorithm>
+#include <atomic>
+#include <bit>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <stdexcept>
+
+namespace ufan::server {
+
+// A counter with one writing thread. Increments are a relaxed load and
+// store rather than a locked read-modify-write, and any thread may read it
+// without stopping the writer.
+class Counter {
+  private:
+    std::atomic<uint64_t> m_value{0};
+
+  public:
+    void add(uint64_t n = 1) noexcept {
+        m_value.store(m_value.load(std::memory_order_relaxed) + n,
+                      std::memory_order_relaxed);
+    }
+    uint64_t load() const noexcept {
+        return m_value.load(std::memory_order_relaxed);
+    }
+};
+
+// A level set by one writing thread, e.g. a queue depth.
+class Gauge {
+  private:
+    std::atomic<uint64_t> m_value{0};
+
+  public:
+    void set(uint64_t value) noexcept {
+        m_value.store(value, std::memory_order_relaxed);
+    }
+    uint64_t load() const noexcept {
+        return m_value.load(std::memory_order_relaxed);
+    }
+};
+
+// Log2 histogram of Counters, see protocol::Stats for the bucketing.
+template <std::size_t N> class Log2Histogram {
+  private:
+    Counter m_buckets[N];
+
+  public:
+    void record(uint64_t value) noexcept {
+        m_buckets[std::min<std::size_t>(std::bit_width(value), N - 1)].add();
+    }
+    void load(uint64_t (&out)[N]) const noexcept {
+        for (std::size_t i = 0; i < N; i++)
+            out[i] = m_buckets[i].load();
+    }
+};
+
+// Counters written by one worker. Cache-line aligned so workers never share
+// a line.
+struct alignas(64) WorkerStats {
+    Counter datagrams_in;
+    Counter bytes_in;
+    Counter datagrams_out;
+    Counter bytes_out;
+    Counter recv_calls;
+    Counter send_calls;
+    Counter send_dropped;
+    Counter send_errors;
+    Counter parse_failures;
+    Counter connects;
+    Counter timeouts;
+    Counter publishes;
+    Counter naks;
+    Counter retransmits;
+    Counter retransmit_misses;
+    Counter egress_queued;
+    Counter egress_dropped;
+    Counter egress_conflated;
+    Counter evictions;
+    Gauge egress_depth;
+    Gauge cache_values;
+    Gauge cache_bytes;
+    Counter cache_evictions;
+    Counter cache_replays;
+    Counter journaled;
+    Counter journal_dropped;
+    Counter publishes_by_root[8];
+    Log2Histogram<protocol::Stats::fanout_buckets> fanout_sizes;
+    Log2Histogram<protocol::Stats::loop_buckets> loop_ns;
+
+    void count_publish(uint32_t root_key) noexcept {
+        publishes.add();
+        publishes_by_root[(root_key * 0x9e3779b9u) >> 29].add();
+    }
+
+    protocol::Stats snapshot() const noexcept {
+        protocol::Stats out{};
+        out.datagrams_in = datagrams_in.load();
+        out.bytes_in = bytes_in.load();
+        out.datagrams_out = datagrams_out.load();
+        out.bytes_out = bytes_out.load();
+        out.recv_calls = recv_calls.load();
+        out.send_calls = send_calls.load();
+        out.send_dropped = send_dropped.load();
+        out.send_errors = send_errors.load();
+        out.parse_failures = parse_failures.load();
+        out.connects = connects.load();
+        out.timeouts = timeouts.load();
+        out.publishes = publishes.load();
+        out.naks = naks.load();
+        out.retransmits = retransmits.load();
+        out.retransmit_misses = retransmit_misses.load();
+        out.egress_queued = egress_queued.load();
+        out.egress_dropped = egress_dropped.load();
+        out.egress_conflated = egress_conflated.load();
+        out.evictions = evictions.load();
+        out.egress_depth = egress_depth.load();
+        out.cache_values = cache_values.load();
+        out.cache_bytes = cache_bytes.load();
+        out.cache_evictions = cache_evictions.load();
+        out.cache_replays = cache_replays.load();
+        out.journaled = journaled.load();
+        out.journal_dropped = journal_dropped.load();
+        for (std::size_t i = 0; i < 8; i++)
+            out.publishes_by_root[i] = publishes_by_root[i].load();
+        fanout_sizes.load(out.fanout_sizes);
+        loop_ns.load(out.loop_ns);
+        return out;
+    }
+};
+
+// Every worker's stats, owned by the server and shared by reference like
+// the SubscriptionTable. Worker i writes only at(i); any worker can
+// snapshot all of them to answer a stats request.
+class StatsBoard {
+  private:
+    std::unique_ptr<WorkerStats[]> m_stats;
+    std::size_t m_size;
+
+  public:
+    explicit StatsBoard(std::size_t workers)
+        : m_stats(std::make_unique<WorkerStats[]>(workers)), m_size(workers) {}
+
+    std::size_t size() const noexcept { return m_size; }
+
+    WorkerStats& at(std::size_t worker) {
+        if (worker >= m_size)
+            throw std::runtime_error("invalid worker id");
+        return m_stats[worker];
+    }
+    const WorkerStats& at(std::size_t worker) const {
+        if (worker >= m_size)
+            throw std::runtime_error("invalid worker id");
+        return m_stats[worker];
+    }
+};
+
+} // namespace ufan::server
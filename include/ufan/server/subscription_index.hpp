@@ -0,0 +1,162 @@
+#pragma once
+
+#include <ufan/protocol/header.hpp>
+
+#include <algorithm>
+#include <array>
+#include <bit>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace ufan::server {
+
+// Inverted index from subscription patterns to client slots.
+//
+// Topic::matches accepts a level when the subscriber's key has every bit of
+// the published key p, so at that level the matching subscribers are:
+//   p == 0: exactly the subscribers whose key is 0
+//   p != 0: those with each bit of p set, wildcards included
+// Each (level, bit) pair, plus the zero case, gets a bitmap over slots. A
+// publish ANDs the bitmaps of p's bits (or the zero bitmap) at every level.
+// Every bitmap keeps a summary word per 64 data words so that runs of
+// slots with no candidates are skipped without being touched.
+class SubscriptionIndex {
+  public:
+    using Slot = uint32_t;
+
+  private:
+    static constexpr std::size_t n_levels = protocol::Topic::levels;
+    static constexpr std::size_t n_bits = 32;
+
+    struct Bitmap {
+        std::vector<uint64_t> words;
+        std::vector<uint64_t> summary;
+
+        void resize(std::size_t n_words) {
+            words.resize(n_words, 0);
+            summary.resize((n_words + 63) / 64, 0);
+        }
+
+        void set(Slot slot) {
+            const std::size_t w = slot / 64;
+            words[w] |= uint64_t(1) << (slot % 64);
+            summary[w / 64] |= uint64_t(1) << (w % 64);
+        }
+
+        void reset(Slot slot) {
+            const std::size_t w = slot / 64;
+            words[w] &= ~(uint64_t(1) << (slot % 64));
+            if (words[w] == 0)
+                summary[w / 64] &= ~(uint64_t(1) << (w % 64));
+        }
+    };
+
+    struct Level {
+        std::array<Bitmap, n_bits> bits;
+        Bitmap zero;
+    };
+
+    std::array<Level, n_levels> m_levels;
+    std::vector<protocol::Topic> m_topics;
+    std::vector<uint8_t> m_present;
+    std::size_t m_size = 0;
+
+    template <typename F> void for_each_bitmap(Slot slot, F&& f) {
+        const auto& topic = m_topics[slot];
+        for (std::size_t i = 0; i < n_levels; i++) {
+            const uint32_t key = topic.keys[i];
+            if (key == 0)
+                f(m_levels[i].zero);
+            for (uint32_t k = key; k; k &= k - 1)
+                f(m_levels[i].bits[std::countr_zero(k)]);
+        }
+    }
+
+    void grow(Slot slot) {
+        if (slot < m_topics.size())
+            return;
+        std::size_t n_slots = std::max<std::size_t>(m_topics.size() * 2, 64);
+        while (n_slots <= slot)
+            n_slots *= 2;
+        const std::size_t n_words = n_slots / 64;
+        for (auto& level : m_levels) {
+            for (auto& bitmap : level.bits)
+                bitmap.resize(n_words);
+            level.zero.resize(n_words);
+        }
+        m_topics.resize(n_slots);
+        m_present.resize(n_slots, 0);
+    }
+
+
+  public:
+    std::size_t size() const noexcept { return m_size; }
+
+    bool contains(Slot slot) const noexcept {
+        return slot < m_present.size() && m_present[slot];
+    }
+
+    // adds slot with topic, replacing any previous topic for that slot
+    void insert(Slot slot, protocol::Topic topic) {
+        erase(slot);
+        grow(slot);
+        m_topics[slot] = topic;
+        m_present[slot] = 1;
+        ++m_size;
+        for_each_bitmap(slot, [&](Bitmap& bitmap) { bitmap.set(slot); });
+    }
+
+    void erase(Slot slot) {
+        if (!contains(slot))
+            return;
+        for_each_bitmap(slot, [&](Bitmap& bitmap) { bitmap.reset(slot); });
+        m_present[slot] = 0;
+        --m_size;
+    }
+
+    // calls f(slot) for every slot whose topic matches published; f must not
+    // insert into the index
+    template <typename F>
+    void for_each_match(protocol::Topic published, F&& f) const {
+        if (m_size == 0)
+            return;
+
+        // every bitmap a slot must be in, across all levels
+        std::array<const Bitmap*, n_levels * n_bits> selected;
+        std::size_t count = 0;
+        for (std::size_t i = 0; i < n_levels; i++) {
+            const uint32_t key = published.keys[i];
+            const auto& level = m_levels[i];
+            if (key == 0) {
+                selected[count++] = &level.zero;
+                continue;
+            }
+            for (uint32_t k = key; k; k &= k - 1)
+                selected[count++] = &level.bits[std::countr_zero(k)];
+        }
+
+        const std::size_t n_summary = m_levels[0].zero.summary.size();
+        for (std::size_t s = 0; s < n_summary; s++) {
+            uint64_t candidates = ~uint64_t(0);
+            for (std::size_t j = 0; j < count && candidates; j++)
+                candidates &= selected[j]->summary[s];
+
+            while (candidates) {
+                const std::size_t w = s * 64 + std::countr_zero(candidates);
+                candidates &= candidates - 1;
+
+                uint64_t matches = ~uint64_t(0);
+                for (std::size_t j = 0; j < count && matches; j++)
+                    matches &= selected[j]->words[w];
+
+                while (matches) {
+                    f(static_cast<Slot>(w * 64 + std::countr_zero(matches)));
+                    matches &= matches - 1;
+                }
+            }
+        }
+    }
+};
+
+} // namespace ufan::server
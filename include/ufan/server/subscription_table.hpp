@@ -0,0 +1,339 @@
+#pragma once
+
+#include <ufan/common/socket.hpp>
+#include <ufan/protocol/header.hpp>
+#include <ufan/server/subscription_index.hpp>
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <span>
+#include <vector>
+
+namespace ufan::server {
+
+// Publishes matching pattern are sent once to group. Subscribers of exactly
+// pattern are told the group and, once they confirm they joined it, are
+// left out of unicast fanout for that subscription.
+struct MulticastRoute {
+    protocol::Topic pattern;
+    common::Endpoint group;
+};
+
+// Subscription state shared by every server worker.
+//
+// Each client (endpoint) gets a ClientId and each of its subscriptions a
+// Slot in the index; owners maps slots back to clients so a fanout can send
+// once per client however many of its patterns match.
+//
+// Writers (connects, subscribes, expiries) serialize on a mutex and log
+// each change. Readers fan out from an immutable snapshot and only touch
+// the shared pointer when the version counter moves, so the publish path
+// never waits on a writer. There are two snapshots: the published one and
+// a spare that the next republish brings up to date by replaying the
+// changes since it was last published, then swaps in. The spare can only
+// be edited once no reader still holds it from before the last swap, so a
+// republish waits for every reader to refresh at least once; a reader
+// that is about to sleep releases its snapshot.
+//
+// A subscription whose client joined its multicast group leaves the index
+// and becomes a member of the group instead; a fanout sends the group one
+// copy and marks every member as reached.
+class SubscriptionTable {
+  public:
+    using Slot = SubscriptionIndex::Slot;
+    using ClientId = uint32_t;
+
+    struct Snapshot {
+        SubscriptionIndex index;
+        // subscription slot -> owning client
+        std::vector<ClientId> owners;
+        // client -> endpoint
+        std::vector<common::Endpoint> endpoints;
+        // client -> the policy it asked for
+        std::vector<protocol::SlowConsumerPolicy> policies;
+        // client -> 1 once a worker has given up on it as a slow consumer;
+        // the worker owning the client drops it on its next heartbeat
+        std::vector<uint8_t> evicted;
+        // one per MulticastRoute, in configuration order
+        struct Group {
+            protocol::Topic pattern;
+            common::Endpoint endpoint;
+            std::vector<ClientId> members;
+        };
+        std::vector<Group> groups;
+    };
+
+    class Reader {
+      private:
+        const SubscriptionTable* m_table;
+        std::shared_ptr<const Snapshot> m_snapshot;
+        uint64_t m_version = 0;
+
+      public:
+        explicit Reader(const SubscriptionTable& table) : m_table(&table) {
+            m_version = m_table->m_version.load(std::memory_order_acquire);
+            m_snapshot = m_table->m_snapshot.load(std::memory_order_acquire);
+        }
+
+        // picks up the latest snapshot; references from an earlier get()
+        // are invalidated
+        void refresh() {
+            auto version = m_table->m_version.load(std::memory_order_acquire);
+            if (version == m_version)
+                return;
+            m_snapshot = m_table->m_snapshot.load(std::memory_order_acquire);
+            m_version = version;
+        }
+
+        // lets go of the snapshot, e.g. before sleeping, so a republish
+        // need not wait for this reader; get() is invalid until the next
+        // refresh()
+        void release() noexcept {
+            m_snapshot.reset();
+            m_version = ~uint64_t(0);
+        }
+
+        const Snapshot& get() const noexcept { return *m_snapshot; }
+    };
+
+  private:
+    // subscription slot -> index in groups, or no_group
+    static constexpr uint32_t no_group = ~uint32_t(0);
+
+    // one logged change, replayed onto each snapshot in turn
+    struct Change {
+        enum class Kind : uint8_t {
+            add_client,
+            subscribe,
+            unsubscribe,
+            set_policy,
+            evict,
+            join,
+        };
+        Kind kind;
+        // the client, or the slot for subscribe, unsubscribe and join
+        uint32_t id = 0;
+        // subscribe: the owning client; unsubscribe and join: the group
+        uint32_t arg = 0;
+        protocol::Topic topic{};
+        common::Endpoint endpoint{};
+        protocol::SlowConsumerPolicy policy{};
+    };
+
+    static void apply(Snapshot& snapshot, const Change& change) {
+        switch (change.kind) {
+        case Change::Kind::add_client:
+            // ids are handed out in order, so a new one is always the next
+            if (change.id == snapshot.endpoints.size()) {
+                snapshot.endpoints.emplace_back();
+                snapshot.policies.emplace_back();
+                snapshot.evicted.emplace_back();
+            }
+            snapshot.endpoints[change.id] = change.endpoint;
+            snapshot.policies[change.id] =
+                protocol::SlowConsumerPolicy::server_default;
+            snapshot.evicted[change.id] = 0;
+            break;
+        case Change::Kind::subscribe:
+            if (change.id == snapshot.owners.size())
+                snapshot.owners.emplace_back();
+            snapshot.owners[change.id] = change.arg;
+            snapshot.index.insert(change.id, change.topic);
+            break;
+        case Change::Kind::unsubscribe:
+            if (change.arg != no_group) {
+                auto& members = snapshot.groups[change.arg].members;
+                auto it = std::find(members.begin(), members.end(),
+                                    snapshot.owners[change.id]);
+                if (it != members.end()) {
+                    *it = members.back();
+                    members.pop_back();
+                }
+            }
+            snapshot.index.erase(change.id);
+            break;
+        case Change::Kind::set_policy:
+            snapshot.policies[change.id] = change.policy;
+            break;
+        case Change::Kind::evict:
+            snapshot.evicted[change.id] = 1;
+            break;
+        case Change::Kind::join:
+            snapshot.index.erase(change.id);
+            snapshot.groups[change.arg].members.push_back(
+                snapshot.owners[change.id]);
+            break;
+        }
+    }
+
+    std::mutex m_mutex;
+    // changes not yet in the published snapshot
+    std::vector<Change> m_changes;
+    // changes in the published snapshot but not yet in the spare
+    std::vector<Change> m_replay;
+    std::shared_ptr<Snapshot> m_published;
+    std::shared_ptr<Snapshot> m_spare;
+
+    // what writers need to hand out ids and log changes, kept apart from
+    // the snapshots
+    ClientId m_n_clients = 0;
+    std::vector<ClientId> m_free_clients;
+    std::vector<uint8_t> m_evicted;
+    std::vector<Slot> m_free_slots;
+    std::vector<uint32_t> m_slot_groups;
+    // fixed at construction
+    std::vector<protocol::Topic> m_group_patterns;
+
+    void log(const Change& change) {
+        m_changes.push_back(change);
+        m_dirty.store(true, std::memory_order_release);
+    }
+
+    void unsubscribe_locked(Slot slot) {
+        log({.kind = Change::Kind::unsubscribe,
+             .id = slot,
+             .arg = m_slot_groups[slot]});
+        m_slot_groups[slot] = no_group;
+        m_free_slots.push_back(slot);
+    }
+
+    std::atomic<bool> m_dirty{false};
+    std::atomic<uint64_t> m_version{0};
+    std::atomic<std::shared_ptr<const Snapshot>> m_snapshot;
+
+  public:
+    explicit SubscriptionTable(std::span<const MulticastRoute> routes = {}) {
+        Snapshot empty;
+        for (const auto& route : routes) {
+            empty.groups.push_back({route.pattern, route.group, {}});
+            m_group_patterns.push_back(route.pattern);
+        }
+        m_published = std::make_shared<Snapshot>(empty);
+        m_spare = std::make_shared<Snapshot>(std::move(empty));
+        m_snapshot.store(m_published);
+    }
+
+    SubscriptionTable(const SubscriptionTable&) = delete;
+    SubscriptionTable& operator=(const SubscriptionTable&) = delete;
+
+    ClientId add_client(const common::Endpoint& endpoint) {
+        std::lock_guard lock(m_mutex);
+        ClientId client;
+        if (m_free_clients.empty()) {
+            client = m_n_clients++;
+            m_evicted.push_back(0);
+        } else {
+            client = m_free_clients.back();
+            m_free_clients.pop_back();
+            m_evicted[client] = 0;
+        }
+        log({.kind = Change::Kind::add_client,
+             .id = client,
+             .endpoint = endpoint});
+        return client;
+    }
+
+    // drops the client along with its subscription slots
+    void remove_client(ClientId client, std::span<const Slot> slots) {
+        std::lock_guard lock(m_mutex);
+        for (auto slot : slots)
+            unsubscribe_locked(slot);
+        m_free_clients.push_back(client);
+    }
+
+    Slot subscribe(ClientId client, protocol::Topic topic) {
+        std::lock_guard lock(m_mutex);
+        Slot slot;
+        if (m_free_slots.empty()) {
+            slot = m_slot_groups.size();
+            m_slot_groups.push_back(no_group);
+        } else {
+            slot = m_free_slots.back();
+            m_free_slots.pop_back();
+        }
+        log({.kind = Change::Kind::subscribe,
+             .id = slot,
+             .arg = client,
+             .topic = topic});
+        return slot;
+    }
+
+    void unsubscribe(Slot slot) {
+        std::lock_guard lock(m_mutex);
+        unsubscribe_locked(slot);
+    }
+
+    void set_policy(ClientId client, protocol::SlowConsumerPolicy policy) {
+        std::lock_guard lock(m_mutex);
+        log({.kind = Change::Kind::set_policy, .id = client, .policy = policy});
+    }
+
+    // asks the worker owning client to drop it; any worker may call this
+    void evict(ClientId client) {
+        std::lock_guard lock(m_mutex);
+        if (m_evicted[client])
+            return;
+        m_evicted[client] = 1;
+        log({.kind = Change::Kind::evict, .id = client});
+    }
+
+    // the group carrying subscriptions to topic, if one is configured;
+    // patterns are fixed at construction, so this takes no lock
+    std::optional<std::size_t> group_for(protocol::Topic topic) const {
+        for (std::size_t i = 0; i < m_group_patterns.size(); i++)
+            if (m_group_patterns[i] == topic)
+                return i;
+        return std::nullopt;
+    }
+
+    // moves a subscription from the index into group, once its client has
+    // joined the group
+    void join(Slot slot, std::size_t group) {
+        std::lock_guard lock(m_mutex);
+        if (m_slot_groups[slot] != no_group)
+            return;
+        m_slot_groups[slot] = static_cast<uint32_t>(group);
+        log({.kind = Change::Kind::join,
+             .id = slot,
+             .arg = static_cast<uint32_t>(group)});
+    }
+
+    // Publishes any logged changes. Any worker may call this; if another
+    // thread holds the mutex, or a reader is still on the spare snapshot,
+    // it returns immediately and the changes go out with a later call.
+    //
+    // The spare is brought up to date by replaying the changes it missed,
+    // so a republish costs the changes since the one before last rather
+    // than a copy of the table; server/subscribe-churn in
+    // bench/fanout.cpp times it.
+    void publish_if_dirty() {
+        if (!m_dirty.load(std::memory_order_acquire))
+            return;
+        std::unique_lock lock(m_mutex, std::try_to_lock);
+        if (!lock.owns_lock())
+            return;
+        if (m_spare.use_count() > 1)
+            return;
+        // pairs with the release in the last reader's drop of the spare
+        std::atomic_thread_fence(std::memory_order_acquire);
+
+        for (const auto& change : m_replay)
+            apply(*m_spare, change);
+        for (const auto& change : m_changes)
+            apply(*m_spare, change);
+        m_replay.swap(m_changes);
+        m_changes.clear();
+        m_dirty.store(false, std::memory_order_relaxed);
+
+        m_snapshot.store(m_spare, std::memory_order_release);
+        m_version.fetch_add(1, std::memory_order_release);
+        std::swap(m_published, m_spare);
+    }
+};
+
+} // namespace ufan::server
@@ -0,0 +1,77 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <stdexcept>
+#include <utility>
+#include <vector>
+
+namespace ufan::server {
+
+// Hashed timing wheel for lease expiry.
+//
+// Keys are bucketed by deadline into n_slots slots of tick_ms each. advance
+// walks only the slots whose time has passed and hands their keys to the
+// caller, which either expires the key or reschedules it. Renewing a lease
+// therefore doesn't touch the wheel at all: the caller records the new
+// deadline itself and reschedules lazily when the old slot comes due, so
+// each live key costs O(1) per timeout period. Deadlines beyond the wheel's
+// span are parked in the furthest slot and rescheduled from there.
+template <typename Key> class TimerWheel {
+  private:
+    int64_t m_tick_ms;
+    std::vector<std::vector<Key>> m_slots;
+    std::vector<Key> m_due;
+    int64_t m_current_tick;
+    std::size_t m_size = 0;
+
+    std::size_t slot_of(int64_t tick) const noexcept {
+        return static_cast<std::size_t>(tick) % m_slots.size();
+    }
+
+  public:
+    TimerWheel(int64_t tick_ms, std::size_t n_slots, int64_t now)
+        : m_tick_ms(tick_ms), m_slots(n_slots), m_current_tick(now / tick_ms) {
+        if (tick_ms <= 0 || n_slots < 2)
+            throw std::runtime_error("invalid TimerWheel geometry");
+    }
+
+    std::size_t size() const noexcept { return m_size; }
+    int64_t span_ms() const noexcept {
+        return m_tick_ms * static_cast<int64_t>(m_slots.size() - 1);
+    }
+
+    // key comes due no earlier than deadline, and at most one tick late
+    void schedule(Key key, int64_t deadline) {
+        int64_t tick = (deadline + m_tick_ms - 1) / m_tick_ms;
+        if (tick <= m_current_tick)
+            tick = m_current_tick + 1;
+        const int64_t last = m_current_tick + (int64_t)m_slots.size() - 1;
+        if (tick > last)
+            tick = last;
+        m_slots[slot_of(tick)].push_back(std::move(key));
+        ++m_size;
+    }
+
+    // Calls on_due(key) for every key whose slot is at or before now. Keys
+    // may be rescheduled from inside on_due.
+    template <typename F> void advance(int64_t now, F&& on_due) {
+        const int64_t target = now / m_tick_ms;
+        // after a long stall one lap of the wheel visits every slot
+        if (target - m_current_tick > (int64_t)m_slots.size())
+            m_current_tick = target - (int64_t)m_slots.size();
+        while (m_current_tick < target) {
+            ++m_current_tick;
+            auto& slot = m_slots[slot_of(m_current_tick)];
+            if (slot.empty())
+                continue;
+            m_due.swap(slot);
+            m_size -= m_due.size();
+            for (auto& key : m_due)
+                on_due(key);
+            m_due.clear();
+        }
+    }
+};
+
+} // namespace ufan::server